@@ -37,19 +37,21 @@
 #include <rom/gpio.h>
 #endif
 
-#include <set>
+#include <new>
+#include <vector>
 
 using namespace std;
 
 #define TAG MODULE_ACTION
 
-bool operator < (const Action &l, const Action &r)
-{ return strcmp(l.name,r.name) < 0; }
+// Actions are allocated in chunks that are never freed, so Action
+// pointers and handles stay valid. Handles are 1-based indices into the
+// chunks, Sorted holds all handles in name order for lookups.
+#define ACTION_CHUNK 32
 
-bool operator < (const Action &l, const char *r)
-{ return strcmp(l.name,r) < 0; }
-
-static set<Action,less<Action>> Actions;
+static vector<Action *> Chunks;
+static vector<action_t> Sorted;
+static action_t NumActions = 0;
 static event_t ActionTriggerEvt = 0;
 
 
@@ -72,6 +74,41 @@ Action::Action(const char *n, void (*f)(void*),void *a, const char *t)
 }
 #endif
 
+// statistics are updated lock-free, as actions may run concurrently on
+// the event workers
+#ifdef ESP32
+#define stat_inc(v,x) __atomic_fetch_add(&(v),x,__ATOMIC_RELAXED)
+#define stat_set(v,x) __atomic_store_n(&(v),x,__ATOMIC_RELAXED)
+#else
+#define stat_inc(v,x) ((v) += (x))
+#define stat_set(v,x) ((v) = (x))
+#endif
+
+
+static inline void stat_min(uint32_t &v, uint32_t x)
+{
+#ifdef ESP32
+	uint32_t o = __atomic_load_n(&v,__ATOMIC_RELAXED);
+	while ((x < o) && !__atomic_compare_exchange_n(&v,&o,x,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+#else
+	if (x < v)
+		v = x;
+#endif
+}
+
+
+static inline void stat_max(uint32_t &v, uint32_t x)
+{
+#ifdef ESP32
+	uint32_t o = __atomic_load_n(&v,__ATOMIC_RELAXED);
+	while ((x > o) && !__atomic_compare_exchange_n(&v,&o,x,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+#else
+	if (x > v)
+		v = x;
+#endif
+}
+
+
 void Action::activate(void *a)
 {
 	if (arg != 0)
@@ -81,31 +118,113 @@ void Action::activate(void *a)
 	uint64_t st = esp_timer_get_time();
 	func(a);
 	uint64_t end = esp_timer_get_time();
-	++num;
-	unsigned dt = end - st;
-	sum += dt;
-	if (dt < min)
-		min = dt;
-	else if (dt > max)
-		max = dt;
+	uint32_t dt = end - st;
+	stat_inc(num,1);
+	stat_inc(sum,(uint64_t)dt);
+	stat_min(min,dt);
+	stat_max(max,dt);
+	unsigned b = 0;
+	uint32_t x = dt >> 5;
+	while (x && (b < ACTION_BUCKETS-1)) {
+		x >>= 1;
+		++b;
+	}
+	stat_inc(hist[b],1);
 }
 
 
-Action *action_get(const char *name)
+uint32_t Action::percentile(unsigned p) const
+{
+	uint32_t h[ACTION_BUCKETS], n = 0;
+	for (unsigned b = 0; b < ACTION_BUCKETS; ++b) {
+		h[b] = hist[b];
+		n += h[b];
+	}
+	if (n == 0)
+		return 0;
+	uint32_t t = (uint64_t)n * p / 100, s = 0;
+	if (t == 0)
+		t = 1;
+	for (unsigned b = 0; b < ACTION_BUCKETS-1; ++b) {
+		s += h[b];
+		if (s >= t)
+			return 1 << (b+5);
+	}
+	// last bucket is open, the maximum is its best bound
+	return max;
+}
+
+
+void Action::reset()
 {
-	Action x(name);
-	if (const char *sp = strchr(name,' '))  {
-		size_t l = sp-name;
-		char *tmp = (char *)alloca(l+1);
-		memcpy(tmp,name,l);
-		tmp[l] = 0;
-		x.name = tmp;
+	stat_set(num,0);
+	stat_set(sum,0);
+	stat_set(min,UINT32_MAX);
+	stat_set(max,0);
+	for (unsigned b = 0; b < ACTION_BUCKETS; ++b)
+		stat_set(hist[b],0);
+}
+
+
+Action *action_from_handle(action_t h)
+{
+	if ((h == 0) || (h > NumActions))
+		return 0;
+	--h;
+	return Chunks[h/ACTION_CHUNK] + h%ACTION_CHUNK;
+}
+
+
+// compares action name an to the l bytes at n
+static int action_cmp(const char *an, const char *n, size_t l)
+{
+	int r = strncmp(an,n,l);
+	if ((r == 0) && (an[l] != 0))
+		r = 1;
+	return r;
+}
+
+
+// returns the position of n in Sorted or the position to insert it
+static size_t action_find(const char *n, size_t l, bool *found)
+{
+	size_t lo = 0, hi = Sorted.size();
+	*found = false;
+	while (lo < hi) {
+		size_t m = (lo + hi) >> 1;
+		int c = action_cmp(action_from_handle(Sorted[m])->name,n,l);
+		if (c < 0) {
+			lo = m + 1;
+		} else {
+			if (c == 0)
+				*found = true;
+			hi = m;
+		}
 	}
-	auto i = Actions.find(x);
-	if (i != Actions.end())
-		return (Action*)&(*i);
+	return lo;
+}
+
+
+action_t action_handle_n(const char *name, size_t l)
+{
+	bool found;
+	size_t at = action_find(name,l,&found);
+	return found ? Sorted[at] : 0;
+}
+
+
+action_t action_handle(const char *name)
+{
+	// ignore argument after space
+	const char *sp = strchr(name,' ');
+	return action_handle_n(name,sp ? sp-name : strlen(name));
+}
+
+
+Action *action_get(const char *name)
+{
 	// no warning here, because it is used to add new actions
-	return 0;
+	return action_from_handle(action_handle(name));
 }
 
 
@@ -123,14 +242,42 @@ int action_exists(const char *name)
 
 Action *action_add(const char *name, void (*func)(void *), void *arg, const char *text)
 {
-	if (name) {
-		if (0 == action_get(name)) {
-			log_dbug(TAG,"add %s",name);
-			return (Action*) &(*Actions.emplace(name,func,arg,text).first);
-		}
+	if (name == 0)
+		return 0;
+	bool found;
+	size_t at = action_find(name,strlen(name),&found);
+	if (found) {
 		log_warn(TAG,"action exists: %s",name);
+		return 0;
+	}
+	if (NumActions == UINT16_MAX) {
+		log_warn(TAG,"too many actions");
+		return 0;
 	}
-	return 0;
+	if ((NumActions % ACTION_CHUNK) == 0) {
+		Action *c = (Action *) malloc(sizeof(Action)*ACTION_CHUNK);
+		if (c == 0) {
+			log_error(TAG,"out of memory adding %s",name);
+			return 0;
+		}
+		Chunks.push_back(c);
+	}
+	Action *a = Chunks.back() + NumActions % ACTION_CHUNK;
+	new (a) Action(name,func,arg,text);
+	++NumActions;
+	Sorted.insert(Sorted.begin()+at,NumActions);
+	log_dbug(TAG,"add %s",name);
+	return a;
+}
+
+
+int action_activate_h(action_t h, void *arg)
+{
+	if (Action *a = action_from_handle(h)) {
+		a->activate(arg);
+		return 0;
+	}
+	return 1;
 }
 
 
@@ -160,43 +307,72 @@ void action_dispatch(const char *name, size_t l)
 {
 	if (l == 0)
 		l = strlen(name);
-	char *arg = (char *) malloc(l+1);
-	arg[l] = 0;
-	memcpy(arg,name,l);
-	event_trigger_arg(ActionTriggerEvt,arg);
+	const char *sp = (const char *) memchr(name,' ',l);
+	size_t nl = sp ? sp-name : l;
+	action_t h = action_handle_n(name,nl);
+	if (h == 0) {
+		log_warn(TAG,"unknown action %.*s",(int)nl,name);
+		return;
+	}
+	char *arg = 0;
+	if (sp) {
+		size_t al = l - nl - 1;
+		arg = (char *) malloc(al+1);
+		if (arg == 0) {
+			log_warn(TAG,"out of memory dispatching %.*s",(int)nl,name);
+			return;
+		}
+		memcpy(arg,sp+1,al);
+		arg[al] = 0;
+	}
+	event_trigger_action(ActionTriggerEvt,h,arg,true);
+}
+
+
+void action_dispatch_h(action_t h, const char *arg)
+{
+	event_trigger_action(ActionTriggerEvt,h,(void*)arg,false);
 }
 
 
 void action_iterate(void (*f)(void*,const Action *),void *p)
 {
-	for (const Action &a : Actions)
-		f(p,&a);
+	for (action_t h : Sorted)
+		f(p,action_from_handle(h));
+}
+
+
+void action_stats_reset()
+{
+	for (action_t h : Sorted)
+		action_from_handle(h)->reset();
 }
 
 
 static void action_event_cb(void *arg)
 {
+	// arg stays valid until the callback returns
 	const char *as = (const char *)arg;
-	size_t al = strlen(as);
-	char tmp[al+1];
-	memcpy(tmp,as,sizeof(tmp));
-	char *sp = strchr(tmp,' ');
-	if (sp) {
-		*sp = 0;
-		++sp;
-	}
-	if (Action *a = action_get(tmp)) {
-		log_dbug(TAG,"action %s (%s)",a->name,sp?sp:"");
-		a->activate(sp);
+	if (as == 0)
+		return;
+	const char *sp = strchr(as,' ');
+	size_t nl = sp ? sp-as : strlen(as);
+	if (Action *a = action_from_handle(action_handle_n(as,nl))) {
+		log_dbug(TAG,"action %s (%s)",a->name,sp?sp+1:"");
+		event_activate(a,(void*)(sp ? sp+1 : 0));
 	} else {
-		log_warn(TAG,"unknown action %s",tmp);
+		log_warn(TAG,"unknown action %.*s",(int)nl,as);
 	}
 }
 
 
 void action_setup()
 {
+	// dispatched actions are carried by action`trigger and activated
+	// directly, so action!execute is no longer bound to it
 	ActionTriggerEvt = event_register("action`trigger");
-	Action *a = action_add("action!execute",action_event_cb,0,0);
-	event_callback(ActionTriggerEvt,a);
+	if (Action *a = action_add("action!execute",action_event_cb,0,0)) {
+		// serializes the executed action itself, if necessary
+		a->concurrent = true;
+	}
 }
@@ -22,6 +22,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// stable handle of a registered action, 0 is invalid
+typedef uint16_t action_t;
+
+// runtime histogram: bucket i counts runtimes below 2^(i+5)us,
+// the last bucket everything above
+#define ACTION_BUCKETS 16
+
 #ifdef __cplusplus
 
 class Action
@@ -29,7 +36,10 @@ class Action
 	public:
 	const char *name;
 	const char *text = 0;	// descriptive help text
-	uint32_t min = UINT32_MAX, max = 0, sum = 0, num = 0;
+	uint32_t min = UINT32_MAX, max = 0, num = 0;
+	uint64_t sum = 0;	// total runtime in us
+	uint32_t hist[ACTION_BUCKETS] = {0};
+	bool concurrent = false;	// may run in parallel to other actions on event workers
 
 	Action(const char *n)
 	: name(n)
@@ -44,6 +54,9 @@ class Action
 	{ }
 
 	void activate(void * = 0);
+	// upper bound in us of the bucket that covers p percent of all runs
+	uint32_t percentile(unsigned p) const;
+	void reset();
 
 	private:
 	void (*func)(void *);
@@ -61,11 +74,18 @@ const char *action_get_name(size_t);
 const char *action_get_text(size_t);
 const char *action_text(const char *name);
 Action *action_get(const char *name);
+action_t action_handle(const char *name);	// ignores argument after ' '
+action_t action_handle_n(const char *name, size_t l);
+Action *action_from_handle(action_t);
 int action_activate(const char *name);
 int action_activate_arg(const char *name, void *arg);
+int action_activate_h(action_t, void *arg);
 void action_dispatch(const char *name, size_t l);	// execute action via event queue
+// execute action via event queue, arg is not copied and must stay valid
+void action_dispatch_h(action_t, const char *arg);
 //int action_exists(const char *name);
 void action_iterate(void (*)(void*,const Action *),void *);
+void action_stats_reset();
 void actions_setup();
 
 #ifdef __cplusplus
@@ -19,6 +19,8 @@
 #include <sdkconfig.h>
 
 #include "cyclic.h"
+#include "env.h"
+#include "event.h"
 #include "log.h"
 #include "strstream.h"
 #include "terminal.h"
@@ -34,6 +36,7 @@
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
+#include <algorithm>
 #include <vector>
 
 #if!defined APP_CPU_NUM || defined CONFIG_FREERTOS_UNICORE
@@ -42,14 +45,22 @@
 #define CYCLIC_CPU_NUM APP_CPU_NUM
 #endif
 
+#ifndef CONFIG_CYCLIC_BUDGET_MS
+#define CONFIG_CYCLIC_BUDGET_MS 50
+#endif
+
 using namespace std;
 
 #define TAG MODULE_CYCLIC
 
 
+// lateness histogram: bucket i counts start delays below 2^(i+8)us,
+// the last bucket everything above
+#define LATE_BUCKETS 12
+
 struct SubTask
 {
-	SubTask(const char *n, unsigned(*c)(void*), void *a, unsigned nr)
+	SubTask(const char *n, unsigned(*c)(void*), void *a, uint64_t nr)
 	: name(n)
 	, code(c)
 	, arg(a)
@@ -57,9 +68,43 @@ struct SubTask
 	, cputime(0)
 	, peaktime(0)
 	, calls(0)
-	{ }
+	, budget(CONFIG_CYCLIC_BUDGET_MS*1000)
+	, overruns(0)
+	{
+		bzero(late,sizeof(late));
+	}
+
+	void attach(EnvObject *);
+
+	void addLateness(uint32_t dt)
+	{
+		unsigned b = 0;
+		dt >>= 8;
+		while (dt && (b < LATE_BUCKETS-1)) {
+			dt >>= 1;
+			++b;
+		}
+		++late[b];
+	}
+
+	// upper bound of the lateness bucket that covers 99% of all calls,
+	// 0 if there are no samples yet
+	uint32_t p99late() const
+	{
+		uint32_t n = 0;
+		for (unsigned b = 0; b < LATE_BUCKETS; ++b)
+			n += late[b];
+		if (n == 0)
+			return 0;
+		uint32_t t = n - n / 100, s = 0;
+		for (unsigned b = 0; b < LATE_BUCKETS; ++b) {
+			s += late[b];
+			if (s >= t)
+				return 1 << (b+8);
+		}
+		return 0;
+	}
 
-	SubTask *next;
 	const char *name;
 	unsigned (*code)(void*);
 	void *arg;
@@ -67,18 +112,26 @@ struct SubTask
 	long unsigned cputime;
 	uint32_t peaktime;
 	unsigned calls;
+	uint32_t budget;	// in us
+	unsigned overruns;
+	uint32_t late[LATE_BUCKETS];
+	EnvNumber *env_late = 0, *env_ovr = 0;
 };
 
 
+// min-heap ordering on nextrun
 struct SubTaskCmp
 {
-	bool operator () (const SubTask &l, const SubTask &r) const
-	{ return l.nextrun < r.nextrun; }
+	bool operator () (const SubTask *l, const SubTask *r) const
+	{ return l->nextrun > r->nextrun; }
 };
 
-static SubTask *SubTasks = 0;
+static vector<SubTask *> SubTasks;
 static SemaphoreHandle_t Mtx = 0;
+static TaskHandle_t CyclicTask = 0;
 static uint64_t TimeSpent = 0;
+static EnvObject *Env = 0;
+static event_t OverrunEv = 0;
 
 #ifdef CONFIG_ESPTOOLPY_FLASHSIZE_1MB
 #define busy_set(...)
@@ -89,25 +142,52 @@ extern "C" void busy_set(int on);
 #endif
 
 
+static EnvNumber *env_number(EnvObject *o, const char *name, const char *suffix, const char *dim, const char *fmt)
+{
+	size_t nl = strlen(name), sl = strlen(suffix);
+	char n[nl+sl+1];
+	memcpy(n,name,nl);
+	memcpy(n+nl,suffix,sl+1);
+	// a subtask that is removed and added again reuses its elements
+	if (EnvElement *e = o->getChild(n)) {
+		if (EnvNumber *x = e->toNumber())
+			return x;
+	}
+	return o->add(n,NAN,dim,fmt);
+}
+
+
+void SubTask::attach(EnvObject *o)
+{
+	env_late = env_number(o,name,"_late","ms","%4.1f");
+	env_ovr = env_number(o,name,"_ovr",0,"%4.0f");
+}
+
+
 int cyclic_add_task(const char *name, unsigned (*loop)(void*), void *arg, unsigned initdelay)
 {
 	if ((0 == name) || (0 == loop))
 		return 1;
 	log_info(TAG,"add subtask %s",name);
-	SubTask *n = new SubTask(name,loop,arg,esp_timer_get_time()+initdelay*1000);
 	MLock lock(Mtx);
-	SubTask *s = SubTasks;
-	while (s) {
+	for (SubTask *s : SubTasks) {
 		if (0 == strcmp(s->name,name)) {
 			lock.unlock();
-			delete n;
 			log_warn(TAG,"subtask %s already exists",name);
 			return 1;
 		}
-		s = s->next;
 	}
-	n->next = SubTasks;
-	SubTasks = n;
+	SubTask *n = new SubTask(name,loop,arg,esp_timer_get_time()+initdelay*1000);
+	if (Env)
+		n->attach(Env);
+	SubTasks.push_back(n);
+	push_heap(SubTasks.begin(),SubTasks.end(),SubTaskCmp());
+	lock.unlock();
+#ifdef ESP32
+	// new deadline might be before the current wakeup time
+	if (CyclicTask)
+		xTaskNotifyGive(CyclicTask);
+#endif
 	return 0;
 }
 
@@ -115,56 +195,78 @@ int cyclic_add_task(const char *name, unsigned (*loop)(void*), void *arg, unsign
 int cyclic_rm_task(const char *name)
 {
 	MLock lock(Mtx);
-	SubTask *s = SubTasks, *p = 0;
-	while (s) {
+	for (auto i = SubTasks.begin(), e = SubTasks.end(); i != e; ++i) {
+		SubTask *s = *i;
 		if (!strcmp(name,s->name)) {
-			if (p)
-				p->next = s->next;
-			else
-				SubTasks = s->next;
+			SubTasks.erase(i);
+			make_heap(SubTasks.begin(),SubTasks.end(),SubTaskCmp());
 			lock.unlock();
 			delete s;
 			log_info(TAG,"removed subtask %s",name);
 			return 0;
 		}
-		p = s;
-		s = s->next;
 	}
 	return 1;
 }
 
 
 // called from event task, if no dedicated cyclic task is created
+// returns the time in ms until the next subtask is due
 unsigned cyclic_execute()
 {
-	Lock lock(Mtx,__FUNCTION__);
+	// overrun events are triggered after releasing Mtx, as triggering
+	// can block when the event queue is full
+	vector<char *> overruns;
+	MLock lock(Mtx,__FUNCTION__);
+	CyclicTask = xTaskGetCurrentTaskHandle();
 	int64_t start = esp_timer_get_time();
 	int64_t begin = start;
-	unsigned delay = 100;
-	SubTask *t = SubTasks;
 	busy_set(true);
-	while (t) {
-		int32_t off = (int64_t)(t->nextrun - start);
-		if (off <= 0) {
-			unsigned d = t->code(t->arg);
-			int64_t end = esp_timer_get_time();
-			t->nextrun = end + (uint64_t)d * 1000LL;
-			++t->calls;
-			int64_t dt = end - start;
-			t->cputime += dt;
-			if (dt > t->peaktime)
-				t->peaktime = dt;
-			start = end;
-			if (d < delay)
-				delay = d;
-		} else if (off/1000 < delay) {
-			delay = off/1000;
+	// every subtask is executed at most once per call
+	size_t n = SubTasks.size();
+	while (n) {
+		SubTask *t = SubTasks.front();
+		int64_t off = (int64_t)(t->nextrun - start);
+		if (off > 0)
+			break;
+		--n;
+		pop_heap(SubTasks.begin(),SubTasks.end(),SubTaskCmp());
+		t->addLateness(-off);
+		unsigned d = t->code(t->arg);
+		int64_t end = esp_timer_get_time();
+		t->nextrun = end + (uint64_t)d * 1000LL;
+		push_heap(SubTasks.begin(),SubTasks.end(),SubTaskCmp());
+		++t->calls;
+		int64_t dt = end - start;
+		t->cputime += dt;
+		if (dt > t->peaktime)
+			t->peaktime = dt;
+		if (dt > t->budget) {
+			++t->overruns;
+			if (char *n = strdup(t->name))
+				overruns.push_back(n);
+		}
+		if (t->env_late) {
+			t->env_late->set((float)t->p99late()*1E-3);
+			t->env_ovr->set(t->overruns);
 		}
-		t = t->next;
+		start = end;
 	}
 	busy_set(false);
 	int64_t end = esp_timer_get_time();
 	TimeSpent += end-begin;
+	// wake up at least every 100ms to pick up tasks added meanwhile
+	unsigned delay = 100;
+	if (!SubTasks.empty()) {
+		int64_t off = (int64_t)(SubTasks.front()->nextrun - end);
+		if (off <= 0)
+			delay = 0;
+		else if (off < 100000)
+			delay = (off + 999) / 1000;
+	}
+	lock.unlock();
+	for (char *n : overruns)
+		event_trigger_arg(OverrunEv,n);
 	return delay;
 }
 
@@ -172,37 +274,106 @@ unsigned cyclic_execute()
 void cyclic_setup()
 {
 	Mtx = xSemaphoreCreateMutex();
+	OverrunEv = event_register("cyclic`overrun");
 	// cyclic_execute is called from the event or startup task
 }
 
 
-int subtasks(Terminal &term, int argc, const char *args[])
+void cyclic_attach(EnvObject *root)
+{
+	Lock lock(Mtx,__FUNCTION__);
+	Env = root->add("cyclic");
+	for (SubTask *s : SubTasks)
+		s->attach(Env);
+}
+
+
+static void print_scaled(Terminal &term, const char *f, uint64_t v)
 {
-	term.printf("%8s  %9s  %7s  %s\n","calls","peak","total","name");
-	SubTask *s = SubTasks;
 	const char *p = "num kM";
-	while (s) {
-		auto pt = s->peaktime;
-		auto ct = s->cputime;
-		uint8_t pd = 0, cd = 0;
-		while (ct > 30000) {
-			ct /= 1000;
-			++cd;
+	uint8_t d = 0;
+	while (v > 30000) {
+		v /= 1000;
+		++d;
+	}
+	term.printf(f,(unsigned long)v,p[d]);
+}
+
+
+const char *subtasks(Terminal &term, int argc, const char *args[])
+{
+	if (argc == 4) {
+		if (strcmp(args[1],"-b"))
+			return "Invalid argument #1.";
+		char *e;
+		long ms = strtol(args[3],&e,0);
+		if ((*e != 0) || (ms <= 0))
+			return "Invalid argument #3.";
+		Lock lock(Mtx,__FUNCTION__);
+		for (SubTask *s : SubTasks) {
+			if (0 == strcmp(s->name,args[2])) {
+				s->budget = ms * 1000;
+				return 0;
+			}
+		}
+		return "Invalid argument #2.";
+	}
+	bool hist = false;
+	if (argc == 2) {
+		if (strcmp(args[1],"-l"))
+			return "Invalid argument #1.";
+		hist = true;
+	} else if (argc != 1) {
+		return "Invalid number of arguments.";
+	}
+	struct SubTaskStat {
+		const char *name;
+		long unsigned cputime;
+		uint32_t peaktime, p99, budget;
+		unsigned calls, overruns;
+		uint32_t late[LATE_BUCKETS];
+	};
+	vector<SubTaskStat> stats;
+	{
+		Lock lock(Mtx,__FUNCTION__);
+		stats.resize(SubTasks.size());
+		SubTaskStat *x = stats.data();
+		for (const SubTask *s : SubTasks) {
+			x->name = s->name;
+			x->cputime = s->cputime;
+			x->peaktime = s->peaktime;
+			x->p99 = s->p99late();
+			x->budget = s->budget;
+			x->calls = s->calls;
+			x->overruns = s->overruns;
+			memcpy(x->late,s->late,sizeof(x->late));
+			++x;
 		}
-		while (pt > 30000) {
-			pt /= 1000;
-			++pd;
+	}
+	// SubTasks is in heap order
+	sort(stats.begin(),stats.end(),[](const SubTaskStat &l, const SubTaskStat &r) {
+		return strcmp(l.name,r.name) < 0;
+	});
+	if (hist) {
+		// bucket upper bounds in ms
+		term.printf("%-7s%6s%6s%6s%6s%6s%6s%6s%6s%6s%6s%6s%6s  %s\n","late<","0.25","0.5","1","2","4","8","16","33","66","131","262","inf","name");
+		for (const auto &s : stats) {
+			term.print("       ");
+			for (unsigned b = 0; b < LATE_BUCKETS; ++b)
+				term.printf("%6u",s.late[b]);
+			term.printf("  %s\n",s.name);
 		}
-		term.printf("%8u  %8u%c  %6lu%c  %s\n",s->calls,pt,p[pd],ct,p[cd],s->name);
-		s = s->next;
+		return 0;
 	}
-	auto tt = TimeSpent;
-	uint8_t d = 0;
-	while (tt > 30000) {
-		tt /= 1000;
-		++d;
+	term.printf("%8s  %9s  %7s  %7s  %7s  %5s  %s\n","calls","peak","total","p99late","budget","ovr","name");
+	for (const auto &s : stats) {
+		term.printf("%8u  ",s.calls);
+		print_scaled(term,"%8lu%c  ",s.peaktime);
+		print_scaled(term,"%6lu%c  ",s.cputime);
+		print_scaled(term,"%6lu%c  ",s.p99);
+		print_scaled(term,"%6lu%c  ",s.budget);
+		term.printf("%5u  %s\n",s.overruns,s.name);
 	}
-	term.printf("total %u%cs\n",(unsigned)tt,p[d]);
+	print_scaled(term,"total %lu%cs\n",TimeSpent);
 	return 0;
 }
-
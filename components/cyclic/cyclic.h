@@ -22,6 +22,9 @@
 #include <stdint.h>
 
 #ifdef __cplusplus
+class EnvObject;
+void cyclic_attach(EnvObject *);
+
 extern "C" {
 #endif
 
@@ -108,6 +108,8 @@ void EnvBool::writeValue(stream &o) const
 
 void EnvNumber::set(float v)
 {
+	if ((v != m_value) && !(isnan(v) && isnan(m_value)))
+		++m_ver;
 	m_value = v;
 #ifdef CONFIG_THRESHOLDS
 	if (m_evhi) {
@@ -143,6 +145,8 @@ int EnvNumber::setThresholds(float l, float h, const char *n)
 		}
 		m_evhi = event_register(n,"`high");
 		m_evlo = event_register(n,"`low");
+		event_set_prio(m_evhi,ep_bulk);
+		event_set_prio(m_evlo,ep_bulk);
 	}
 	m_low = l;
 	m_high = h;
@@ -151,16 +155,29 @@ int EnvNumber::setThresholds(float l, float h, const char *n)
 }
 
 
+void EnvNumber::setFormat(const char *f)
+{
+	m_fmt = f;
+	m_prec = fmt_precision(f);
+}
+
+
 void EnvNumber::writeValue(stream &o) const
 {
 	// writeValue is used for influx
 	// i.e. spaces must not be included in the output
 	if (isValid()) {
+		char buf[128];
+		if (m_prec >= 0) {
+			if (char *e = fixed_to_str(buf,m_value,m_prec)) {
+				o.write(buf,e-buf);
+				return;
+			}
+		}
 #ifdef CONFIG_ESPTOOLPY_FLASHSIZE_1MB
 		// variant needed if printf %f support is missing
 		o << get();
 #else
-		char buf[128];
 		int n = snprintf(buf,sizeof(buf),m_fmt,m_value);
 		assert((n > 0) && (n < sizeof(buf)));
 		char *b = buf;
@@ -214,6 +231,10 @@ void EnvString::set(const char *v)
 
 void EnvString::set(const char *v, size_t l)
 {
+	size_t nl = v[l-1] ? l : l - 1;
+	if ((nl == strlen(m_value)) && (0 == memcmp(m_value,v,nl)))
+		return;
+	++m_ver;
 	char *x = (char*)realloc(m_value,l + (v[l-1] != 0));
 	assert(x);
 	m_value = x;
@@ -291,11 +312,126 @@ void EnvObject::toStream(stream &o) const
 }
 
 
+unsigned EnvObject::s_generation = 0;
+
+
+// Writes into the chunk buffer and keeps what does not fit for the
+// next chunk.
+class JsonSink : public stream
+{
+	public:
+	JsonSink(char *buf, size_t size, estring &pend)
+	: m_buf(buf)
+	, m_size(size)
+	, m_pend(pend)
+	{ }
+
+	int write(const char *s, size_t n) override
+	{
+		size_t c = m_size - m_used;
+		if (c > n)
+			c = n;
+		memcpy(m_buf+m_used,s,c);
+		m_used += c;
+		if (c < n)
+			m_pend.append(s+c,n-c);
+		return n;
+	}
+
+	bool full() const
+	{ return (m_used == m_size) || (m_pend.size() != 0); }
+
+	size_t used() const
+	{ return m_used; }
+
+	private:
+	char *m_buf;
+	size_t m_size, m_used = 0;
+	estring &m_pend;
+};
+
+
+EnvJson::EnvJson(const EnvObject *root)
+: m_root(root)
+, m_gen(EnvObject::generation())
+{
+}
+
+
+void EnvJson::step(stream &o)
+{
+	if (m_depth == 0) {
+		if (m_root == 0) {
+			m_done = true;
+			return;
+		}
+		if (const char *n = m_root->name())
+			o.printf("\"%s\":{",n);
+		else
+			o << '{';
+		m_stack[0].obj = m_root;
+		m_stack[0].idx = 0;
+		m_depth = 1;
+		m_root = 0;
+		return;
+	}
+	if (m_gen != EnvObject::generation()) {
+		// pointers on the stack may be stale
+		while (m_depth) {
+			o << '}';
+			--m_depth;
+		}
+		m_done = true;
+		return;
+	}
+	Level &l = m_stack[m_depth-1];
+	EnvElement *e = l.obj->getChild(l.idx);
+	if (e == 0) {
+		o << '}';
+		if (--m_depth == 0)
+			m_done = true;
+		return;
+	}
+	if (l.idx++)
+		o << ',';
+	EnvObject *c = e->toObject();
+	if (c && (m_depth < sizeof(m_stack)/sizeof(m_stack[0]))) {
+		o.printf("\"%s\":{",c->name());
+		m_stack[m_depth].obj = c;
+		m_stack[m_depth].idx = 0;
+		++m_depth;
+	} else {
+		e->toStream(o);
+	}
+}
+
+
+size_t EnvJson::read(char *buf, size_t size)
+{
+	size_t n = m_pend.size() - m_poff;
+	if (n) {
+		if (n > size)
+			n = size;
+		memcpy(buf,m_pend.data()+m_poff,n);
+		m_poff += n;
+		if (m_poff < m_pend.size())
+			return n;
+	}
+	m_pend.clear();
+	m_poff = 0;
+	JsonSink o(buf+n,size-n,m_pend);
+	while (!m_done && !o.full())
+		step(o);
+	return n + o.used();
+}
+
+
 void EnvObject::append(EnvElement *e)
 {
 	assert(e);
 	m_childs.push_back(e);
 	e->m_parent = this;
+	++s_generation;
 }
 
 
@@ -433,8 +569,10 @@ void EnvObject::remove(EnvElement *x)
 {
 	auto e = m_childs.end();
 	auto i = std::find(m_childs.begin(),e,x);
-	if (i != e)
+	if (i != e) {
 		m_childs.erase(i,i+1);
+		++s_generation;
+	}
 }
 
 /*
@@ -28,6 +28,7 @@
 // - no checking for invalid characters
 // - no string escape sequences
 
+#include "estring.h"
 #include "event.h"
 
 #include <math.h>
@@ -91,6 +92,10 @@ class EnvElement
 	void setSkip(bool s = true)
 	{ m_skip = s; }
 
+	// incremented on every change of the value
+	uint16_t version() const
+	{ return m_ver; }
+
 	size_t getPath(char *path, char sep);
 
 	protected:
@@ -101,6 +106,7 @@ class EnvElement
 	friend class EnvObject;
 	EnvObject *m_parent = 0;
 	bool m_skip = false;
+	uint16_t m_ver = 0;
 
 	private:
 	EnvElement(const EnvElement &);		// intentionally not supported
@@ -122,7 +128,12 @@ class EnvBool : public EnvElement
 	void writeValue(stream &) const;
 
 	void set(bool v)
-	{ m_value = v; }
+	{
+		if (v != m_value) {
+			m_value = v;
+			++m_ver;
+		}
+	}
 
 	bool get() const
 	{ return m_value; }
@@ -141,7 +152,7 @@ class EnvNumber : public EnvElement
 	, m_value(NAN)
 	{
 		if (fmt)
-			m_fmt = fmt;
+			setFormat(fmt);
 	}
 
 	EnvNumber(const char *name, double v, const char *dim = 0, const char *fmt = 0)
@@ -149,7 +160,7 @@ class EnvNumber : public EnvElement
 	, m_value(v)
 	{
 		if (fmt)
-			m_fmt = fmt;
+			setFormat(fmt);
 	}
 
 	EnvNumber *toNumber() override
@@ -168,12 +179,15 @@ class EnvNumber : public EnvElement
 //	{ return isnormal(m_value); }
 	{ return !isnan(m_value); }
 
-	void setFormat(const char *f)
-	{ m_fmt = f; }
+	void setFormat(const char *f);
 
 	const char *getFormat() const
 	{ return m_fmt; }
 
+	// precision of the format, -1 if it needs printf
+	int getPrecision() const
+	{ return m_prec; }
+
 	float getHigh() const
 	{ return m_high; }
 
@@ -186,6 +200,7 @@ class EnvNumber : public EnvElement
 	float m_high = NAN, m_low = NAN;
 	event_t m_evhi = 0, m_evlo = 0;
 	int8_t m_tst = 0;
+	int8_t m_prec = 1;
 	const char *m_fmt = "%4.1f";
 };
 
@@ -241,6 +256,11 @@ class EnvObject : public EnvElement
 	EnvElement *getElement(unsigned i) const;
 	unsigned numElements() const override;
 
+	// incremented whenever an element is added to or removed from
+	// any object
+	static unsigned generation()
+	{ return s_generation; }
+
 	EnvElement *getChild(unsigned i) const
 	{
 		if (i >= m_childs.size())
@@ -271,6 +291,44 @@ class EnvObject : public EnvElement
 	void append(EnvElement *);
 
 	std::vector<EnvElement *> m_childs;
+	static unsigned s_generation;
+};
+
+
+// Resumable JSON serializer: produces the same output as
+// EnvObject::toStream, but in chunks of a caller supplied size. The
+// tree must only be locked during each call of read(). If elements are
+// added or removed between two calls, the open objects are closed and
+// the output ends early.
+class EnvJson
+{
+	public:
+	explicit EnvJson(const EnvObject *root);
+
+	// returns the number of bytes written to buf, 0 when done
+	size_t read(char *buf, size_t size);
+
+	bool done() const
+	{ return m_done && (m_poff == m_pend.size()); }
+
+	private:
+	EnvJson(const EnvJson &);
+	EnvJson &operator = (const EnvJson &);
+	void step(stream &);
+
+	struct Level
+	{
+		const EnvObject *obj;
+		unsigned idx;
+	};
+
+	Level m_stack[8];	// deeper objects are serialized at once
+	const EnvObject *m_root;
+	unsigned m_gen;
+	uint8_t m_depth = 0;
+	bool m_done = false;
+	estring m_pend;		// overflow of the last chunk
+	size_t m_poff = 0;
 };
 
 
@@ -64,29 +64,303 @@ extern "C" void busy_set(int on);
 #define CONFIG_EVENT_STACK_SIZE 8192
 #endif
 
+#if defined CONFIG_EVENT_RING && !defined CONFIG_EVENT_RING_SIZE
+#define CONFIG_EVENT_RING_SIZE 64
+#endif
+
+// maximum number of events dequeued at once from the event ring
+#define EVENT_BATCH 8
+
+#if defined CONFIG_EVENT_WORKERS && CONFIG_EVENT_WORKERS > 0
+#define EVENT_WORKERS CONFIG_EVENT_WORKERS
+#ifndef CONFIG_EVENT_WORKER_CPU
+#define CONFIG_EVENT_WORKER_CPU -1
+#endif
+#else
+#define EVENT_WORKERS 0
+#endif
+
 
 struct Event {
 	event_t id;
+	action_t act = 0;		// if set, activate only this action
+	uint8_t prio = ep_normal;	// set on enqueue
+	bool own = true;		// arg is free()'ed after processing
+	uint32_t ts = 0;		// enqueue time, lower 32 bits of esp_timer
 	void *arg = 0;
 	Event(event_t i = 0, void *a = 0)
 	: id(i)
 	, arg(a)
 	{ }
+
+	void release()
+	{
+		if (own)
+			free(arg);
+	}
+};
+
+#define EP_NUM (ep_bulk+1)
+
+struct EventLatency {
+	uint32_t num = 0, max = 0;
+	uint64_t sum = 0;
+};
+
+#ifdef CONFIG_EVENT_RING
+// Bounded multi-producer/single-consumer ring with per-slot sequence
+// numbers. Producers claim a slot with a CAS on m_head and publish it
+// by updating the slot's sequence. No producer ever waits for another
+// one, so push() is safe to be called from ISRs.
+class EventRing
+{
+	static_assert((CONFIG_EVENT_RING_SIZE & (CONFIG_EVENT_RING_SIZE-1)) == 0, "event ring size must be a power of 2");
+	static const uint32_t Mask = CONFIG_EVENT_RING_SIZE - 1;
+
+	public:
+	EventRing()
+	{
+		for (uint32_t i = 0; i < CONFIG_EVENT_RING_SIZE; ++i)
+			m_slots[i].seq.store(i,memory_order_relaxed);
+	}
+
+	bool push(const Event &e)
+	{
+		uint32_t pos = m_head.load(memory_order_relaxed);
+		Slot *s;
+		for (;;) {
+			s = m_slots + (pos & Mask);
+			int32_t dif = s->seq.load(memory_order_acquire) - pos;
+			if (dif == 0) {
+				if (m_head.compare_exchange_weak(pos,pos+1,memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;	// full
+			} else {
+				pos = m_head.load(memory_order_relaxed);
+			}
+		}
+		s->ev = e;
+		s->seq.store(pos+1,memory_order_release);
+		return true;
+	}
+
+	// consumer only
+	unsigned pop(Event *e, unsigned max)
+	{
+		unsigned n = 0;
+		while (n < max) {
+			Slot *s = m_slots + (m_tail & Mask);
+			if ((int32_t)(s->seq.load(memory_order_acquire) - (m_tail+1)) < 0)
+				break;
+			e[n++] = s->ev;
+			s->seq.store(m_tail+CONFIG_EVENT_RING_SIZE,memory_order_release);
+			++m_tail;
+		}
+		return n;
+	}
+
+	unsigned fill() const
+	{ return m_head.load(memory_order_relaxed) - m_tail; }
+
+	private:
+	struct Slot {
+		atomic<uint32_t> seq;
+		Event ev;
+	};
+	alignas(32) atomic<uint32_t> m_head = {0};
+	alignas(32) uint32_t m_tail = 0;
+	alignas(32) Slot m_slots[CONFIG_EVENT_RING_SIZE];
+};
+
+static EventRing EventsR[EP_NUM];
+#else
+static QueueHandle_t EventsQ[EP_NUM];
+static const uint8_t EventsQLen[EP_NUM] = { 16, 32, 16 };
+#endif
+static TaskHandle_t EventTaskH = 0;
+static EventLatency Latency[EP_NUM];
+
+#if EVENT_WORKERS > 0
+// Events are dispatched to workers by event id, so all triggers of one
+// event are processed by the same worker in order.
+struct EventWorker {
+	QueueHandle_t q = 0;
+	uint64_t busy = 0;
+	uint32_t num = 0;
+	uint8_t maxq = 0;
 };
 
+static EventWorker Workers[EVENT_WORKERS];
+// held while executing actions that are not declared concurrent
+static SemaphoreHandle_t SerialMtx = 0;
+#endif
+static const char EventPrioNames[][9] = { "critical", "normal", "bulk" };
+
 #if defined STATIC_TASK && !defined CONFIG_IDF_TARGET_ESP8266
 static StackType_t EventStack[CONFIG_EVENT_STACK_SIZE];
 static StaticTask_t EventTask;
 #endif
 
-static QueueHandle_t EventsQ = 0;
 static SemaphoreHandle_t EventMtx = 0;
 static vector<EventHandler> EventHandlers;
+// open addressing hash index over EventHandlers for name lookups
+// 0 marks an empty slot, as event_t 0 is invalid
+static event_t *EventIdx = 0;
+static unsigned EventIdxMask = 0;
+// producers of lost events
+typedef enum { lp_task, lp_isr, lp_action, lp_syslog, lp_worker, LP_NUM } lost_prod_t;
+static const char LostProdNames[][8] = { "task", "ISR", "action", "syslog", "worker" };
+#ifdef ESP32
+static atomic<uint32_t> Lost, Discarded, Invalid, Processed, Isr, Coalesced;
+static atomic<uint32_t> LostBy[LP_NUM];
+#else
+static uint32_t Lost = 0, Discarded = 0, Invalid = 0, Processed = 0, Isr = 0, Coalesced = 0;
+static uint32_t LostBy[LP_NUM];
+#endif
+
+
+// Priorities are read from ISRs, where EventHandlers might be reallocated
+// by a concurrent event_register. Therefore, they are kept in blocks that
+// are allocated on registration and never move. Events beyond the last
+// block are ep_normal.
+#define PRIO_BLOCK_SIZE 128
+#define PRIO_BLOCKS 32
+static uint8_t *EventPrio[PRIO_BLOCKS];
+
+
+static inline uint8_t event_prio(event_t id)
+{
+	unsigned b = id / PRIO_BLOCK_SIZE;
+	if (b >= PRIO_BLOCKS)
+		return ep_normal;
+	uint8_t *p = EventPrio[b];
+	return p ? p[id % PRIO_BLOCK_SIZE] : (uint8_t)ep_normal;
+}
+
+
+// returns the previous state of the pending flag
+static inline bool event_set_pending(EventHandler &h, bool p)
+{
 #ifdef ESP32
-static atomic<uint32_t> Lost, Discarded, Invalid, Processed, Isr;
+	return __atomic_exchange_n(&h.pending,p,__ATOMIC_ACQ_REL);
+#else
+	bool r = h.pending;
+	h.pending = p;
+	return r;
+#endif
+}
+
+
+static inline void IRAM_ATTR event_lost(lost_prod_t p)
+{
+	++Lost;
+	++LostBy[p];
+}
+
+
+// task context
+// only critical events wait for room in the queue
+static bool event_enqueue(Event &e)
+{
+	e.prio = event_prio(e.id);
+	e.ts = esp_timer_get_time();
+#ifdef CONFIG_EVENT_RING
+	if (!EventsR[e.prio].push(e))
+		return false;
+#else
+	if (pdTRUE != xQueueSend(EventsQ[e.prio],&e,e.prio == ep_critical ? 1000 : 0))
+		return false;
+#endif
+	if (EventTaskH)
+		xTaskNotifyGive(EventTaskH);
+	return true;
+}
+
+
+static void IRAM_ATTR event_isr_enqueue(Event &e)
+{
+	// ! don't log from ISR
+	e.prio = event_prio(e.id);
+	e.ts = esp_timer_get_time();
+#ifdef CONFIG_EVENT_RING
+	if (EventsR[e.prio].push(e)) {
 #else
-static uint32_t Lost = 0, Discarded = 0, Invalid = 0, Processed = 0, Isr = 0;
+	if (pdTRUE == xQueueSendFromISR(EventsQ[e.prio],&e,0)) {
 #endif
+		++Isr;
+		if (EventTaskH) {
+			BaseType_t w = pdFALSE;
+			vTaskNotifyGiveFromISR(EventTaskH,&w);
+			if (w)
+				portYIELD_FROM_ISR();
+		}
+	} else {
+		event_lost(lp_isr);
+	}
+}
+
+
+// dequeues a batch of the highest priority class that has pending events
+static unsigned event_dequeue(Event *ev, unsigned max)
+{
+	for (unsigned c = 0; c < EP_NUM; ++c) {
+#ifdef CONFIG_EVENT_RING
+		if (unsigned n = EventsR[c].pop(ev,max))
+			return n;
+#else
+		unsigned n = 0;
+		while ((n < max) && (pdTRUE == xQueueReceive(EventsQ[c],ev+n,0)))
+			++n;
+		if (n)
+			return n;
+#endif
+	}
+	return 0;
+}
+
+
+int event_set_prio(event_t e, event_prio_t p)
+{
+	if ((e == 0) || (e >= EventHandlers.size()) || ((unsigned)p >= EP_NUM))
+		return 1;
+	unsigned b = e / PRIO_BLOCK_SIZE;
+	if ((b >= PRIO_BLOCKS) || (EventPrio[b] == 0))
+		return 1;
+	EventPrio[b][e % PRIO_BLOCK_SIZE] = p;
+	return 0;
+}
+
+
+event_prio_t event_get_prio(event_t e)
+{
+	return (event_prio_t) event_prio(e);
+}
+
+
+int event_set_coalesce(event_t e, bool c)
+{
+	if ((e == 0) || (e >= EventHandlers.size()))
+		return 1;
+	EventHandlers[e].coalesce = c;
+	return 0;
+}
+
+
+const char *event_prio_name(event_prio_t p)
+{
+	return ((unsigned)p < EP_NUM) ? EventPrioNames[p] : 0;
+}
+
+
+int event_prio_parse(const char *n)
+{
+	for (unsigned c = 0; c < EP_NUM; ++c) {
+		if (!strcmp(n,EventPrioNames[c]))
+			return c;
+	}
+	return -1;
+}
 
 
 char *concat(const char *s0, const char *s1)
@@ -100,6 +374,74 @@ char *concat(const char *s0, const char *s1)
 }
 
 
+static uint32_t event_hash(const char *n)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	while (char c = *n++) {
+		h ^= (uint8_t) c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+// returns the slot of name n or the empty slot where it belongs
+static unsigned event_idx_slot(const char *n)
+{
+	unsigned s = event_hash(n) & EventIdxMask;
+	while (event_t e = EventIdx[s]) {
+		if (!strcmp(n,EventHandlers[e].name))
+			break;
+		s = (s + 1) & EventIdxMask;
+	}
+	return s;
+}
+
+
+// keeps the old index if out of memory
+static bool event_idx_resize(unsigned size)
+{
+	event_t *idx = (event_t *) calloc(size,sizeof(event_t));
+	if (idx == 0) {
+		log_warn(TAG,"no memory for event index");
+		return false;
+	}
+	free(EventIdx);
+	EventIdx = idx;
+	EventIdxMask = size - 1;
+	for (size_t e = 1, n = EventHandlers.size(); e < n; ++e)
+		EventIdx[event_idx_slot(EventHandlers[e].name)] = (event_t) e;
+	return true;
+}
+
+
+// EventMtx must be held or event infrastructure not yet running
+static event_t event_add(const char *name, unsigned slot)
+{
+	size_t n = EventHandlers.size();
+	unsigned b = n / PRIO_BLOCK_SIZE;
+	if ((b < PRIO_BLOCKS) && (EventPrio[b] == 0)) {
+		// published before the event exists, so ISRs see a valid class
+		if (uint8_t *p = (uint8_t *) malloc(PRIO_BLOCK_SIZE)) {
+			memset(p,ep_normal,PRIO_BLOCK_SIZE);
+			EventPrio[b] = p;
+		}
+	}
+	EventHandlers.emplace_back(name);
+	// keep load factor below 3/4
+	if ((4*n >= 3*(EventIdxMask+1)) && event_idx_resize((EventIdxMask+1)<<1))
+		return (event_t) n;
+	// slot is still valid, but one slot must stay empty to terminate probing
+	if (n >= EventIdxMask) {
+		EventHandlers.pop_back();
+		return 0;
+	}
+	EventIdx[slot] = (event_t) n;
+	return (event_t) n;
+}
+
+
 event_t event_register(const char *cat, const char *type)
 {
 	const char *name;
@@ -111,19 +453,22 @@ event_t event_register(const char *cat, const char *type)
 	if (0 == strchr(name,'`'))
 		log_warn(TAG,"event '%s' missing `",name);
 	Lock lock(EventMtx,__FUNCTION__);
-	size_t n = EventHandlers.size();
-	// event_t 0: name: empty string; invalid event, catched in this loop
-	for (size_t i = 1; i < n; ++i) {
-		if (!strcmp(name,EventHandlers[i].name)) {
-			log_warn(TAG,"duplicate event %d: %s",i,name);
-			if (name != cat)
-				free((void*)name);
-			return (event_t) i;
-		}
+	unsigned s = event_idx_slot(name);
+	if (event_t e = EventIdx[s]) {
+		log_warn(TAG,"duplicate event %d: %s",e,name);
+		if (name != cat)
+			free((void*)name);
+		return e;
 	}
-	log_dbug(TAG,"register %s=%u",name,n);
-	EventHandlers.emplace_back(name);
-	return (event_t) n;
+	event_t e = event_add(name,s);
+	if (e == 0) {
+		log_warn(TAG,"unable to register %s",name);
+		if (name != cat)
+			free((void*)name);
+		return 0;
+	}
+	log_dbug(TAG,"register %s=%u",name,e);
+	return e;
 }
 
 
@@ -301,14 +646,7 @@ event_t event_id(const char *n)
 {
 //	PROFILE_FUNCTION();
 	Lock lock(EventMtx,__FUNCTION__);
-	event_t r = 0;
-	for (unsigned i = 1; i < EventHandlers.size(); ++i) {
-		if (!strcmp(n,EventHandlers[i].name)) {
-			r = (event_t) i;
-			break;
-		}
-	}
-	return r;
+	return EventIdx[event_idx_slot(n)];
 }
 
 
@@ -317,10 +655,7 @@ void IRAM_ATTR event_isr_handler(void *arg)
 	event_t id = (event_t)(unsigned)arg;
 	if (id != 0) {
 		Event e(id);
-		if (pdTRUE == xQueueSendFromISR(EventsQ,&e,0))
-			++Isr;
-		else
-			++Lost;
+		event_isr_enqueue(e);
 	}
 }
 
@@ -346,12 +681,21 @@ void event_trigger(event_t id)
 		++Discarded;
 		++EventHandlers[id].occur;
 	} else {
+		EventHandler &h = EventHandlers[id];
+		if (h.coalesce && event_set_pending(h,true)) {
+			// already pending: counted, but dispatched only once
+			++h.occur;
+			++Coalesced;
+			return;
+		}
 		Event e(id);
-		BaseType_t r = xQueueSend(EventsQ,&e,1000);
-		if (r != pdTRUE) {
-			++Lost;
+		if (event_enqueue(e)) {
+			log_dbug(TAG,"trigger %s",h.name);
 		} else {
-			log_dbug(TAG,"trigger %s",EventHandlers[id].name);
+			if (h.coalesce)
+				event_set_pending(h,false);
+			event_lost(lp_task);
+			++h.lost;
 		}
 	}
 }
@@ -359,10 +703,18 @@ void event_trigger(event_t id)
 
 void event_trigger_nd(event_t id)	// no-debug version for syslog only
 {
+	EventHandler &h = EventHandlers[id];
+	if (h.coalesce && event_set_pending(h,true)) {
+		++h.occur;
+		++Coalesced;
+		return;
+	}
 	Event e(id);
-	BaseType_t r = xQueueSend(EventsQ,&e,1000);
-	if (r != pdTRUE)
-		++Lost;
+	if (!event_enqueue(e)) {
+		if (h.coalesce)
+			event_set_pending(h,false);
+		event_lost(lp_syslog);
+	}
 }
 
 
@@ -371,15 +723,16 @@ void event_trigger_arg(event_t id, void *arg)
 	if ((id != 0) && (id < EventHandlers.size())) {
 		if (!EventHandlers[id].callbacks.empty()) {
 			Event e(id,arg);
-			BaseType_t r = xQueueSend(EventsQ,&e,1000);
-			if (r != pdTRUE)
-				++Lost;
-			else
+			if (event_enqueue(e)) {
 				log_dbug(TAG,"trigger %d %p",id,arg);
-			return;
+				return;
+			}
+			event_lost(lp_task);
+			++EventHandlers[id].lost;
+		} else {
+			++Discarded;
+			++EventHandlers[id].occur;
 		}
-		++Discarded;
-		++EventHandlers[id].occur;
 	} else {
 		log_warn(TAG,"invalid id %d",id);
 		++Invalid;
@@ -388,31 +741,162 @@ void event_trigger_arg(event_t id, void *arg)
 }
 
 
+void event_trigger_action(event_t id, action_t act, void *arg, bool own)
+{
+	Event e(id,arg);
+	e.act = act;
+	e.own = own;
+	if (event_enqueue(e)) {
+		log_dbug(TAG,"trigger %d action %u",id,act);
+		return;
+	}
+	event_lost(lp_action);
+	if (id < EventHandlers.size())
+		++EventHandlers[id].lost;
+	e.release();
+}
+
+
 void IRAM_ATTR event_isr_trigger(event_t id)
 {
-	// ! don't log from ISR
 	if (id != 0) {
 		Event e(id);
-		if (pdTRUE == xQueueSendFromISR(EventsQ,&e,0))
-			++Isr;
-		else
-			++Lost;
+		event_isr_enqueue(e);
 	}
 }
 
 
 void IRAM_ATTR event_isr_trigger_arg(event_t id, void *arg)
 {
-	// ! don't log from ISR
 	if (id != 0) {
 		Event e(id,arg);
-		if (pdTRUE == xQueueSendFromISR(EventsQ,&e,0))
-			++Isr;
-		else
-			++Lost;
+		event_isr_enqueue(e);
 	}
 }
 
+
+void event_activate(Action *a, void *arg)
+{
+#if EVENT_WORKERS > 0
+	if (!a->concurrent) {
+		// may take longer than MUTEX_ABORT_TIMEOUT
+		xSemaphoreTake(SerialMtx,portMAX_DELAY);
+		a->activate(arg);
+		xSemaphoreGive(SerialMtx);
+		return;
+	}
+#endif
+	a->activate(arg);
+}
+
+
+static void event_process(Event &e)
+{
+	MLock lock(EventMtx,__FUNCTION__);
+	int64_t start = esp_timer_get_time();
+	EventLatency &l = Latency[e.prio];
+	uint32_t lat = (uint32_t)start - e.ts;
+	++l.num;
+	l.sum += lat;
+	if (lat > l.max)
+		l.max = lat;
+	log_devel(TAG,"process %d",e.id);
+	if (e.id < EventHandlers.size()) {
+		EventHandler &h = EventHandlers[e.id];
+		++h.occur;
+		if (h.coalesce)
+			event_set_pending(h,false);
+		if (e.act) {
+			// directly addressed action, activated before the
+			// callbacks bound to the event
+			++Processed;
+			lock.unlock();
+			if (Action *a = action_from_handle(e.act))
+				event_activate(a,e.arg);
+			else
+				++Invalid;
+			lock.lock();
+		}
+		// after unlock 'EventHandler h' may be a wild pointer
+		EventHandler &h1 = EventHandlers[e.id];
+		if (!h1.callbacks.empty()) {
+			busy_set(true);
+			log_local(TAG,"%s: %u callbacks, arg %p",h1.name,h1.callbacks.size(),e.arg);
+			// need to copy the enabled callbacks,
+			// because the enabling might be changed
+			// with an action
+			bool enabled[h1.callbacks.size()];
+			unsigned x = 0, y = sizeof(enabled);
+			for (const auto &c : h1.callbacks) {
+				enabled[x] = c.enabled;
+				if (enabled[x] && (y == sizeof(enabled))) {
+					y = x;
+					if (e.act == 0)
+						++Processed;
+				}
+				++x;
+			}
+			if ((y == sizeof(enabled)) && (e.act == 0))
+				++Discarded;
+			// after unlock 'EventHandler h' may be
+			// a wild pointer! Therefore, reinit it
+			// from its vector every iteration.
+			for (size_t n = sizeof(enabled); y != n; ++y) {
+			// action arg	: set on action_add (cannot be overwritten)
+			// callback arg	: set on event_callback_arg
+			// event arg    : set on event_trigger_arg
+				if (enabled[y]) {
+					const auto &c = EventHandlers[e.id].callbacks[y];
+					log_devel(TAG,"\t%s, %s-arg %-16s",c.action->name?c.action->name:"<null>",e.arg?"event": c.arg?"callback":"null",e.arg ? e.arg : c.arg ? c.arg : "");
+					Action *a = c.action;
+					void *arg = e.arg ? e.arg : c.arg;
+					lock.unlock();
+					event_activate(a,arg);
+					lock.lock();
+				}
+			}
+			int64_t end = esp_timer_get_time();
+			EventHandler &h2 = EventHandlers[e.id];
+			log_local(TAG,"%s time: %lu",h2.name,end-start);
+			h2.time += end-start;
+			busy_set(false);
+		} else if (e.act == 0) {
+			++Discarded;
+		}
+	} else {
+		log_local(TAG,"invalid event %d",e.id);
+		++Invalid;
+	}
+	if (e.arg && e.own) {
+		log_devel(TAG,"free arg %p",e.arg);
+		free(e.arg);
+	}
+	log_devel(TAG,"finished %d",e.id);
+}
+
+
+// low prio stuff on timeout
+static void event_idle()
+{
+	static uint32_t invalid = 0, lost = 0, discarded = 0;
+#ifdef CONFIG_VERIFY_HEAP
+	heap_caps_check_integrity_all(true);
+#endif
+	if (Lost != lost) {
+		log_warn(TAG,"%u lost",Lost-lost);
+		lost = Lost;
+	}
+	if (Invalid != invalid) {
+		log_warn(TAG,"%u invalid",Invalid-invalid);
+		invalid = Invalid;
+	}
+	if (Discarded != discarded) {
+		log_dbug(TAG,"%u discarded",Discarded-discarded);
+		discarded = Discarded;
+	}
+}
+
+
 static void event_task(void *)
 {
 #ifdef ESP32
@@ -421,105 +905,105 @@ static void event_task(void *)
 	unsigned d = portTICK_PERIOD_MS;
 	#define dt (d / portTICK_PERIOD_MS)
 #endif
-	uint32_t invalid = 0, lost = 0, discarded = 0;
 	for (;;) {
-		Event e;
-		BaseType_t r = xQueueReceive(EventsQ,&e,dt);
-		if (r == pdFALSE) {
-			// timeout: process cyclic
-			// cyclic has its own task
+		Event ev[EVENT_BATCH];
+		unsigned n = event_dequeue(ev,EVENT_BATCH);
+		if (n == 0) {
+			if (0 == ulTaskNotifyTake(pdTRUE,dt)) {
+				// timeout: process cyclic
+				// cyclic has its own task
 #ifndef ESP32
-			d = cyclic_execute();
-#endif
-#ifdef CONFIG_VERIFY_HEAP
-			heap_caps_check_integrity_all(true);
+				d = cyclic_execute();
 #endif
-			// low prio stuff
-			if (Lost != lost) {
-				log_warn(TAG,"%u lost",Lost-lost);
-				lost = Lost;
-			}
-			if (Invalid != invalid) {
-				log_warn(TAG,"%u invalid",Invalid-invalid);
-				invalid = Invalid;
-			}
-			if (Discarded != discarded) {
-				log_dbug(TAG,"%u discarded",Discarded-discarded);
-				discarded = Discarded;
+				event_idle();
 			}
 			continue;
 		}
-		MLock lock(EventMtx,__FUNCTION__);
-		int64_t start = esp_timer_get_time();
-		log_devel(TAG,"process %d",e.id);
-		if (e.id < EventHandlers.size()) {
-			EventHandler &h = EventHandlers[e.id];
-			++h.occur;
-			if (!h.callbacks.empty()) {
-				busy_set(true);
-				log_local(TAG,"%s: %u callbacks, arg %p",h.name,h.callbacks.size(),e.arg);
-				// need to copy the enabled callbacks,
-				// because the enabling might be changed
-				// with an action
-				bool enabled[h.callbacks.size()];
-				unsigned x = 0, y = sizeof(enabled);
-				for (const auto &c : h.callbacks) {
-					enabled[x] = c.enabled;
-					if (enabled[x] && (y == sizeof(enabled))) {
-						y = x;
-						++Processed;
-					}
-					++x;
-				}
-				if (y == sizeof(enabled))
-					++Discarded;
-				// after unlock 'EventHandler h' may be
-				// a wild pointer! Therefore, reinit it
-				// from its vector every iteration.
-				for (size_t n = sizeof(enabled); y != n; ++y) {
-				// action arg	: set on action_add (cannot be overwritten)
-				// callback arg	: set on event_callback_arg
-				// event arg    : set on event_trigger_arg
-					if (enabled[y]) {
-						const auto &c = EventHandlers[e.id].callbacks[y];
-						log_devel(TAG,"\t%s, %s-arg %-16s",c.action->name?c.action->name:"<null>",e.arg?"event": c.arg?"callback":"null",e.arg ? e.arg : c.arg ? c.arg : "");
-						Action *a = c.action;
-						void *arg = e.arg ? e.arg : c.arg;
-						lock.unlock();
-						a->activate(arg);
-						lock.lock();
-					}
-				}
-				int64_t end = esp_timer_get_time();
-				EventHandler &h2 = EventHandlers[e.id];
-				log_local(TAG,"%s time: %lu",h2.name,end-start);
-				h2.time += end-start;
-				busy_set(false);
+		for (unsigned i = 0; i < n; ++i) {
+#if EVENT_WORKERS > 0
+			// never block: a worker busy with a slow bulk handler
+			// must not delay events for the other workers
+			EventWorker &w = Workers[ev[i].id % EVENT_WORKERS];
+			if (pdTRUE == xQueueSend(w.q,ev+i,0)) {
+				uint8_t d = uxQueueMessagesWaiting(w.q);
+				if (d > w.maxq)
+					w.maxq = d;
 			} else {
-				++Discarded;
+				event_lost(lp_worker);
+				if ((ev[i].id != 0) && (ev[i].id < EventHandlers.size())) {
+					EventHandler &h = EventHandlers[ev[i].id];
+					++h.lost;
+					// otherwise later triggers get coalesced into
+					// the dropped one and are never dispatched
+					if (h.coalesce)
+						event_set_pending(h,false);
+				}
+				ev[i].release();
 			}
-		} else {
-			log_local(TAG,"invalid event %d",e.id);
-			++Invalid;
+#else
+			event_process(ev[i]);
+#endif
 		}
-		if (e.arg) {
-			log_devel(TAG,"free arg %p",e.arg);
-			free(e.arg);
+	}
+}
+
+
+#if EVENT_WORKERS > 0
+static void event_worker(void *p)
+{
+	EventWorker *w = (EventWorker *) p;
+	for (;;) {
+		Event e;
+		if (pdTRUE == xQueueReceive(w->q,&e,portMAX_DELAY)) {
+			int64_t st = esp_timer_get_time();
+			event_process(e);
+			w->busy += esp_timer_get_time() - st;
+			++w->num;
 		}
-		log_devel(TAG,"finished %d",e.id);
 	}
 }
+#endif
 
 
 void event_status(Terminal &t)
 {
 #ifdef ESP32
-	t.printf("%u processed, %u discarded, %u lost, %u invalid, %u ISR\n"
-			,Processed.load(),Discarded.load(),Lost.load(),Invalid.load(),Isr.load());
+	t.printf("%u processed, %u discarded, %u lost, %u invalid, %u ISR, %u coalesced\n"
+			,Processed.load(),Discarded.load(),Lost.load(),Invalid.load(),Isr.load(),Coalesced.load());
 #else
-	t.printf("%u processed, %u discarded, %u lost, %u invalid, %u ISR\n"
-			,Processed,Discarded,Lost,Invalid,Isr);
+	t.printf("%u processed, %u discarded, %u lost, %u invalid, %u ISR, %u coalesced\n"
+			,Processed,Discarded,Lost,Invalid,Isr,Coalesced);
+#endif
+	for (unsigned p = 0; p < LP_NUM; ++p) {
+		uint32_t l = LostBy[p];
+		if (l)
+			t.printf("lost from %s: %u\n",LostProdNames[p],l);
+	}
+#ifdef CONFIG_EVENT_RING
+	for (unsigned c = 0; c < EP_NUM; ++c)
+		t.printf("%s ring: %u/%u used\n",EventPrioNames[c],EventsR[c].fill(),CONFIG_EVENT_RING_SIZE);
+#endif
+#if EVENT_WORKERS > 0
+	for (unsigned i = 0; i < EVENT_WORKERS; ++i) {
+		const EventWorker &w = Workers[i];
+		t.printf("worker %u: %u events, busy %lums, queue %u (max %u)\n"
+			,i,w.num,(unsigned long)(w.busy/1000),uxQueueMessagesWaiting(w.q),w.maxq);
+	}
 #endif
+	for (const auto &h : EventHandlers) {
+		if (h.lost)
+			t.printf("%s: %u lost\n",h.name,h.lost);
+	}
+}
+
+
+void event_latency(Terminal &t)
+{
+	t.printf("%-9s %8s %8s %8s\n","class","events","avg[us]","max[us]");
+	for (unsigned c = 0; c < EP_NUM; ++c) {
+		const EventLatency &l = Latency[c];
+		t.printf("%-9s %8u %8u %8u\n",EventPrioNames[c],l.num,l.num ? (unsigned)(l.sum/l.num) : 0,l.max);
+	}
 }
 
 
@@ -527,10 +1011,18 @@ void event_init(void)
 {
 	EventMtx = xSemaphoreCreateMutex();
 	EventHandlers.emplace_back("<null>");	// (event_t)0 is an invalid event
-	EventHandlers.emplace_back("init`done");
-	EventHandlers.emplace_back("wifi`station_up");
-	EventHandlers.emplace_back("wifi`station_down");
-	EventsQ = xQueueCreate(32,sizeof(Event));
+	event_idx_resize(64);
+	for (const char *n : {"init`done","wifi`station_up","wifi`station_down"})
+		event_add(n,event_idx_slot(n));
+#ifndef CONFIG_EVENT_RING
+	for (unsigned c = 0; c < EP_NUM; ++c)
+		EventsQ[c] = xQueueCreate(EventsQLen[c],sizeof(Event));
+#endif
+#if EVENT_WORKERS > 0
+	SerialMtx = xSemaphoreCreateMutex();
+	for (auto &w : Workers)
+		w.q = xQueueCreate(32,sizeof(Event));
+#endif
 }
 
 
@@ -538,15 +1030,27 @@ int event_start(void)
 {
 #ifdef CONFIG_IDF_TARGET_ESP8266
 	// static task allocation support is missing
-	xTaskCreate(&event_task, "events", CONFIG_EVENT_STACK_SIZE, (void*)0, 9, 0);
+	xTaskCreate(&event_task, "events", CONFIG_EVENT_STACK_SIZE, (void*)0, 9, &EventTaskH);
 #elif defined STATIC_TASK
-	xTaskCreateStatic(&event_task, "events", sizeof(EventStack), (void*)0, 9, EventStack, &EventTask);
+	EventTaskH = xTaskCreateStatic(&event_task, "events", sizeof(EventStack), (void*)0, 9, EventStack, &EventTask);
 #else
-	BaseType_t r = xTaskCreatePinnedToCore(&event_task, "events", 8*1024, (void*)0, 9, NULL, EVENT_CPU_NUM);
+	BaseType_t r = xTaskCreatePinnedToCore(&event_task, "events", 8*1024, (void*)0, 9, &EventTaskH, EVENT_CPU_NUM);
 	if (r != pdPASS) {
 		log_error(TAG,"create task: %d",r);
 		return 1;
 	}
+#endif
+#if EVENT_WORKERS > 0
+	for (unsigned i = 0; i < EVENT_WORKERS; ++i) {
+		char name[12];
+		snprintf(name,sizeof(name),"evworker%u",i);
+		BaseType_t r = xTaskCreatePinnedToCore(&event_worker, name, CONFIG_EVENT_STACK_SIZE, Workers+i, 9, NULL
+			, CONFIG_EVENT_WORKER_CPU < 0 ? tskNO_AFFINITY : CONFIG_EVENT_WORKER_CPU);
+		if (r != pdPASS) {
+			log_error(TAG,"create worker: %d",r);
+			return 1;
+		}
+	}
 #endif
 	return 0;
 }
@@ -24,6 +24,11 @@
 typedef uint16_t event_t;
 typedef uint32_t trigger_t;
 
+// event priority classes, dispatched in this order
+typedef enum {
+	ep_critical, ep_normal, ep_bulk
+} event_prio_t;
+
 
 #ifdef __cplusplus
 #include <vector>
@@ -53,11 +58,15 @@ struct EventHandler
 
 	const char *name;	// name of event
 	uint32_t occur = 0;
+	uint32_t lost = 0;	// triggers lost on full event queue
 	uint64_t time = 0;
+	bool coalesce = false;	// pending triggers without arg are dispatched once
+	bool pending = false;
 	std::vector<Callback> callbacks;
 };
 
 void event_status(Terminal &);
+void event_latency(Terminal &);
 
 trigger_t event_callback(event_t e, Action *a);
 // strdup's arg
@@ -65,7 +74,14 @@ trigger_t event_callback_arg(event_t e, Action *a, const char *arg);
 int event_cb_set_en(event_t e, Action *a, bool en);
 int event_cba_set_en(event_t e, Action *a, const char *, bool en);
 int event_detach(event_t e, Action *a);
+// activates a, serialized with other actions unless a is concurrent
+void event_activate(Action *a, void *arg);
 event_t event_register(const char *cat, const char *type = 0);
+int event_set_prio(event_t e, event_prio_t p);
+event_prio_t event_get_prio(event_t e);
+int event_set_coalesce(event_t e, bool c);
+const char *event_prio_name(event_prio_t p);
+int event_prio_parse(const char *);	// returns -1 on error
 const EventHandler *event_handler(event_t);
 extern "C" {
 #else
@@ -87,6 +103,8 @@ void event_trigger_nd(event_t id);	// no-debug version for syslog only
 // It will be free()'ed by the event infrastructure, because their might
 // be != 1 event consumers...
 void event_trigger_arg(event_t e, void *);
+// activates only action act with arg, arg is free()'ed if own is set
+void event_trigger_action(event_t e, uint16_t act, void *arg, bool own);
 void event_isr_trigger(event_t e);
 void event_isr_trigger_arg(event_t e, void *);
 void event_isr_handler(void *);		// casts arg to event and calls event_isr_trigger
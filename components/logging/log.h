@@ -34,6 +34,10 @@
 #define LOG_MAXLEN 130
 #endif
 
+// maximum size of binary log record bodies: a message of LOG_MAXLEN
+// as text record, or format id and arguments
+#define LOG_BINSIZE (LOG_MAXLEN+16)
+
 //#define MUTEX_ABORT_TIMEOUT portMAX_DELAY
 #define MUTEX_ABORT_TIMEOUT (10000/portTICK_PERIOD_MS)
 
@@ -197,6 +201,9 @@ void log_directv(log_level_t ll, logmod_t m, const char *f, va_list val);
 
 struct timeval;
 void log_syslog(log_level_t lvl, logmod_t m, const char *msg, size_t ml, struct timeval *);
+void log_syslog_bin(log_level_t lvl, logmod_t m, const uint8_t *b, size_t bl, struct timeval *);
+// formats a binary log record body, returns the length of the text
+int log_bin_format(char *out, size_t os, const uint8_t *b, size_t bl);
 
 int log_module_disable(const char *m);
 int log_module_enable(const char *m);
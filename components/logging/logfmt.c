@@ -0,0 +1,541 @@
+/*
+ *  Copyright (C) 2024, Thomas Maier-Komor
+ *  Atrium Firmware Package for ESP
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sdkconfig.h>
+#include "log.h"
+#include "logfmt.h"
+#ifndef IDF_VERSION
+#include "versions.h"
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined CONFIG_LOG_ASYNC || defined CONFIG_LOG_BINARY
+
+#ifdef CONFIG_IDF_TARGET_ESP8266
+extern const char _rodata_start[], _rodata_end[];
+#elif IDF_VERSION >= 50
+#include <esp_memory_utils.h>
+#else
+#include <soc/soc_memory_layout.h>
+#endif
+
+// conversion specification of a format string
+typedef struct LogSpec {
+	const char *start;	// points to '%'
+	int prec;		// -1 if not given
+	uint8_t nstar;		// number of '*' arguments
+	bool pstar;		// precision is a '*' argument
+	bool wide;		// 64 bit integer argument
+	char conv;		// conversion character
+} LogSpec;
+
+
+// Parses the next conversion of f into s.
+// Returns the position after the conversion or 0 at the end of f.
+static const char *log_spec(const char *f, LogSpec *s)
+{
+	for (;;) {
+		f = strchr(f,'%');
+		if (f == 0)
+			return 0;
+		if (f[1] != '%')
+			break;
+		f += 2;
+	}
+	s->start = f++;
+	s->prec = -1;
+	s->nstar = 0;
+	s->pstar = false;
+	while (*f && strchr("-+ #0",*f))
+		++f;
+	if (*f == '*') {
+		++s->nstar;
+		++f;
+	} else {
+		while ((*f >= '0') && (*f <= '9'))
+			++f;
+	}
+	if (*f == '.') {
+		++f;
+		if (*f == '*') {
+			++s->nstar;
+			s->pstar = true;
+			++f;
+		} else {
+			s->prec = 0;
+			while ((*f >= '0') && (*f <= '9'))
+				s->prec = s->prec * 10 + *f++ - '0';
+		}
+	}
+	size_t as = sizeof(int);
+	while (*f && strchr("hlzjt",*f)) {
+		if (*f == 'l')
+			as = (f[1] == 'l') ? sizeof(long long) : sizeof(long);
+		else if (*f == 'j')
+			as = sizeof(intmax_t);
+		else if ((*f == 'z') || (*f == 't'))
+			as = sizeof(size_t);
+		if ((f[0] == 'l') && (f[1] == 'l'))
+			++f;
+		++f;
+	}
+	s->wide = (as == sizeof(long long));
+	s->conv = *f;
+	return *f ? f + 1 : f;
+}
+
+
+// copies the literal text from f to e, returns the new length of out
+static size_t log_literal(char *out, size_t os, size_t n, const char *f, const char *e)
+{
+	while ((f < e) && (n + 1 < os)) {
+		out[n++] = *f;
+		f += (*f == '%') ? 2 : 1;
+	}
+	return n;
+}
+
+
+int log_fmt_static(const char *f)
+{
+#ifdef CONFIG_IDF_TARGET_ESP8266
+	return (f >= _rodata_start) && (f < _rodata_end);
+#else
+	return esp_ptr_in_drom(f);
+#endif
+}
+
+
+#define PACK(T,v) { \
+	T x = v; \
+	if (at + sizeof(T) > e) \
+		return -1; \
+	memcpy(at,&x,sizeof(T)); \
+	at += sizeof(T); \
+}
+
+int log_pack(uint8_t *b, size_t bs, const char *f, va_list val)
+{
+	uint8_t *at = b, *e = b + bs;
+	LogSpec s;
+	while ((f = log_spec(f,&s)) != 0) {
+		for (unsigned i = 0; i < s.nstar; ++i) {
+			int v = va_arg(val,int);
+			if (s.pstar && (i + 1 == s.nstar))
+				s.prec = v;
+			PACK(int,v);
+		}
+		switch (s.conv) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+			if (s.wide)
+				PACK(long long,va_arg(val,long long))
+			else
+				PACK(int,va_arg(val,int))
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			PACK(double,va_arg(val,double));
+			break;
+		case 'p':
+			PACK(void *,va_arg(val,void *));
+			break;
+		case 's':
+			{
+				const char *str = va_arg(val,const char *);
+				if (str == 0)
+					str = "(null)";
+				size_t l = (s.prec >= 0) ? strnlen(str,s.prec) : strlen(str);
+				if (at == e)
+					return -1;
+				if (at + l + 1 > e)
+					l = e - at - 1;
+				memcpy(at,str,l);
+				at[l] = 0;
+				at += l + 1;
+			}
+			break;
+		default:
+			// %n, %L, or invalid
+			return -1;
+		}
+	}
+	return at - b;
+}
+
+
+#define UNPACK(T,v) { \
+	if (a + sizeof(T) > ae) \
+		return n; \
+	memcpy(&v,a,sizeof(T)); \
+	a += sizeof(T); \
+}
+
+#define FMTARG(v) \
+	(s.nstar == 0 ? snprintf(out+n,os-n,spec,v) : \
+	 s.nstar == 1 ? snprintf(out+n,os-n,spec,st[0],v) : \
+	 snprintf(out+n,os-n,spec,st[0],st[1],v))
+
+// copies the conversion specification to spec, returns false if too long
+static bool log_specstr(char *spec, size_t ss, const LogSpec *s, const char *e)
+{
+	size_t sl = e - s->start;
+	if (sl >= ss)
+		return false;
+	memcpy(spec,s->start,sl);
+	spec[sl] = 0;
+	return true;
+}
+
+
+int log_unpack(char *out, size_t os, const char *f, const uint8_t *a, size_t al)
+{
+	const uint8_t *ae = a + al;
+	size_t n = 0;
+	LogSpec s;
+	const char *e;
+	while ((n + 1 < os) && ((e = log_spec(f,&s)) != 0)) {
+		n = log_literal(out,os,n,f,s.start);
+		f = e;
+		char spec[16];
+		if (!log_specstr(spec,sizeof(spec),&s,e))
+			return n;
+		int st[2], r;
+		for (unsigned i = 0; i < s.nstar; ++i)
+			UNPACK(int,st[i]);
+		switch (s.conv) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+			if (s.wide) {
+				long long v;
+				UNPACK(long long,v);
+				r = FMTARG(v);
+			} else {
+				int v;
+				UNPACK(int,v);
+				r = FMTARG(v);
+			}
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			{
+				double v;
+				UNPACK(double,v);
+				r = FMTARG(v);
+			}
+			break;
+		case 'p':
+			{
+				void *v;
+				UNPACK(void *,v);
+				r = FMTARG(v);
+			}
+			break;
+		case 's':
+			{
+				const char *v = (const char *)a;
+				size_t l = strnlen(v,ae-a);
+				if (a + l == ae)
+					return n;
+				a += l + 1;
+				r = FMTARG(v);
+			}
+			break;
+		default:
+			return n;
+		}
+		if (r > 0)
+			n += r;
+		if (n >= os)
+			n = os - 1;
+	}
+	if (n + 1 < os)
+		n = log_literal(out,os,n,f,f+strlen(f));
+	return n;
+}
+#endif
+
+
+#ifdef CONFIG_LOG_BINARY
+/*
+ * Binary log record body:
+ * - format id as varint: 0 for plain text, otherwise the zigzag encoded
+ *   distance of the format string to ModNames plus 1, so the host tool
+ *   can look up the format string in the ELF file
+ * - the arguments in the order of the format string:
+ *   - '*' width and precision, signed integers: zigzag varint
+ *   - unsigned integers, pointers: varint
+ *   - floating point: 64 bit double, little endian
+ *   - strings: varint length followed by the characters
+ * Strings are truncated if they do not fit into the buffer.
+ */
+
+static uint8_t *put_varint(uint8_t *at, uint8_t *e, uint64_t v)
+{
+	while (at != e) {
+		if (v < 0x80) {
+			*at++ = v;
+			return at;
+		}
+		*at++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	return 0;
+}
+
+
+static const uint8_t *get_varint(const uint8_t *at, const uint8_t *e, uint64_t *v)
+{
+	uint64_t r = 0;
+	unsigned s = 0;
+	while ((at != e) && (s < 64)) {
+		uint8_t b = *at++;
+		r |= (uint64_t)(b & 0x7f) << s;
+		if ((b & 0x80) == 0) {
+			*v = r;
+			return at;
+		}
+		s += 7;
+	}
+	return 0;
+}
+
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+
+int log_bin_text(uint8_t *b, size_t bs, const char *t, size_t tl)
+{
+	if (bs == 0)
+		return 0;
+	b[0] = 0;
+	if (tl > bs - 1)
+		tl = bs - 1;
+	memcpy(b+1,t,tl);
+	return tl + 1;
+}
+
+
+#define PUTV(v) { \
+	at = put_varint(at,e,v); \
+	if (at == 0) \
+		return -1; \
+}
+
+int log_bin_encode(uint8_t *b, size_t bs, const char *f, const uint8_t *a, size_t al)
+{
+	uint8_t *at = b, *e = b + bs;
+	const uint8_t *ae = a + al;
+	// the host tool can only resolve formats of the ELF file
+	if (!log_fmt_static(f))
+		return -1;
+	PUTV(zigzag((intptr_t)f - (intptr_t)ModNames) + 1);
+	LogSpec s;
+	while ((f = log_spec(f,&s)) != 0) {
+		for (unsigned i = 0; i < s.nstar; ++i) {
+			int v;
+			if (a + sizeof(int) > ae)
+				return -1;
+			memcpy(&v,a,sizeof(int));
+			a += sizeof(int);
+			PUTV(zigzag(v));
+		}
+		switch (s.conv) {
+		case 'd': case 'i': case 'c':
+		case 'u': case 'x': case 'X': case 'o':
+			{
+				int64_t v;
+				if (s.wide) {
+					long long x;
+					if (a + sizeof(x) > ae)
+						return -1;
+					memcpy(&x,a,sizeof(x));
+					a += sizeof(x);
+					v = x;
+				} else {
+					int x;
+					if (a + sizeof(x) > ae)
+						return -1;
+					memcpy(&x,a,sizeof(x));
+					a += sizeof(x);
+					v = ((s.conv == 'd') || (s.conv == 'i') || (s.conv == 'c')) ? (int64_t)x : (int64_t)(unsigned)x;
+				}
+				if ((s.conv == 'd') || (s.conv == 'i') || (s.conv == 'c'))
+					PUTV(zigzag(v))
+				else
+					PUTV((uint64_t)v)
+			}
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			{
+				double d;
+				if (a + sizeof(d) > ae)
+					return -1;
+				memcpy(&d,a,sizeof(d));
+				a += sizeof(d);
+				if (at + sizeof(d) > e)
+					return -1;
+				memcpy(at,&d,sizeof(d));
+				at += sizeof(d);
+			}
+			break;
+		case 'p':
+			{
+				void *v;
+				if (a + sizeof(v) > ae)
+					return -1;
+				memcpy(&v,a,sizeof(v));
+				a += sizeof(v);
+				PUTV((uintptr_t)v);
+			}
+			break;
+		case 's':
+			{
+				size_t l = strnlen((const char *)a,ae-a);
+				if (a + l == ae)
+					return -1;
+				const uint8_t *str = a;
+				a += l + 1;
+				if (at == e)
+					return -1;
+				// length varint needs at most 2 bytes here
+				size_t room = e - at - ((e - at > 128) ? 2 : 1);
+				if (l > room)
+					l = room;
+				PUTV(l);
+				memcpy(at,str,l);
+				at += l;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+	return at - b;
+}
+
+
+#define GETV(v) { \
+	a = get_varint(a,ae,&v); \
+	if (a == 0) \
+		return n; \
+}
+
+int log_bin_format(char *out, size_t os, const uint8_t *a, size_t al)
+{
+	const uint8_t *ae = a + al;
+	size_t n = 0;
+	uint64_t id;
+	if (os == 0)
+		return 0;
+	GETV(id);
+	if (id == 0) {
+		n = ae - a;
+		if (n > os - 1)
+			n = os - 1;
+		memcpy(out,a,n);
+		return n;
+	}
+	const char *f = ModNames + unzigzag(id - 1);
+	LogSpec s;
+	const char *e;
+	while ((n + 1 < os) && ((e = log_spec(f,&s)) != 0)) {
+		n = log_literal(out,os,n,f,s.start);
+		f = e;
+		char spec[16];
+		if (!log_specstr(spec,sizeof(spec),&s,e))
+			return n;
+		int st[2], r;
+		for (unsigned i = 0; i < s.nstar; ++i) {
+			uint64_t v;
+			GETV(v);
+			st[i] = unzigzag(v);
+		}
+		switch (s.conv) {
+		case 'd': case 'i': case 'c':
+		case 'u': case 'x': case 'X': case 'o':
+			{
+				uint64_t v;
+				GETV(v);
+				if ((s.conv == 'd') || (s.conv == 'i') || (s.conv == 'c'))
+					v = unzigzag(v);
+				if (s.wide)
+					r = FMTARG((long long)v);
+				else
+					r = FMTARG((int)v);
+			}
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			{
+				double v;
+				if (a + sizeof(v) > ae)
+					return n;
+				memcpy(&v,a,sizeof(v));
+				a += sizeof(v);
+				r = FMTARG(v);
+			}
+			break;
+		case 'p':
+			{
+				uint64_t v;
+				GETV(v);
+				r = FMTARG((void *)(uintptr_t)v);
+			}
+			break;
+		case 's':
+			{
+				uint64_t l;
+				GETV(l);
+				if (a + l > ae)
+					return n;
+				// the string is not terminated: print it with
+				// its length as precision
+				if ((s.prec >= 0) && (l > (uint64_t)s.prec))
+					l = s.prec;
+				char sp[sizeof(spec)+2];
+				size_t sl = strcspn(spec,".s");
+				memcpy(sp,spec,sl);
+				strcpy(sp+sl,".*s");
+				if (s.nstar > (s.pstar ? 1 : 0))
+					r = snprintf(out+n,os-n,sp,st[0],(int)l,(const char *)a);
+				else
+					r = snprintf(out+n,os-n,sp,(int)l,(const char *)a);
+				a += l;
+			}
+			break;
+		default:
+			return n;
+		}
+		if (r > 0)
+			n += r;
+		if (n >= os)
+			n = os - 1;
+	}
+	if (n + 1 < os)
+		n = log_literal(out,os,n,f,f+strlen(f));
+	return n;
+}
+#endif
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2024, Thomas Maier-Komor
+ *  Atrium Firmware Package for ESP
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGFMT_H
+#define LOGFMT_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns non-zero if f is constant data of the firmware. Only such
+// formats can be referenced after the log call returns.
+int log_fmt_static(const char *f);
+
+// Packs the arguments of f in native layout into b, strings are copied.
+// Returns the packed size or -1 if f cannot be deferred.
+int log_pack(uint8_t *b, size_t bs, const char *f, va_list val);
+
+// Formats arguments packed by log_pack with f to out.
+// Returns the length of the message in out.
+int log_unpack(char *out, size_t os, const char *f, const uint8_t *a, size_t al);
+
+// Encodes arguments packed by log_pack as binary log record body.
+// Returns the size of the body or -1 if it does not fit into b.
+int log_bin_encode(uint8_t *b, size_t bs, const char *f, const uint8_t *a, size_t al);
+
+// Stores plain text as binary log record body.
+int log_bin_text(uint8_t *b, size_t bs, const char *t, size_t tl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,6 +18,7 @@
 
 #include <sdkconfig.h>
 #include "log.h"
+#include "logfmt.h"
 #include "netsvc.h"
 #ifndef IDF_VERSION
 #include "versions.h"
@@ -49,6 +50,8 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
@@ -106,12 +109,19 @@ static int LogUart = -1;
 #ifdef HAVE_FS
 static SemaphoreHandle_t FileLock = 0;
 static int LogFile = -1;
+#ifdef CONFIG_LOG_BINARY
+static time_t FileBase = 0;
+#endif
 #endif
 
 #ifdef CONFIG_IDF_TARGET_ESP8266
 static uint32_t Start = 0;
 #endif
 
+#ifdef CONFIG_LOG_ASYNC
+static void log_async_setup(void);
+#endif
+
 const char UartPrefix[][8] = {
 	ANSI_RED	"E",
 	ANSI_PURPLE	"W",
@@ -246,6 +256,9 @@ void log_setup()
 	acmcfg.callback_line_coding_changed = 0;
 	tusb_cdc_acm_init(&acmcfg);
 #endif
+#ifdef CONFIG_LOG_ASYNC
+	log_async_setup();
+#endif
 }
 
 
@@ -265,20 +278,22 @@ void set_logfile(const char *fn)
 	if (FileLock == 0)
 		FileLock = xSemaphoreCreateMutex();
 	LogFile = open(fn,O_WRONLY|O_CREAT,0666);
+#ifdef CONFIG_LOG_BINARY
+	FileBase = 0;
+#endif
 	if (LogFile == -1)
 		log_error("log","unable to open logfile %s: %s",fn,strerror(errno));
 }
 #endif
 
 
-void log_common(log_level_t l, logmod_t m, const char *f, va_list val)
+// writes the time and module prefix to buf+8, returns the offset after it
+static int log_prefix(char *buf, logmod_t m, const struct timeval *tv)
 {
-	char buf[32+LOG_MAXLEN+1];	// 32 for the prefix
 	char *at = buf + 8;
 	int p = 8;
-	struct timeval tv;
 	const char *a = ModNames+ModNameOff[m];
-	if ((-1 == gettimeofday(&tv,0)) || (tv.tv_sec < 1E6)) {
+	if (tv->tv_sec < 1E6) {
 #ifdef CONFIG_IDF_TARGET_ESP8266
 #ifdef CONFIG_NEWLIB_LIBRARY_LEVEL_NORMAL
 		p += sprintf(at," (%6f) %s: ",(double)((float)clock()/(float)CLOCKS_PER_SEC+(float)Start),a);
@@ -286,28 +301,94 @@ void log_common(log_level_t l, logmod_t m, const char *f, va_list val)
 		p += sprintf(at," (%6lu) %s: ",clock()*1000/CLOCKS_PER_SEC+Start,a);
 #endif
 #else
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME,&ts);
-		p += sprintf(at," (%llu.%03u) %s: ",ts.tv_sec,(unsigned)(ts.tv_nsec/1E6),a);
+		p += sprintf(at," (%llu.%03u) %s: ",(unsigned long long)tv->tv_sec,(unsigned)(tv->tv_usec/1000),a);
 #endif
 	} else {
 		struct tm tm;
-		localtime_r(&tv.tv_sec,&tm);
+		localtime_r(&tv->tv_sec,&tm);
 		p += sprintf(at, " %02d:%02d:%02d.%03lu %s: "
-			, (int)tm.tm_hour, (int)tm.tm_min, (int)tm.tm_sec, tv.tv_usec/1000,a);
+			, (int)tm.tm_hour, (int)tm.tm_min, (int)tm.tm_sec, (unsigned long)tv->tv_usec/1000,a);
 	}
-	int s = vsnprintf(buf+p,sizeof(buf)-p,f,val);
-	if (s <= 0)
-		return;
+	return p;
+}
+
+
+#if defined CONFIG_LOG_BINARY && defined HAVE_FS
+/*
+ * Binary log file record:
+ * - varint: size of the remaining record
+ * - 1 byte: bits 0-2 log level, bit 3: timestamp relative to time base
+ * - 1 byte: module id
+ * - 4 bytes: timestamp in ms, little endian, relative to the time base or
+ *   since boot
+ * - record body as created by log_bin_encode
+ * A record with level 7 sets the time base. Its body holds the seconds
+ * since the epoch as 8 bytes little endian.
+ */
+static void log_file_write(uint8_t flags, logmod_t m, uint32_t ts, const uint8_t *b, size_t bl)
+{
+	uint8_t hdr[8];
+	size_t hl = 0, rl = bl + 6;
+	while (rl >= 0x80) {
+		hdr[hl++] = (rl & 0x7f) | 0x80;
+		rl >>= 7;
+	}
+	hdr[hl++] = rl;
+	hdr[hl++] = flags;
+	hdr[hl++] = m;
+	for (int i = 0; i < 4; ++i)
+		hdr[hl++] = ts >> (i << 3);
+	write(LogFile,hdr,hl);
+	write(LogFile,b,bl);
+}
+
+
+// caller holds FileLock
+static void log_file_record(log_level_t l, logmod_t m, const struct timeval *tv, const uint8_t *b, size_t bl)
+{
+	uint8_t flags = l;
+	uint32_t ts;
+	if (tv->tv_sec > 10000000) {
+		// 2^32 ms are about 49 days
+		if ((FileBase == 0) || (tv->tv_sec - FileBase > 40*24*3600) || (tv->tv_sec < FileBase)) {
+			uint8_t base[8];
+			FileBase = tv->tv_sec;
+			for (int i = 0; i < 8; ++i)
+				base[i] = (uint64_t)FileBase >> (i << 3);
+			log_file_write(7,0,0,base,sizeof(base));
+		}
+		flags |= 8;
+		ts = (tv->tv_sec - FileBase) * 1000 + tv->tv_usec / 1000;
+	} else {
+		ts = esp_timer_get_time() / 1000;
+	}
+	log_file_write(flags,m,ts,b,bl);
+}
+#endif
+
+
+// buf: prefix up to p, message up to s, and room for LOG_MAXLEN
+// f, a, al: format and arguments packed by log_pack, if f != 0
+static void log_output(log_level_t l, logmod_t m, char *buf, int p, int s, struct timeval *tv, const char *f, const uint8_t *a, size_t al)
+{
+	const size_t bs = 32+LOG_MAXLEN+1;
+#ifdef CONFIG_LOG_BINARY
+	uint8_t body[LOG_BINSIZE];
+	int bl = -1;
+	if (f)
+		bl = log_bin_encode(body,sizeof(body),f,a,al);
+	if (bl < 0)
+		bl = log_bin_text(body,sizeof(body),buf+p,(s+p < bs) ? s : bs-p-1);
+#endif
 	memcpy(buf,UartPrefix[l],8);
 	s += p;
-	if (s+2 > sizeof(buf)) {
-		buf[sizeof(buf)-3] = ']';
-		buf[sizeof(buf)-4] = '.';
-		buf[sizeof(buf)-5] = '.';
-		buf[sizeof(buf)-6] = '.';
-		buf[sizeof(buf)-7] = '[';
-		s = sizeof(buf)-2;
+	if (s+2 > bs) {
+		buf[bs-3] = ']';
+		buf[bs-4] = '.';
+		buf[bs-5] = '.';
+		buf[bs-6] = '.';
+		buf[bs-7] = '[';
+		s = bs-2;
 	}
 	buf[s++] = '\r';
 	buf[s++] = '\n';
@@ -327,13 +408,21 @@ void log_common(log_level_t l, logmod_t m, const char *f, va_list val)
 #ifdef HAVE_FS
 	if (LogFile >= 0) {
 		xSemaphoreTake(FileLock,portMAX_DELAY);
+#ifdef CONFIG_LOG_BINARY
+		log_file_record(l,m,tv,body,bl);
+#else
 		write(LogFile,buf+9,s-9);
+#endif
 		xSemaphoreGive(FileLock);
 	}
 #endif
 #ifdef CONFIG_SYSLOG
 	if ((m != MODULE_LOG) && (m != MODULE_LWTCP))
-		log_syslog(l,m,buf+p,s-p-2,&tv);
+#ifdef CONFIG_LOG_BINARY
+		log_syslog_bin(l,m,body,bl,tv);
+#else
+		log_syslog(l,m,buf+p,s-p-2,tv);
+#endif
 #endif
 #ifdef CONFIG_USB_DIAGLOG
 	if (UsbDiag)
@@ -349,6 +438,226 @@ void log_common(log_level_t l, logmod_t m, const char *f, va_list val)
 }
 
 
+#ifdef CONFIG_LOG_ASYNC
+/*
+ * Asynchronous logging:
+ * Callers reserve a slot in the ring of their core, store timestamp,
+ * module, level, format pointer, and the packed arguments, and return.
+ * The log task merges the rings by timestamp, formats the messages, and
+ * writes them to UART, file, syslog, and USB. Strings are copied, as the
+ * caller's buffers may be gone when the message gets formatted. Formats
+ * that cannot be packed are formatted by the caller instead.
+ * Errors are written synchronously, so they are visible before an abort.
+ */
+#ifndef CONFIG_LOG_ASYNC_SLOTS
+#define CONFIG_LOG_ASYNC_SLOTS 32
+#endif
+#define LOG_SLOTS CONFIG_LOG_ASYNC_SLOTS
+// packed arguments, or a message of up to LOG_MAXLEN formatted by the caller
+#if LOG_MAXLEN >= 104
+#define LOG_ARGSIZE ((LOG_MAXLEN+8)&~7)
+#else
+#define LOG_ARGSIZE 104
+#endif
+
+#if (LOG_SLOTS & (LOG_SLOTS-1)) != 0
+#error CONFIG_LOG_ASYNC_SLOTS must be a power of 2
+#endif
+
+typedef struct LogRec {
+	uint64_t us;		// gettimeofday in us
+	const char *fmt;	// 0: args holds the formatted message
+	uint8_t level, module;
+	uint16_t alen;
+	uint8_t args[LOG_ARGSIZE];
+} LogRec;
+
+// Vyukov bounded queue: a slot is free for position pos when seq == pos,
+// and holds a record when seq == pos+1
+typedef struct LogSlot {
+	uint32_t seq;
+	LogRec rec;
+} LogSlot;
+
+typedef struct LogRing {
+	uint32_t head;		// next position to reserve
+	uint32_t tail;		// next position to consume
+	LogSlot slot[LOG_SLOTS];
+} LogRing;
+
+static LogRing *Rings = 0;
+static TaskHandle_t LogTask = 0;
+static uint32_t Dropped = 0;
+
+
+static int log_push(log_level_t l, logmod_t m, const char *f, va_list val)
+{
+	LogRing *r = Rings + xPortGetCoreID();
+	uint32_t pos = __atomic_load_n(&r->head,__ATOMIC_RELAXED);
+	LogSlot *s;
+	for (;;) {
+		s = r->slot + (pos & (LOG_SLOTS-1));
+		uint32_t seq = __atomic_load_n(&s->seq,__ATOMIC_ACQUIRE);
+		int32_t d = (int32_t)(seq - pos);
+		if (d == 0) {
+			if (__atomic_compare_exchange_n(&r->head,&pos,pos+1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		} else if (d < 0) {
+			__atomic_fetch_add(&Dropped,1,__ATOMIC_RELAXED);
+			return 0;
+		} else {
+			pos = __atomic_load_n(&r->head,__ATOMIC_RELAXED);
+		}
+	}
+	LogRec *rec = &s->rec;
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	rec->us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	rec->level = l;
+	rec->module = m;
+	// formats that might change or vanish are formatted right away
+	int n = -1;
+	if (log_fmt_static(f)) {
+		va_list cpy;
+		va_copy(cpy,val);
+		n = log_pack(rec->args,sizeof(rec->args),f,cpy);
+		va_end(cpy);
+	}
+	if (n >= 0) {
+		rec->fmt = f;
+	} else {
+		// same limit as for synchronous messages
+		n = vsnprintf((char *)rec->args,LOG_MAXLEN+1,f,val);
+		if (n < 0)
+			n = 0;
+		else if (n > LOG_MAXLEN)
+			n = LOG_MAXLEN;
+		rec->fmt = 0;
+	}
+	rec->alen = n;
+	__atomic_store_n(&s->seq,pos+1,__ATOMIC_RELEASE);
+	xTaskNotifyGive(LogTask);
+	return 1;
+}
+
+
+static LogRec *log_peek(LogRing *r)
+{
+	LogSlot *s = r->slot + (r->tail & (LOG_SLOTS-1));
+	if (__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE) == r->tail + 1)
+		return &s->rec;
+	return 0;
+}
+
+
+static void log_release(LogRing *r)
+{
+	LogSlot *s = r->slot + (r->tail & (LOG_SLOTS-1));
+	__atomic_store_n(&s->seq,r->tail + LOG_SLOTS,__ATOMIC_RELEASE);
+	++r->tail;
+}
+
+
+static void log_write_rec(const LogRec *rec)
+{
+	char buf[32+LOG_MAXLEN+1];
+	struct timeval tv;
+	tv.tv_sec = rec->us / 1000000;
+	tv.tv_usec = rec->us % 1000000;
+	int p = log_prefix(buf,(logmod_t)rec->module,&tv);
+	int s;
+	if (rec->fmt) {
+		s = log_unpack(buf+p,sizeof(buf)-p,rec->fmt,rec->args,rec->alen);
+	} else {
+		s = rec->alen;
+		memcpy(buf+p,rec->args,s);
+	}
+	if (s > 0)
+		log_output((log_level_t)rec->level,(logmod_t)rec->module,buf,p,s,&tv,rec->fmt,rec->args,rec->alen);
+}
+
+
+static void log_task(void *ignored)
+{
+	uint32_t dropped = 0;
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+		for (;;) {
+			// oldest record of all cores first
+			LogRing *ring = 0;
+			LogRec *oldest = 0;
+			for (unsigned c = 0; c < portNUM_PROCESSORS; ++c) {
+				LogRec *r = log_peek(Rings+c);
+				if (r && ((oldest == 0) || (r->us < oldest->us))) {
+					ring = Rings+c;
+					oldest = r;
+				}
+			}
+			if (oldest == 0)
+				break;
+			log_write_rec(oldest);
+			log_release(ring);
+		}
+		uint32_t d = __atomic_load_n(&Dropped,__ATOMIC_RELAXED);
+		if (d != dropped) {
+			log_direct(ll_warn,MODULE_LOG,"%u messages dropped",d-dropped);
+			dropped = d;
+		}
+	}
+}
+
+
+static void log_async_setup(void)
+{
+	Rings = (LogRing *) calloc(portNUM_PROCESSORS,sizeof(LogRing));
+	for (unsigned c = 0; c < portNUM_PROCESSORS; ++c) {
+		for (uint32_t i = 0; i < LOG_SLOTS; ++i)
+			Rings[c].slot[i].seq = i;
+	}
+	if (pdPASS != xTaskCreate(log_task,"log",3072,0,1,&LogTask))
+		LogTask = 0;
+}
+#endif
+
+
+void log_common(log_level_t l, logmod_t m, const char *f, va_list val)
+{
+#ifdef CONFIG_LOG_ASYNC
+	if ((l > ll_error) && LogTask && (xTaskGetCurrentTaskHandle() != LogTask) && !xPortInIsrContext()) {
+		log_push(l,m,f,val);
+		return;
+	}
+#endif
+	char buf[32+LOG_MAXLEN+1];	// 32 for the prefix
+	struct timeval tv;
+	if (-1 == gettimeofday(&tv,0)) {
+		int64_t now = esp_timer_get_time();
+		tv.tv_sec = now / 1000000;
+		tv.tv_usec = now % 1000000;
+	}
+	int p = log_prefix(buf,m,&tv);
+#ifdef CONFIG_LOG_BINARY
+	// only constant formats get a format id, others are stored as text
+	uint8_t args[LOG_MAXLEN];
+	int al = -1;
+	if (log_fmt_static(f)) {
+		va_list cpy;
+		va_copy(cpy,val);
+		al = log_pack(args,sizeof(args),f,cpy);
+		va_end(cpy);
+	}
+#endif
+	int s = vsnprintf(buf+p,sizeof(buf)-p,f,val);
+	if (s <= 0)
+		return;
+#ifdef CONFIG_LOG_BINARY
+	log_output(l,m,buf,p,s,&tv,al >= 0 ? f : 0,args,al);
+#else
+	log_output(l,m,buf,p,s,&tv,0,0,0);
+#endif
+}
+
+
 void log_direct(log_level_t ll, logmod_t m, const char *f, ...)
 {
 	va_list val;
@@ -23,12 +23,14 @@
 #include "udns.h"
 #include "tcpio.h"
 
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
 #include <lwip/inet.h>
 #include <lwip/tcpip.h>
 #include <lwip/priv/tcpip_priv.h>
+#include <lwip/priv/tcp_priv.h>
 
 #include <string.h>
 
@@ -89,7 +91,7 @@ LwTcp::LwTcp()
 LwTcp::~LwTcp()
 {
 	log_local(TAG,"~%u: %u",m_port,m_total);
-	if (m_pcb) 
+	if (m_pcb || m_closing)
 		close();
 	if (m_pbuf) {
 #if LWIP_TCPIP_CORE_LOCKING == 1
@@ -117,12 +119,14 @@ LwTcp::~LwTcp()
 void LwTcp::close_fn(void *arg)
 {
 	LwTcp *a = (LwTcp *)arg;
-	tcp_err(a->m_pcb,0);
-	tcp_recv(a->m_pcb,0);
-	tcp_sent(a->m_pcb,0);
-	if (a->m_pcb) {
-		a->m_err = tcp_close(a->m_pcb);
+	if (struct tcp_pcb *pcb = a->m_pcb ? a->m_pcb : a->m_closing) {
+		tcp_err(pcb,0);
+		tcp_recv(pcb,0);
+		tcp_sent(pcb,0);
+		tcp_poll(pcb,0,0);
+		a->m_err = tcp_close(pcb);
 		a->m_pcb = 0;
+		a->m_closing = 0;
 	}
 	xSemaphoreGive(a->m_lwip);
 }
@@ -131,17 +135,19 @@ void LwTcp::close_fn(void *arg)
 
 int LwTcp::close()
 {
-	if (m_pcb == 0)
+	if ((m_pcb == 0) && (m_closing == 0))
 		return -1;
 #if LWIP_TCPIP_CORE_LOCKING == 1
 	LWIP_LOCK();
-	tcp_err(m_pcb,0);
-	tcp_recv(m_pcb,0);
-	tcp_sent(m_pcb,0);
 	err_t e = 0;
-	if (m_pcb) {
-		e = tcp_close(m_pcb);
+	if (struct tcp_pcb *pcb = m_pcb ? m_pcb : m_closing) {
+		tcp_err(pcb,0);
+		tcp_recv(pcb,0);
+		tcp_sent(pcb,0);
+		tcp_poll(pcb,0,0);
+		e = tcp_close(pcb);
 		m_pcb = 0;
+		m_closing = 0;
 	}
 	LWIP_UNLOCK();
 	m_err = e;
@@ -238,11 +244,13 @@ void LwTcp::handle_err(void *arg, err_t e)
 		log_warn(TAG,"error@%u %d",P->m_port,e);
 		P->m_err = e;
 		P->m_pcb = 0;
+		P->m_closing = 0;	// already freed by LwIP
 	}
 	if (pdFALSE == xSemaphoreGive(P->m_sem))
 		log_local(TAG,"m_sem");
 	if (pdFALSE == xSemaphoreGive(P->m_send))
 		log_local(TAG,"m_send");
+	P->wake();
 }
 
 
@@ -254,9 +262,11 @@ err_t LwTcp::handle_sent(void *arg, struct tcp_pcb *pcb, u16_t l)
 	log_devel(TAG,"sent@%u %u/%u",pcb->local_port,l,P->m_nwrite);
 	assert(l <= P->m_nwrite);
 	P->m_nwrite -= l;
-	if (P->m_nwrite == 0)
+	if ((P->m_nwrite == 0) || P->m_sndwait) {
+		P->m_sndwait = false;
 		if (pdFALSE == xSemaphoreGive(P->m_send))
 			log_local(TAG,"@%u m_send already set",P->m_port);
+	}
 	return 0;
 }
 
@@ -303,6 +313,9 @@ err_t LwTcp::handle_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *pbuf, err_
 			log_devel(TAG,"concat %u@%u => %u",P->m_pbuf->tot_len,P->m_port,P->m_pbuf->tot_len);
 		} else {
 			log_devel(TAG,"recv %u@%u, ERR_MEM",pbuf->tot_len,pcb->local_port);
+			// LwIP keeps the pbuf and retries on its timer or after
+			// the reader has freed some data
+			P->m_refused = true;
 			give = false;
 			recved = 0;
 			r = ERR_MEM;
@@ -317,6 +330,7 @@ err_t LwTcp::handle_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *pbuf, err_
 			} else {
 				log_devel(TAG,"recv give %d",r);
 			}
+			P->wake();
 		}
 		return r;
 	} else if (e != 0) {
@@ -327,8 +341,10 @@ err_t LwTcp::handle_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *pbuf, err_
 		}
 	} else if (pbuf == 0) {
 		log_local(TAG,"recv@%u pbuf=0/FIN",pcb->local_port);
+		P->m_closing = pcb;
 		P->m_pcb = 0;
 		xSemaphoreGive(P->m_sem);
+		P->wake();
 	} else {
 		abort();
 	}
@@ -371,20 +387,7 @@ int LwTcp::read(char *buf, size_t l, unsigned timeout)
 		log_devel(TAG,"avail %u, copy %u, taken %u",avail,copy,m_taken);
 		assert(m_taken+copy <= m_pbuf->tot_len);
 		pbuf_copy_partial(m_pbuf,buf,copy,m_taken);
-		m_taken += copy;
-		if (m_taken == m_pbuf->tot_len) {
-			log_devel(TAG,"total free",m_taken);
-			tofree = m_pbuf;
-			m_pbuf = 0;
-			m_taken = 0;
-		} else if (m_pbuf->len <= m_taken) {
-			tofree = m_pbuf;
-			do {
-				m_taken -= m_pbuf->len;
-				m_pbuf = m_pbuf->next;
-			} while (m_pbuf->len <= m_taken); 
-			pbuf_ref(m_pbuf);
-		}
+		tofree = consume(copy);
 		r = copy;
 	} else if (timeout == 0) {
 		log_devel(TAG,"non-blocking");
@@ -420,18 +423,8 @@ int LwTcp::read(char *buf, size_t l, unsigned timeout)
 		}
 	}
 	xSemaphoreGiveRecursive(m_mtx);
-	if (tofree) {
-#if LWIP_TCPIP_CORE_LOCKING != 0
-		LWIP_LOCK();
-		pbuf_free(tofree);
-		LWIP_UNLOCK();
-#else
-		tcp_pbuf_arg_t a;
-		a.pbuf = tofree;
-		a.sem = m_lwip;
-		tcpip_send_msg_wait_sem(tcp_pbuf_free_fn,&a,&m_lwip);
-#endif
-	}
+	if (tofree)
+		freePbuf(tofree);
 	log_local(TAG,"read@%u(%u)=%d",m_port,l,r);
 	if (r > 0)
 		m_total += r;
@@ -439,6 +432,133 @@ int LwTcp::read(char *buf, size_t l, unsigned timeout)
 }
 
 
+// must be called with m_mtx held
+// returns the pbufs that have been consumed completely
+struct pbuf *LwTcp::consume(size_t l)
+{
+	struct pbuf *tofree = 0;
+	m_taken += l;
+	assert(m_taken <= m_pbuf->tot_len);
+	if (m_taken == m_pbuf->tot_len) {
+		log_devel(TAG,"total free",m_taken);
+		tofree = m_pbuf;
+		m_pbuf = 0;
+		m_taken = 0;
+	} else if (m_pbuf->len <= m_taken) {
+		tofree = m_pbuf;
+		do {
+			m_taken -= m_pbuf->len;
+			m_pbuf = m_pbuf->next;
+		} while (m_pbuf->len <= m_taken); 
+		pbuf_ref(m_pbuf);
+	}
+	return tofree;
+}
+
+
+struct free_arg_t
+{
+	LwTcp *con;
+	struct pbuf *pbuf;
+};
+
+
+// executed in LwIP context
+void LwTcp::free_fn(void *arg)
+{
+	free_arg_t *a = (free_arg_t *)arg;
+	LwTcp *c = a->con;
+	pbuf_free(a->pbuf);
+	if (c->m_refused && c->m_pcb) {
+		// deliver refused data now instead of on the next timer
+		c->m_refused = false;
+		tcp_process_refused_data(c->m_pcb);
+	}
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	xSemaphoreGive(c->m_lwip);
+#endif
+}
+
+
+void LwTcp::freePbuf(struct pbuf *p)
+{
+	free_arg_t a;
+	a.con = this;
+	a.pbuf = p;
+#if LWIP_TCPIP_CORE_LOCKING == 1
+	LWIP_LOCK();
+	free_fn(&a);
+	LWIP_UNLOCK();
+#else
+	tcpip_send_msg_wait_sem(free_fn,&a,&m_lwip);
+#endif
+}
+
+
+// Zero-copy read: waits for data like read() and fills up to n spans
+// that point into the received pbufs. Returns the number of bytes in
+// the spans, 0 at the end of the stream, or -1 on error or timeout.
+// Unused spans are set to size 0.
+// The data stays valid until release(), which must be called before
+// the next borrow() or read().
+int LwTcp::borrow(LwTcpSpan *spans, unsigned n, unsigned timeout)
+{
+	if (pdTRUE != xSemaphoreTakeRecursive(m_mtx,MUTEX_ABORT_TIMEOUT))
+		abort_on_mutex(m_mtx,__FUNCTION__);
+	PROFILE_FUNCTION();
+	// without m_buf received pbufs are queued as they are
+	assert(m_buf == 0);
+	while ((m_pbuf == 0) && (m_pcb != 0) && (m_pcb->state <= ESTABLISHED)) {
+		xSemaphoreGiveRecursive(m_mtx);
+		log_local(TAG,"wait borrow on %u",m_port);
+		if (pdTRUE != xSemaphoreTake(m_sem,timeout)) {
+			log_local(TAG,"borrow@%u: timeout",m_port);
+			return -1;
+		}
+		if (pdTRUE != xSemaphoreTakeRecursive(m_mtx,MUTEX_ABORT_TIMEOUT))
+			abort_on_mutex(m_mtx,__FUNCTION__);
+	}
+	int r = 0;
+	if (m_pbuf) {
+		struct pbuf *p = m_pbuf;
+		unsigned off = m_taken;
+		unsigned i = 0;
+		for (; (i < n) && p; ++i) {
+			spans[i].data = (const char *)p->payload + off;
+			spans[i].size = p->len - off;
+			r += p->len - off;
+			off = 0;
+			p = p->next;
+		}
+		for (; i < n; ++i) {
+			spans[i].data = 0;
+			spans[i].size = 0;
+		}
+	} else if (m_pcb != 0) {
+		log_local(TAG,"borrow@%u error state %d",m_port,m_pcb->state);
+		r = -1;
+	}
+	xSemaphoreGiveRecursive(m_mtx);
+	log_local(TAG,"borrow@%u=%d",m_port,r);
+	return r;
+}
+
+
+// Releases l bytes of the borrowed data.
+void LwTcp::release(size_t l)
+{
+	if (l == 0)
+		return;
+	if (pdTRUE != xSemaphoreTakeRecursive(m_mtx,MUTEX_ABORT_TIMEOUT))
+		abort_on_mutex(m_mtx,__FUNCTION__);
+	struct pbuf *tofree = consume(l);
+	xSemaphoreGiveRecursive(m_mtx);
+	if (tofree)
+		freePbuf(tofree);
+	m_total += l;
+}
+
+
 int LwTcp::send(const char *buf, size_t l, bool copy)
 {
 	if (l == 0)
@@ -523,6 +643,120 @@ int LwTcp::write(const char *buf, size_t l, bool copy)
 }
 
 
+struct stream_arg_t
+{
+	LwTcp *con;
+	const char *data;
+	size_t size;
+	bool copy;
+	err_t err;
+};
+
+
+// executed in LwIP context
+// queues as much as the send buffer takes and returns the amount in size
+void LwTcp::stream_fn(void *arg)
+{
+	stream_arg_t *a = (stream_arg_t *)arg;
+	LwTcp *c = a->con;
+	size_t n = 0;
+	if (c->m_pcb == 0) {
+		a->err = ERR_CLSD;
+	} else {
+		n = tcp_sndbuf(c->m_pcb);
+		if (n > a->size)
+			n = a->size;
+		a->err = 0;
+		if (n > 0) {
+			uint8_t f = a->copy ? TCP_WRITE_FLAG_COPY : 0;
+			if (n < a->size)
+				f |= TCP_WRITE_FLAG_MORE;
+			a->err = tcp_write(c->m_pcb,a->data,n,f);
+			if (a->err == ERR_MEM) {
+				// segment queue is full
+				a->err = 0;
+				n = 0;
+			}
+		}
+		if (a->err == 0) {
+			if (n) {
+				RLock lock(c->m_mtx);
+				c->m_nwrite += n;
+				tcp_output(c->m_pcb);
+			} else {
+				// wake up on next acknowledgement
+				c->m_sndwait = true;
+			}
+		}
+	}
+	a->size = a->err ? 0 : n;
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	xSemaphoreGive(c->m_lwip);
+#endif
+}
+
+
+// Sends data in chunks that fit into the send window. Without copy the
+// data must stay valid until it has been acknowledged, e.g. mmapped
+// flash. Blocks only while the send buffer is full.
+int LwTcp::stream(const char *data, size_t l, bool copy)
+{
+	PROFILE_FUNCTION();
+	stream_arg_t a;
+	a.con = this;
+	a.copy = copy;
+	while (l) {
+		a.data = data;
+		a.size = l;
+#if LWIP_TCPIP_CORE_LOCKING == 1
+		LWIP_LOCK();
+		stream_fn(&a);
+		LWIP_UNLOCK();
+#else
+		tcpip_send_msg_wait_sem(stream_fn,&a,&m_lwip);
+#endif
+		if (a.err) {
+			log_local(TAG,"stream@%u error %d",m_port,a.err);
+			m_err = a.err;
+			return -1;
+		}
+		if (a.size == 0) {
+			log_devel(TAG,"stream@%u wait",m_port);
+			xSemaphoreTake(m_send,100/portTICK_PERIOD_MS);
+		}
+		data += a.size;
+		l -= a.size;
+	}
+	return 0;
+}
+
+
+// Queues a copy of as much data as the send buffer takes without
+// blocking. Returns the number of bytes queued or -1 on error.
+int LwTcp::trywrite(const char *data, size_t l)
+{
+	PROFILE_FUNCTION();
+	stream_arg_t a;
+	a.con = this;
+	a.data = data;
+	a.size = l;
+	a.copy = true;
+#if LWIP_TCPIP_CORE_LOCKING == 1
+	LWIP_LOCK();
+	stream_fn(&a);
+	LWIP_UNLOCK();
+#else
+	tcpip_send_msg_wait_sem(stream_fn,&a,&m_lwip);
+#endif
+	if (a.err) {
+		log_local(TAG,"trywrite@%u error %d",m_port,a.err);
+		m_err = a.err;
+		return -1;
+	}
+	return a.size;
+}
+
+
 void LwTcp::sync(bool block)
 {
 	PROFILE_FUNCTION();
@@ -571,12 +805,43 @@ LwTcpListener::LwTcpListener(uint16_t port, void (*session)(LwTcp *), const char
 , m_port(port)
 , m_stack(stack)
 , m_prio(prio)
+{
+	listen();
+}
+
+
+LwTcpListener::LwTcpListener(uint16_t port, pool_session_t session, const char *name, uint16_t stack, uint8_t prio, uint8_t workers, uint8_t queue, uint16_t bufsize, uint16_t idle)
+: m_next(First)
+, m_name(name)
+, m_port(port)
+, m_stack(stack)
+, m_prio(prio)
+, m_pool(session)
+, m_queue(xQueueCreate(queue+workers,sizeof(LwTcp *)))
+, m_start(esp_timer_get_time())
+, m_bufsize(bufsize)
+, m_idle(idle)
+{
+	// the queue also takes resumed keep-alive sessions
+	for (unsigned i = 0; i < workers; ++i) {
+		char tn[configMAX_TASK_NAME_LEN];
+		snprintf(tn,sizeof(tn),"%s%u",name,i);
+		if (pdTRUE == xTaskCreatePinnedToCore(worker,tn,stack,this,prio,NULL,PRO_CPU_NUM))
+			++m_workers;
+		else
+			log_warn(TAG,"cannot create worker %s",tn);
+	}
+	listen();
+}
+
+
+void LwTcpListener::listen()
 {
 #if LWIP_TCPIP_CORE_LOCKING == 1
 	LWIP_LOCK();
 	m_pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
-	if (err_t e = tcp_bind(m_pcb,IP_ADDR_ANY,port)) {
-		log_warn(TAG,"binding to port %d: %d",(int)port,e);
+	if (err_t e = tcp_bind(m_pcb,IP_ADDR_ANY,m_port)) {
+		log_warn(TAG,"binding to port %d: %d",(int)m_port,e);
 	} else {
 		m_pcb = tcp_listen(m_pcb);
 		tcp_arg(m_pcb,this);
@@ -594,7 +859,7 @@ LwTcpListener::LwTcpListener(uint16_t port, void (*session)(LwTcp *), const char
 	strcat(svc,"._tcp");
 	udns_add_ptr(svc);
 	*/
-	log_local(TAG,"listening on port %u",(unsigned) port);
+	log_local(TAG,"listening on port %u",(unsigned) m_port);
 	First = this;
 }
 
@@ -652,6 +917,19 @@ err_t LwTcpListener::handle_accept(void *arg, struct tcp_pcb *pcb, err_t x)
 			log_localx(TAG,"%s disabled: rejecting %s:%u",P->m_name,inet_ntoa(pcb->remote_ip),(int)pcb->remote_port);
 			return 1;
 		}
+		if (P->m_pool) {
+			// keep one slot per worker for resumed sessions
+			if (uxQueueSpacesAvailable(P->m_queue) <= P->m_workers) {
+				++P->m_rejected;
+				log_local(TAG,"%s: accept queue full",P->m_name);
+				return ERR_MEM;
+			}
+			LwTcp *N = new LwTcp(pcb);
+			N->m_listener = P;
+			++P->m_accepted;
+			xQueueSendToBack(P->m_queue,&N,0);
+			return 0;
+		}
 		LwTcp *N = new LwTcp(pcb);
 		char name[24];
 		sprintf(name,"%s%u",P->m_name,(unsigned)++P->m_id);
@@ -666,6 +944,192 @@ err_t LwTcpListener::handle_accept(void *arg, struct tcp_pcb *pcb, err_t x)
 }
 
 
+// executed in LwIP context
+void LwTcp::wake()
+{
+	if (!m_parked)
+		return;
+	m_parked = false;
+	--m_listener->m_nparked;
+	LwTcp *self = this;
+	if (pdTRUE == xQueueSendToBack(m_listener->m_queue,&self,0)) {
+		++m_listener->m_resumed;
+	} else {
+		// The pcb might be freed already, so there might be no
+		// further poll. The workers retry when the queue has room.
+		log_local(TAG,"@%u resume deferred",m_port);
+		m_resume = m_listener->m_pending;
+		m_listener->m_pending = this;
+	}
+}
+
+
+struct resume_arg_t
+{
+	LwTcpListener *listener;
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	SemaphoreHandle_t sem;
+#endif
+};
+
+
+// executed in LwIP context
+void LwTcpListener::resume_fn(void *arg)
+{
+	resume_arg_t *a = (resume_arg_t *)arg;
+	LwTcpListener *L = a->listener;
+	while (LwTcp *c = L->m_pending) {
+		if (pdTRUE != xQueueSendToBack(L->m_queue,&c,0))
+			break;
+		L->m_pending = c->m_resume;
+		c->m_resume = 0;
+		++L->m_resumed;
+	}
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	xSemaphoreGive(a->sem);
+#endif
+}
+
+
+// executed in LwIP context, only set for parked sessions
+err_t LwTcp::handle_poll(void *arg, struct tcp_pcb *pcb)
+{
+	LwTcp *P = (LwTcp *)arg;
+	if ((P == 0) || !P->m_parked)
+		return 0;
+	if ((P->m_pbuf == 0) && ((uint32_t)(esp_timer_get_time()/1000) - P->m_parkts > P->m_listener->m_idle*1000U)) {
+		log_local(TAG,"@%u idle timeout",P->m_port);
+		P->m_expired = true;
+	}
+	if (P->m_pbuf || P->m_expired)
+		P->wake();
+	return 0;
+}
+
+
+struct park_arg_t
+{
+	LwTcp *con;
+	bool parked;
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	SemaphoreHandle_t sem;
+#endif
+};
+
+
+// executed in LwIP context
+void LwTcp::park_fn(void *arg)
+{
+	park_arg_t *a = (park_arg_t *)arg;
+	LwTcp *c = a->con;
+	a->parked = (c->m_pcb != 0);
+	if (a->parked) {
+		c->m_parked = true;
+		c->m_parkts = esp_timer_get_time()/1000;
+		++c->m_listener->m_nparked;
+		tcp_poll(c->m_pcb,handle_poll,2);
+		// data may have arrived after the session returned
+		if (c->m_pbuf)
+			c->wake();
+	}
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	xSemaphoreGive(a->sem);
+#endif
+}
+
+
+// Returns false if the connection is gone and must be deleted.
+// Otherwise the connection must not be accessed anymore by the caller.
+bool LwTcp::park()
+{
+	park_arg_t a;
+	a.con = this;
+#if LWIP_TCPIP_CORE_LOCKING == 1
+	LWIP_LOCK();
+	park_fn(&a);
+	LWIP_UNLOCK();
+#else
+	a.sem = m_lwip;
+	tcpip_send_msg_wait_sem(park_fn,&a,&m_lwip);
+#endif
+	return a.parked;
+}
+
+
+void LwTcp::countRequest()
+{
+	++m_nreq;
+	if (m_listener)
+		++m_listener->m_requests;
+}
+
+
+void LwTcpListener::worker(void *arg)
+{
+	LwTcpListener *L = (LwTcpListener *) arg;
+	char *buf = (char *) malloc(L->m_bufsize);
+	if (buf == 0) {
+		log_warn(TAG,"%s: out of memory",L->m_name);
+		--L->m_workers;
+		vTaskDelete(0);
+		return;
+	}
+	resume_arg_t ra;
+	ra.listener = L;
+#if LWIP_TCPIP_CORE_LOCKING == 0
+	ra.sem = xSemaphoreCreateBinary();
+#endif
+	for (;;) {
+		LwTcp *con;
+		if (pdTRUE != xQueueReceive(L->m_queue,&con,portMAX_DELAY))
+			continue;
+		if (L->m_pending) {
+			// the queue has room for a deferred session now
+#if LWIP_TCPIP_CORE_LOCKING == 1
+			LWIP_LOCK();
+			resume_fn(&ra);
+			LWIP_UNLOCK();
+#else
+			tcpip_send_msg_wait_sem(resume_fn,&ra,&ra.sem);
+#endif
+		}
+		if (!con->m_expired && (con->isConnected() || con->hasData())) {
+			++L->m_nbusy;
+			int64_t start = esp_timer_get_time();
+			bool keep = L->m_pool(con,buf,L->m_bufsize);
+			L->m_busy += esp_timer_get_time() - start;
+			--L->m_nbusy;
+			if (con->m_detached) {
+				con->handOver();
+				continue;
+			}
+			if (keep && con->park())
+				continue;
+		}
+		log_local(TAG,"%s: closing @%u",L->m_name,con->m_port);
+		con->close();
+		delete con;
+	}
+}
+
+
+unsigned LwTcpListener::utilisation() const
+{
+	int64_t dt = (esp_timer_get_time() - m_start) * m_workers;
+	if (dt <= 0)
+		return 0;
+	return (unsigned)(m_busy * 100 / dt);
+}
+
+
+extern "C" 
+int listen_pool(int port, bool (*session)(LwTcp *, char *, size_t), const char *basename, unsigned prio, unsigned stack, unsigned workers, unsigned queue, unsigned bufsize, unsigned idle)
+{
+	LwTcpListener *server = new LwTcpListener(port,session,basename,stack,prio,workers,queue,bufsize,idle);
+	return (server == 0);
+}
+
+
 extern "C" 
 int listen_port(int port, int mode, void (*session)(LwTcp*), const char *basename, const char *service, unsigned prio, unsigned stack)
 {
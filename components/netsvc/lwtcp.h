@@ -23,6 +23,7 @@
 
 #include <lwip/tcp.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include <freertos/semphr.h>
 
 #ifndef LWIP_TCPIP_CORE_LOCKING
@@ -32,6 +33,15 @@
 
 extern "C" const char *strlwiperr(int e);
 
+class LwTcpListener;
+
+// received data inside the pbuf chain of a connection
+struct LwTcpSpan
+{
+	const char *data;
+	size_t size;
+};
+
 class LwTcp
 {
 	public:
@@ -42,7 +52,11 @@ class LwTcp
 	int connect(ip_addr_t *a, uint16_t port, bool block = true);
 	bool isConnected() const;
 	int write(const char *data, size_t l, bool = true);
+	int stream(const char *data, size_t l, bool copy = false);
+	int trywrite(const char *data, size_t l);
 	int read(char *data, size_t l, unsigned timeout = portMAX_DELAY);
+	int borrow(LwTcpSpan *spans, unsigned n, unsigned timeout = portMAX_DELAY);
+	void release(size_t l);
 	void sync(bool = true);
 	int close();
 
@@ -54,6 +68,32 @@ class LwTcp
 
 	err_t getError() const
 	{ return m_err; }
+
+	// received data is waiting to be read
+	bool hasData() const
+	{ return m_pbuf != 0; }
+
+	void countRequest();
+
+	// requests served on this connection
+	unsigned numRequests() const
+	{ return m_nreq; }
+
+	// The session hands the connection over to another owner, which
+	// becomes responsible for close and delete.
+	void detach()
+	{ m_detached = true; }
+
+	bool isDetached() const
+	{ return m_detached; }
+
+	// Last access of the session to a detached connection. Before,
+	// the new owner must not close or delete it.
+	void handOver()
+	{ __atomic_store_n(&m_handed,true,__ATOMIC_RELEASE); }
+
+	bool isHandedOver() const
+	{ return __atomic_load_n(&m_handed,__ATOMIC_ACQUIRE); }
 	
 	private:
 	LwTcp(struct tcp_pcb *);
@@ -65,14 +105,27 @@ class LwTcp
 	static void handle_err(void *arg, err_t e);
 	static err_t handle_sent(void *arg, struct tcp_pcb *pcb, u16_t l);
 	static err_t handle_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *pbuf, err_t e);
+	static err_t handle_poll(void *arg, struct tcp_pcb *pcb);
 	static void connect_fn(void *);
 	static void close_fn(void *);
+	static void park_fn(void *);
+	static void stream_fn(void *);
+	static void free_fn(void *);
+	struct pbuf *consume(size_t);
+	void freePbuf(struct pbuf *);
+	bool park();
+	void wake();
 
 	struct tcp_pcb *m_pcb = 0;
+	struct tcp_pcb *m_closing = 0;	// received FIN, needs tcp_close
+	LwTcpListener *m_listener = 0;	// set for pool sessions
+	LwTcp *m_resume = 0;		// next in LwTcpListener::m_pending
+	uint32_t m_parkts = 0;
 	char *m_buf = 0;
 	struct pbuf *m_pbuf = 0;
 	unsigned m_total = 0;
 	uint16_t m_port = 0, m_bufsize = 0, m_fill = 0, m_taken = 0, m_nwrite = 0, m_nout = 0;
+	uint16_t m_nreq = 0;
 	err_t m_err = 0;
 	SemaphoreHandle_t m_sem, m_send, m_mtx;
 #if LWIP_TCPIP_CORE_LOCKING == 0
@@ -80,15 +133,24 @@ class LwTcp
 	SemaphoreHandle_t m_lwip;
 #endif
 	bool m_sync = true;
+	bool m_parked = false, m_expired = false, m_detached = false, m_handed = false;
+	bool m_sndwait = false, m_refused = false;
 
 	friend class LwTcpListener;
 };
 
 
+// A listener either creates a task per connection, or hands
+// connections to a fixed pool of worker tasks. Pool sessions return true
+// to keep the connection alive. Kept connections are parked without a
+// worker until new data arrives or the idle timeout expires.
 class LwTcpListener
 {
 	public:
+	typedef bool (*pool_session_t)(LwTcp *, char *, size_t);
+
 	LwTcpListener(uint16_t port, void (*)(LwTcp *), const char *, uint16_t, uint8_t);
+	LwTcpListener(uint16_t port, pool_session_t, const char *, uint16_t stack, uint8_t prio, uint8_t workers, uint8_t queue, uint16_t bufsize, uint16_t idle);
 	~LwTcpListener();
 
 	static LwTcpListener *getFirst()
@@ -108,6 +170,36 @@ class LwTcpListener
 
 	uint16_t getPort() const
 	{ return m_port; }
+
+	bool isPool() const
+	{ return m_pool != 0; }
+
+	unsigned numWorkers() const
+	{ return m_workers; }
+
+	unsigned numBusy() const
+	{ return m_nbusy; }
+
+	unsigned numParked() const
+	{ return m_nparked; }
+
+	unsigned numQueued() const
+	{ return m_queue ? uxQueueMessagesWaiting(m_queue) : 0; }
+
+	unsigned numAccepted() const
+	{ return m_accepted; }
+
+	unsigned numRequests() const
+	{ return m_requests; }
+
+	unsigned numRejected() const
+	{ return m_rejected; }
+
+	unsigned numResumed() const
+	{ return m_resumed; }
+
+	// percentage of time the workers were busy
+	unsigned utilisation() const;
 	
 	private:
 	LwTcpListener(const LwTcp &);
@@ -117,6 +209,9 @@ class LwTcpListener
 	static void handle_err(void *arg, err_t e);
 	static void abort_fn(void *);
 	static void create_fn(void *);
+	static void resume_fn(void *);
+	static void worker(void *);
+	void listen();
 
 	static LwTcpListener *First;
 	LwTcpListener *m_next = 0;
@@ -129,6 +224,16 @@ class LwTcpListener
 #if LWIP_TCPIP_CORE_LOCKING == 0
 	SemaphoreHandle_t m_lwip;
 #endif
+	pool_session_t m_pool = 0;
+	QueueHandle_t m_queue = 0;
+	LwTcp *m_pending = 0;	// woken sessions that did not fit into m_queue
+	int64_t m_start = 0, m_busy = 0;
+	unsigned m_accepted = 0, m_requests = 0, m_rejected = 0, m_resumed = 0;
+	uint16_t m_bufsize = 0, m_idle = 0;
+	uint16_t m_nparked = 0;
+	uint8_t m_workers = 0, m_nbusy = 0;
+
+	friend class LwTcp;
 };
 
 #endif
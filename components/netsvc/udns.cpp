@@ -79,6 +79,12 @@
 
 #define MAX_LABELLEN	63
 
+#define CACHE_SLOTS	32	// hash table size, must be a power of 2
+#define CACHE_LOAD	24	// maximum number of entries in the table
+#define QUERY_TIMEOUT	5	// seconds until a query is considered failed
+#define MIN_TTL		5
+#define MAX_TTL		86400
+
 /*************************************************************************
 
 Packet format:
@@ -152,10 +158,12 @@ struct Answert
 
 struct DnsEntry
 {
-	DnsEntry *next;
 	ip_addr_t ip;
-	TickType_t ttl;
+	TickType_t added, expire, used;
+	uint32_t hash;
 	uint8_t len;
+	bool negative;	// NXDOMAIN or timeout
+	bool refresh;	// prefetch query pending
 	char host[];
 };
 
@@ -163,17 +171,36 @@ struct DnsEntry
 struct Query
 {
 	Query *next;
-	TickType_t ts;
+	TickType_t start, ts;
 	uint8_t *buf;
 	void *arg;
 	void (*cb)(const char *, const ip_addr_t *, void *);
 	uint16_t ql;
 	bool local;
+	bool prefetch;
 	uint8_t cnt;	// send count
 	char hostname[1];
 };
 
 
+typedef enum {
+	rec_a,
+	rec_aaaa,
+	rec_ptr,		// reverse lookup
+	rec_num
+} mdns_rec_t;
+
+
+// serialized mDNS answer, including header
+struct MdnsRecord
+{
+	uint8_t *data;
+	uint16_t len;
+	uint32_t ttl;
+	TickType_t sent;	// last multicast
+};
+
+
 struct CName
 {
 	struct CName *next;
@@ -188,8 +215,7 @@ struct CName
 static void recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *ip, u16_t port);
 
 static void cache_add(const char *hn, size_t hl, ip_addr_t *ip, uint32_t ttl);
-static void cache_remove_head();
-static ip_addr_t *cache_lookup(const char *hn);
+static int cache_lookup(const char *hn, ip_addr_t *ip);
 #ifdef EXTRA_INFO
 static int add_ptr(const char *);
 #endif
@@ -198,16 +224,26 @@ static struct udp_pcb *MPCB = 0, *SPCB = 0;
 #if LWIP_IPV6
 static struct udp_pcb *MPCB6 = 0;
 #endif
-static DnsEntry *CacheS = 0, *CacheE = 0;
+static DnsEntry *Cache[CACHE_SLOTS];
 static Query *Queries = 0;;
+static Query *Deferred = 0;	// failures of negative cache hits
 static CName *CNames = 0;
 #ifdef EXTRA_INFO
 static char *Ptr = 0;
 #endif
 static ip4_addr_t IP4;
 static ip_addr_t NameServer[4];
-static uint16_t CacheSize = 0, MaxCache = 256, Id = 0;
+static uint16_t CacheSize = 0, CacheEntries = 0, MaxCache = 1024, Id = 0;
+static unsigned Hits = 0, NegHits = 0, Misses = 0, Prefetches = 0;
 static mdns_state_t State = mdns_wifidown;
+static MdnsRecord Records[rec_num];
+static ip4_addr_t RecIP4;
+#if defined CONFIG_LWIP_IPV6
+static ip6_addr_t RecIP6;
+#endif
+static bool RecValid = false;
+static char RevName[32];
+static unsigned MdnsAnswered = 0, MdnsSuppressed = 0;
 static SemaphoreHandle_t Mtx = 0;
 #if LWIP_TCPIP_CORE_LOCKING == 0
 static SemaphoreHandle_t LwipSem = 0;
@@ -248,17 +284,82 @@ static int add_ptr(const char *p)
 #endif
 
 
-static void cache_remove_head()
+static inline bool expired(const DnsEntry *e, TickType_t now)
+{
+	return (int32_t)(e->expire - now) <= 0;
+}
+
+
+static uint32_t cache_hash(const char *hn)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	while (char c = *hn++) {
+		h ^= (uint8_t) c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+static int cache_find(const char *hn, uint32_t h)
 {
-	DnsEntry *e = CacheS;
+	// linear probing, the table is never full due to CACHE_LOAD
+	unsigned i = h & (CACHE_SLOTS-1);
+	while (DnsEntry *e = Cache[i]) {
+		if ((e->hash == h) && (0 == strcmp(e->host,hn)))
+			return i;
+		i = (i + 1) & (CACHE_SLOTS-1);
+	}
+	return -1;
+}
+
+
+static void cache_remove(unsigned i)
+{
+	DnsEntry *e = Cache[i];
 	assert(e);
 	log_dbug(TAG,"cache rm %s",e->host);
-	CacheSize -= sizeof(DnsEntry);
-	CacheSize -= e->len;
-	CacheS = e->next;
+	CacheSize -= sizeof(DnsEntry) + e->len + 1;
+	--CacheEntries;
 	free(e);
-	if (CacheS == 0)
-		CacheE = 0;
+	Cache[i] = 0;
+	// backward shift deletion: move entries of the probe sequence
+	// into the gap unless their home slot lies between gap and entry
+	unsigned j = i;
+	for (;;) {
+		j = (j + 1) & (CACHE_SLOTS-1);
+		DnsEntry *x = Cache[j];
+		if (x == 0)
+			break;
+		unsigned k = x->hash & (CACHE_SLOTS-1);
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		Cache[i] = x;
+		Cache[j] = 0;
+		i = j;
+	}
+}
+
+
+static void cache_evict()
+{
+	// remove an expired entry or the least recently used one
+	TickType_t now = xTaskGetTickCount();
+	int v = -1;
+	for (int i = 0; i < CACHE_SLOTS; ++i) {
+		DnsEntry *e = Cache[i];
+		if (e == 0)
+			continue;
+		if (expired(e,now)) {
+			v = i;
+			break;
+		}
+		if ((v == -1) || ((int32_t)(e->used - Cache[v]->used) < 0))
+			v = i;
+	}
+	if (v != -1)
+		cache_remove(v);
 }
 
 
@@ -291,61 +392,84 @@ static int query_remove(const char *hn, ip_addr_t *ip)
 
 static void cache_add(const char *hn, size_t hl, ip_addr_t *ip, uint32_t ttl)
 {
-//	log_dbug(TAG,"strlen %u, hl %u, %s",strlen(hn),hl,hn);
-	DnsEntry *e = CacheS;
-	while (e) {
-		if (0 == strcmp(e->host,hn)) {
+	// Mtx must be held
+	TickType_t now = xTaskGetTickCount();
+	if (ttl < MIN_TTL)
+		ttl = MIN_TTL;
+	else if (ttl > MAX_TTL)
+		ttl = MAX_TTL;
+	uint32_t h = cache_hash(hn);
+	DnsEntry *e;
+	int i = cache_find(hn,h);
+	if (i >= 0) {
+		e = Cache[i];
+		// a failure must not replace a valid address
+		if ((ip == 0) && !e->negative && !expired(e,now))
 			return;
-		}
-		e = e->next;
-	}
-//	log_dbug(TAG,"cache size %u/%u, add %s: %s",CacheSize,MaxCache,hn,ip2str(ip));
-	CacheSize += sizeof(DnsEntry)+hl;
-	while (CacheSize > MaxCache) {
-		assert(CacheS);
-		cache_remove_head();
+		log_dbug(TAG,"cache update %s",hn);
+	} else {
+		size_t s = sizeof(DnsEntry) + hl + 1;
+		if (s > MaxCache)
+			return;
+		while (CacheEntries && ((CacheSize + s > MaxCache) || (CacheEntries >= CACHE_LOAD)))
+			cache_evict();
+		e = (DnsEntry *) malloc(s);
+		if (e == 0)
+			return;
+		memcpy(e->host,hn,hl);
+		e->host[hl] = 0;
+		e->len = hl;
+		e->hash = h;
+		CacheSize += s;
+		++CacheEntries;
+		i = h & (CACHE_SLOTS-1);
+		while (Cache[i])
+			i = (i + 1) & (CACHE_SLOTS-1);
+		Cache[i] = e;
 	}
 	if (Modules[0] || Modules[TAG]) {
 		char ipstr[40];
 		if (ip) {
 			ip2str_r(ip,ipstr,sizeof(ipstr));
 		}
-		log_dbug(TAG,"cache add %.*s: %s",hl,hn,ip ? ipstr : "<unknown>");
+		log_dbug(TAG,"cache add %.*s: %s, ttl %u",(int)hl,hn,ip ? ipstr : "<unknown>",ttl);
 	}
-	e = (DnsEntry *) malloc(sizeof(DnsEntry)+hl);
-	memcpy(e->host,hn,hl);
-	e->host[hl] = 0;
-	e->next = 0;
 	if (ip)
 		memcpy(&e->ip,ip,sizeof(ip_addr_t));
 	else
 		bzero(&e->ip,sizeof(e->ip));
-	e->len = hl;
-	e->ttl = xTaskGetTickCount() + ttl * configTICK_RATE_HZ;
-	if (CacheE)
-		CacheE->next = e;
-	else
-		CacheS = e;
-	CacheE = e;
+	e->negative = (ip == 0);
+	e->refresh = false;
+	e->added = now;
+	e->used = now;
+	e->expire = now + ttl * configTICK_RATE_HZ;
 }
 
 
-ip_addr_t *cache_lookup(const char *hn)
+static int cache_lookup(const char *hn, ip_addr_t *ip)
 {
+	// returns 1 on hit, -1 on negative hit, 0 on miss
 	Lock lock(Mtx,__FUNCTION__);
-	long now = xTaskGetTickCount();
-	while (CacheS && (CacheS->ttl < now)) {
-		log_dbug(TAG,"entry timeout: %d",CacheS->ttl);
-		cache_remove_head();
-	}
-	DnsEntry *e = CacheS;
-	while (e) {
-		if (0 == strcmp(e->host,hn)) {
+	int i = cache_find(hn,cache_hash(hn));
+	if (i >= 0) {
+		DnsEntry *e = Cache[i];
+		TickType_t now = xTaskGetTickCount();
+		if (!expired(e,now)) {
+			e->used = now;
+			if (e->negative) {
+				log_dbug(TAG,"negative cache hit %s",e->host);
+				++NegHits;
+				return -1;
+			}
 			log_dbug(TAG,"cache hit %s",e->host);
-			return &e->ip;
+			*ip = e->ip;
+			++Hits;
+			return 1;
 		}
-		e = e->next;
+		log_dbug(TAG,"entry timeout: %s",e->host);
+		cache_remove(i);
 	}
+	++Misses;
 	return 0;
 }
 
@@ -426,6 +550,7 @@ static int parseAnswer(struct pbuf *p, size_t off, const ip_addr_t *sender)
 	a.rr_type = ntohs(a.rr_type);
 	a.rr_class = ntohs(a.rr_class);
 	a.rdlen = ntohs(a.rdlen);
+	a.ttl = ntohl(a.ttl);
 	off += SIZEOF_ANSWER;
 	log_devel(TAG,"answer type %u, class %u, len %u",a.rr_type,a.rr_class,a.rdlen);
 	if (a.rr_type == TYPE_CNAME) {
@@ -496,115 +621,143 @@ static int parseAnswer(struct pbuf *p, size_t off, const ip_addr_t *sender)
 }
 
 
-static inline void sendOwnIp(uint8_t *q, uint16_t ql, uint16_t id, const ip_addr_t *qip, uint16_t port)
+static size_t put_localname(uint8_t *pkt)
 {
-	log_dbug(TAG,"send own IP");
-	// caller ensures: Ctx != 0, State == mdns_up
-	size_t bsize = SIZEOF_HEADER+SIZEOF_IP4ANSW+HostnameLen+8;
-	uint16_t numans = 1;
-	struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT,bsize,PBUF_RAM);
-	assert(p->len == p->tot_len);
-	Header *h = (Header*) p->payload;
+	*pkt++ = HostnameLen;
+	memcpy(pkt,Hostname,HostnameLen);
+	memcpy(pkt+HostnameLen,"\005local",7);
+	return HostnameLen+8;
+}
+
+
+static bool is_localname(const char *n)
+{
+	return (0 == strncmp(n,Hostname,HostnameLen)) && (0 == strcmp(n+HostnameLen,".local"));
+}
+
+
+static void record_set(unsigned r, const uint8_t *name, size_t nl, uint16_t type, uint16_t cls, uint32_t ttl, const void *rd, size_t rdl)
+{
+	MdnsRecord &rec = Records[r];
+	size_t len = SIZEOF_HEADER+nl+SIZEOF_ANSWER+rdl;
+	uint8_t *b = (uint8_t *) realloc(rec.data,len);
+	if (b == 0) {
+		free(rec.data);
+		rec.data = 0;
+		rec.len = 0;
+		return;
+	}
+	// id = 0 as required for multicast responses
+	Header *h = (Header *) b;
 	bzero(h,SIZEOF_HEADER);
-	h->id = id;
 	h->flags.qr = 1;
 	h->flags.aa = 1;
-	h->acnt = htons(numans);
-	uint8_t *pkt = (uint8_t*)p->payload + SIZEOF_HEADER;
-	*pkt++ = HostnameLen;
-	memcpy(pkt, Hostname, HostnameLen);
-	pkt += HostnameLen;
-	memcpy(pkt,"\005local",7);
-	pkt += 7;
+	h->acnt = htons(1);
+	uint8_t *pkt = b + SIZEOF_HEADER;
+	memcpy(pkt,name,nl);
+	pkt += nl;
 	Answert a;
-	a.rr_type = htons(TYPE_ADDR);
-	a.rr_class = htons(CLASS_INET|CACHE_FLUSH);
-	a.ttl = htonl(120);
-	a.rdlen = htons(4);
+	a.rr_type = htons(type);
+	a.rr_class = htons(cls);
+	a.ttl = htonl(ttl);
+	a.rdlen = htons(rdl);
 	memcpy(pkt,&a,SIZEOF_ANSWER);
 	pkt += SIZEOF_ANSWER;
-	memcpy(pkt,&IP4,SIZEOF_IA4);
-	pkt += SIZEOF_IA4;
-	assert(pkt-(uint8_t*)p->payload == p->len);
-	err_t r;
-	struct pbuf *p2 = pbuf_alloc(PBUF_TRANSPORT,bsize,PBUF_RAM);
-	assert(p2->len == p2->tot_len);
-	pbuf_copy(p2,p);
-	r = udp_send(MPCB,p2);
-	if (r) {
-		char ipstr[64];
-		log_warn(TAG,"sendto MPCB %s:%d %s",ip2str_r(qip,ipstr,sizeof(ipstr)),port,strlwiperr(r));
-	}
-#if defined CONFIG_LWIP_IPV6 || defined CONFIG_IDF_TARGET_ESP32 || defined CONFIG_IDF_TARGET_ESP32S2 || defined CONFIG_IDF_TARGET_ESP32S3 || defined CONFIG_IDF_TARGET_ESP32C3
-	/* causes routing error... why?
-	pbuf_copy(p2,p);
-	r = udp_send(MPCB6,p2);
-	if (r)
-		log_warn(TAG,"sendto MPCB6 %s",strlwiperr(r));
-	*/
+	memcpy(pkt,rd,rdl);
+	rec.data = b;
+	rec.len = len;
+	rec.ttl = ttl;
+	rec.sent = xTaskGetTickCount() - configTICK_RATE_HZ;
+}
+
+
+static void records_update()
+{
+	// called from tcpip_task, serializes the answers only on
+	// changes of hostname or IP
+#if defined CONFIG_LWIP_IPV6
+	if (RecValid && ip4_addr_cmp(&RecIP4,&IP4) && (0 == memcmp(&RecIP6,&IP6G,sizeof(RecIP6))))
+		return;
+	RecIP6 = IP6G;
+#else
+	if (RecValid && ip4_addr_cmp(&RecIP4,&IP4))
+		return;
 #endif
-	r = udp_sendto(SPCB,p,qip,port);
-	if (r) {
-		char ipstr[64];
-		log_warn(TAG,"sendto SPCB %s:%d %s",ip2str_r(qip,ipstr,sizeof(ipstr)),port,strlwiperr(r));
+	log_dbug(TAG,"update mDNS records");
+	RecIP4 = IP4;
+	RecValid = true;
+	for (auto &rec : Records)
+		rec.len = 0;
+	RevName[0] = 0;
+	if (HostnameLen == 0)
+		return;
+	uint8_t name[HostnameLen+8];
+	size_t nl = put_localname(name);
+	if (IP4.addr != 0) {
+		record_set(rec_a,name,nl,TYPE_ADDR,CLASS_INET|CACHE_FLUSH,120,&IP4,SIZEOF_IA4);
+		// d.c.b.a.in-addr.arpa
+		const uint8_t *ip = (const uint8_t *) &IP4.addr;
+		uint8_t rev[32], *at = rev;
+		char *rn = RevName;
+		for (int i = 3; i >= 0; --i) {
+			int l = sprintf(rn,"%u.",ip[i]);
+			*at++ = l-1;
+			memcpy(at,rn,l-1);
+			at += l-1;
+			rn += l;
+		}
+		strcpy(rn,"in-addr.arpa");
+		memcpy(at,"\007in-addr\004arpa",14);
+		at += 14;
+		record_set(rec_ptr,rev,at-rev,TYPE_PTR,CLASS_INET|CACHE_FLUSH,120,name,nl);
 	}
-	pbuf_free(p);
-	pbuf_free(p2);
+#if defined CONFIG_LWIP_IPV6
+	if (!ip6_addr_isany_val(IP6G))
+		record_set(rec_aaaa,name,nl,TYPE_ADDR6,CLASS_INET,10000,&IP6G,SIZEOF_IA6);
+#endif
 }
 
 
-static inline void sendOwnIp6(uint8_t *q, uint16_t ql, uint16_t id, const ip_addr_t *qip, uint16_t port)
+static void record_send(unsigned r, uint16_t id, const ip_addr_t *qip, uint16_t port, bool unicast)
 {
-#if defined CONFIG_LWIP_IPV6
-	// caller ensures: Ctx != 0, State == mdns_up
-	if (ip6_addr_isany_val(IP6G))
+	// caller ensures: State == mdns_up
+	MdnsRecord &rec = Records[r];
+	if (rec.len == 0)
 		return;
-//	log_dbug(TAG,"send own IPv6");
-	size_t numans = 1;
-	size_t bsize = SIZEOF_HEADER+(SIZEOF_IP6ANSW+HostnameLen+8)*numans;
-	struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT,bsize,PBUF_RAM);
-	assert(p->len == p->tot_len);
-	Header *h = (Header*) p->payload;
-	bzero(h,SIZEOF_HEADER);
-	h->id = id;
-	h->flags.qr = 1;
-	h->flags.aa = 1;
-	h->acnt = htons(numans);
-	uint8_t *pkt = (uint8_t*)p->payload + SIZEOF_HEADER;
-	*pkt++ = HostnameLen;
-	memcpy(pkt, Hostname, HostnameLen);
-	pkt += HostnameLen;
-	memcpy(pkt,"\005local",7);
-	pkt += 7;
-	Answert a;
-	a.rr_type = htons(TYPE_ADDR6);
-	a.rr_class = htons(CLASS_INET);
-	a.ttl = htonl(10000);
-	a.rdlen = htons(SIZEOF_IA6);
-	memcpy(pkt,&a,SIZEOF_ANSWER);
-	pkt += SIZEOF_ANSWER;
-	log_dbug(TAG,"global ip6 %s",ip6addr_ntoa(&IP6G));
-	memcpy(pkt,&IP6G,SIZEOF_IA6);
-	pkt += SIZEOF_IA6;
-	assert(pkt-(uint8_t*)p->payload == p->len);
-	err_t r;
-	struct pbuf *p2 = pbuf_alloc(PBUF_TRANSPORT,bsize,PBUF_RAM);
-	pbuf_copy(p2,p);
-	r = udp_send(MPCB,p2);
-	if (r)
-		log_warn(TAG,"sendto MPCB %s",strlwiperr(r));
-	/* causes routing error... why?
-	pbuf_copy(p2,p);
-	r = udp_send(MPCB6,p2);
-	if (r)
-		log_warn(TAG,"sendto MPCB6 %s",strlwiperr(r));
-	*/
-	pbuf_free(p2);
-	r = udp_sendto(SPCB,p,qip,port);
-	if (r)
-		log_warn(TAG,"sendto SPCB %s",strlwiperr(r));
+	TickType_t now = xTaskGetTickCount();
+	bool legacy = (port != MDNS_PORT);
+	if (!legacy && !unicast) {
+		// RFC 6762, 6: multicast a record at most once per second
+		if (now - rec.sent < configTICK_RATE_HZ) {
+			log_devel(TAG,"rate limited record %u",r);
+			++MdnsSuppressed;
+			return;
+		}
+		if (MPCB == 0)
+			return;
+	}
+	struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT,rec.len,PBUF_RAM);
+	if (p == 0)
+		return;
+	pbuf_take(p,rec.data,rec.len);
+	err_t e;
+	if (legacy) {
+		// legacy unicast query, answer must carry the query id
+		((Header *)p->payload)->id = id;
+		e = udp_sendto(SPCB,p,qip,port);
+	} else if (unicast) {
+		e = udp_sendto(SPCB,p,qip,port);
+	} else {
+		e = udp_send(MPCB,p);
+		rec.sent = now;
+	}
 	pbuf_free(p);
-#endif
+	if (e) {
+		char ipstr[64];
+		log_warn(TAG,"send answer to %s:%d %s",ip2str_r(qip,ipstr,sizeof(ipstr)),port,strlwiperr(e));
+	} else {
+		++MdnsAnswered;
+	}
 }
 
 
@@ -722,7 +875,7 @@ static void sendPtrInfo(uint8_t *q, uint16_t ql, uint16_t id)
 #endif
 
 
-static int parseQuestion(struct pbuf *p, size_t qoff, uint16_t id, const ip_addr_t *qip, uint16_t port)
+static int parseQuestion(struct pbuf *p, size_t qoff, uint16_t id, unsigned &want, bool &unicast)
 {
 	log_devel(TAG,"parse question %d at 0x%x",(int)id,qoff);
 	size_t off = qoff;
@@ -741,15 +894,13 @@ static int parseQuestion(struct pbuf *p, size_t qoff, uint16_t id, const ip_addr
 	qtype = ntohs(qtype);
 	qclass = ntohs(qclass);
 	log_devel(TAG,"question %d/%d: %s",qtype,qclass,hname);
-	if (0 == id)
-		id = ++Id;
-	if (	((qclass == CLASS_INET) && (0 == strcmp(hname,Hostname)))
-		|| ((0 == memcmp(hname,Hostname,HostnameLen)) && (0 == memcmp(hname+HostnameLen,".local",7)))) {
+	unsigned w = 0;
+	if (((qclass == CLASS_INET) && (0 == strcmp(hname,Hostname))) || is_localname(hname)) {
 		log_devel(TAG,"question for this host");
 		if (qtype == TYPE_ADDR)
-			sendOwnIp((uint8_t*)p->payload+qoff,off-qoff,id,qip,port);
+			w = 1 << rec_a;
 		else if (qtype == TYPE_ADDR6)
-			sendOwnIp6((uint8_t*)p->payload+qoff,off-qoff,id,qip,port);
+			w = 1 << rec_aaaa;
 #ifdef EXTRA_INFO
 		else if (qtype == TYPE_CNAME)
 			sendOwnHostname((uint8_t*)p->payload+qoff,off-qoff,id);
@@ -760,7 +911,57 @@ static int parseQuestion(struct pbuf *p, size_t qoff, uint16_t id, const ip_addr
 #endif
 		else
 			log_dbug(TAG,"unsupported qtype %d",qtype);
+	} else if ((qtype == TYPE_PTR) && RevName[0] && (0 == strcmp(hname,RevName))) {
+		log_devel(TAG,"reverse lookup of this host");
+		w = 1 << rec_ptr;
+	}
+	if (w) {
+		want |= w;
+		// QU bit: unicast response requested
+		if (qclass & 0x8000)
+			unicast = true;
+	}
+	return off;
+}
+
+
+static int knownAnswer(struct pbuf *p, size_t off, unsigned &want)
+{
+	// RFC 6762, 7.1: suppress answers the querier already knows
+	// with at least half of the TTL remaining
+	char name[256];
+	int x = parseName(p,off,name,0);
+	if (x < 0)
+		return x;
+	Answert a;
+	if (SIZEOF_ANSWER != pbuf_copy_partial(p,&a,SIZEOF_ANSWER,off))
+		return -off;
+	a.rr_type = ntohs(a.rr_type);
+	a.rdlen = ntohs(a.rdlen);
+	a.ttl = ntohl(a.ttl);
+	off += SIZEOF_ANSWER;
+	size_t rd = off;
+	off += a.rdlen;
+	int r = -1;
+	if ((a.rr_type == TYPE_ADDR) && is_localname(name))
+		r = rec_a;
+	else if ((a.rr_type == TYPE_ADDR6) && is_localname(name))
+		r = rec_aaaa;
+	else if ((a.rr_type == TYPE_PTR) && RevName[0] && (0 == strcmp(name,RevName)))
+		r = rec_ptr;
+	if ((r < 0) || (0 == (want & (1 << r))) || (Records[r].len == 0) || (a.ttl < Records[r].ttl/2))
+		return off;
+	const MdnsRecord &rec = Records[r];
+	if (r == rec_ptr) {
+		char target[256];
+		if ((parseName(p,rd,target,0) < 0) || !is_localname(target))
+			return off;
+	} else if ((a.rdlen > rec.len) || pbuf_memcmp(p,rd,rec.data+rec.len-a.rdlen,a.rdlen)) {
+		return off;
 	}
+	log_devel(TAG,"known answer for record %d",r);
+	want &= ~(1 << r);
+	++MdnsSuppressed;
 	return off;
 }
 
@@ -807,10 +1008,15 @@ static void recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const
 		log_devel(TAG,"opcode=%d, aa=%d, ra=%d, rd=%d, tc=%d, qcnt=%d, acnt=%d, nscnt=%d, arcnt=%d"
 				,(int)h.flags.opcode,(int)h.flags.aa,(int)h.flags.ra,(int)h.flags.rd,(int)h.flags.tc
 				,(int)h.qcnt,(int)h.acnt,(int)h.nscnt,(int)h.arcnt);
+		bool respond = (State == mdns_up) && (0 == h.flags.qr);
+		unsigned want = 0;
+		bool unicast = false;
+		if (respond)
+			records_update();
 		while (h.qcnt--) {
 			int x;
-			if ((State == mdns_up) && (0 == h.flags.qr))
-				x = parseQuestion(p,off,h.id,ip,port);
+			if (respond)
+				x = parseQuestion(p,off,h.id,want,unicast);
 			else
 				x = skipQuestion(p,off);
 			if (x < 0) {
@@ -820,6 +1026,19 @@ static void recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const
 			}
 			off = x;
 		}
+		if (want) {
+			size_t ko = off;
+			for (unsigned k = 0; want && (k < h.acnt); ++k) {
+				int x = knownAnswer(p,ko,want);
+				if (x < 0)
+					break;
+				ko = x;
+			}
+			for (unsigned r = 0; r < rec_num; ++r) {
+				if (want & (1 << r))
+					record_send(r,h.id,ip,port,unicast);
+			}
+		}
 		unsigned n = h.acnt + h.nscnt + h.arcnt;
 //		unsigned n = h.acnt;
 		while (n--) {
@@ -837,7 +1056,12 @@ static void recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const
 		if (hl < 0)
 			return;
 		log_dbug(TAG,"negative reply for %s",cname);
-		query_remove(cname,0);
+		LWIP_UNLOCK();
+		MLock lock(Mtx,__FUNCTION__);
+		if (query_remove(cname,0))
+			cache_add(cname,hl,0,CONFIG_UDNS_NEGATIVE_TTL);
+		lock.unlock();
+		LWIP_LOCK();
 	}
 	if (e) {
 		log_hex(TAG,p->payload,p->len,"error %d on packet at %u",e,off);
@@ -865,10 +1089,62 @@ static int udns_send_ns(uint8_t *buf,size_t ql)
 }
 
 
-#if LWIP_TCPIP_CORE_LOCKING == 0
-static void query_fn(void *a)
+static Query *query_new(const char *hn, void (*cb)(const char *, const ip_addr_t *, void *), void *arg, bool pkt)
+{
+	// pkt == false: query only waits for the answer of another one
+	size_t len = strlen(hn), l = len;
+	char labels[len+2], *at = labels;
+	if (pkt) {
+		memcpy(labels+1,hn,len+1);
+		while (char *dot = strchr(at+1,'.')) {
+			size_t ll = dot-at-1;
+			if (ll > 64)
+				return 0;
+			l -= ll;
+			*at = ll;
+			at = dot;
+			--l;
+		}
+		*at = l;
+		log_devel(TAG,"labels='%s',len=%u,at-labels=%d,%d",labels,len,at-labels,l);
+	}
+	Query *q = (Query *) malloc(sizeof(Query)+len+1);
+	if (q == 0)
+		return 0;
+	q->cb = cb;
+	q->arg = arg;
+	q->buf = 0;
+	q->ql = 0;
+	q->cnt = 0;
+	q->prefetch = false;
+	q->start = xTaskGetTickCount();
+	q->ts = q->start;
+	q->local = (len > 6) && (0 == memcmp(".local",hn+len-6,6));
+	memcpy(q->hostname,hn,len+1);
+	if (!pkt)
+		return q;
+	size_t ql = len+2+sizeof(Header)+4;
+	uint8_t *buf = (uint8_t *) malloc(ql);
+	if (buf == 0) {
+		free(q);
+		return 0;
+	}
+	q->ql = ql;
+	q->buf = buf;
+	bzero(buf,ql);
+	buf[2] = 1;	// recursion desired
+	buf[5] = 1;	// question count = 1
+	memcpy(buf+12,labels,len+2);
+	buf[12+2+len+1] = 1;
+	buf[12+2+len+3] = 1;
+	return q;
+}
+
+
+static uint8_t query_send(Query *q)
 {
-	Query *q = (Query *)a;
+	// must be called with LWIP locked or from tcpip_task
+	log_dbug(TAG,"sending %sDNS query",q->local?"m":"");
 	if (q->local) {
 		if (MPCB) {
 			struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT,q->ql,PBUF_RAM);
@@ -877,7 +1153,7 @@ static void query_fn(void *a)
 //			log_hex(TAG,pb->payload,pb->len,"sending mDNS query");
 			err_t r = udp_send(MPCB,pb);
 			q->cnt = (r == 0);
-			pbuf_free(pb);		/// TODO/BUG? is this the problem?
+			pbuf_free(pb);
 		} else {
 			log_warn(TAG,"no socket for multi-cast query");
 		}
@@ -886,6 +1162,15 @@ static void query_fn(void *a)
 		memcpy(q->buf,&Id,2);
 		q->cnt = udns_send_ns(q->buf,q->ql);
 	}
+	// q->buf is freed when the query is answered and deleted
+	return q->cnt;
+}
+
+
+#if LWIP_TCPIP_CORE_LOCKING == 0
+static void query_fn(void *a)
+{
+	query_send((Query *)a);
 	if (pdTRUE != xSemaphoreGive(LwipSem))
 		abort();
 }
@@ -924,19 +1209,36 @@ int udns_query(const char *hn, ip_addr_t *ip, void (*cb)(const char *, const ip_
 		}
 		cn = cn->next;
 	}
-	if (ip_addr_t *ce = cache_lookup(hn)) {
+	ip_addr_t cip;
+	int h = cache_lookup(hn,&cip);
+	if (h < 0) {
+		// negative hits fail without re-querying, the callback is
+		// called on the next cyclic run like for a timed out query
+		if (ip)
+			*ip = ip_addr_any;
+		if (cb == 0)
+			return -1;
+		Query *q = query_new(hn,cb,arg,false);
+		if (q == 0)
+			return -1;
+		Lock lock(Mtx,__FUNCTION__);
+		q->next = Deferred;
+		Deferred = q;
+		return 1;
+	}
+	if (h > 0) {
 		if (ip)
-			*ip = *ce;
+			*ip = cip;
 		if (cb) {
 #if LWIP_TCPIP_CORE_LOCKING == 1
 			LWIP_LOCK();
-			cb(hn,ce,arg);
+			cb(hn,&cip,arg);
 			LWIP_UNLOCK();
 #else
 			cb_arg_t a;
 			a.cb = cb;
 			a.hn = hn;
-			a.ip = ce;
+			a.ip = &cip;
 			a.arg = arg;
 			tcpip_send_msg_wait_sem(perform_cb_fn,&a,&LwipSem);
 #endif
@@ -945,45 +1247,27 @@ int udns_query(const char *hn, ip_addr_t *ip, void (*cb)(const char *, const ip_
 	}
 	if (ip)
 		*ip = ip_addr_any;
-	size_t l = strlen(hn), len = l;
-	char labels[l+2], *at = labels;
-	memcpy(labels+1,hn,l+1);
-	while (char *dot = strchr(at+1,'.')) {
-		size_t ll = dot-at-1;
-		if (ll > 64)
-			return -1;
-		l -= ll;
-		*at = ll;
-		at = dot;
-		--l;
+	{
+		// join a pending query for the same host
+		Lock lock(Mtx,__FUNCTION__);
+		Query *p = Queries;
+		while (p && strcmp(p->hostname,hn))
+			p = p->next;
+		if (p) {
+			if (cb) {
+				Query *q = query_new(hn,cb,arg,false);
+				if (q == 0)
+					return -1;
+				log_dbug(TAG,"join query %s",hn);
+				q->next = Queries;
+				Queries = q;
+			}
+			return 1;
+		}
 	}
-	*at = l;
-	log_devel(TAG,"labels='%s',len=%u,at-labels=%d,%d",labels,len,at-labels,l);
-	Query *q = (Query *) malloc(sizeof(Query)+len+1);
+	Query *q = query_new(hn,cb,arg,true);
 	if (q == 0)
 		return -1;
-	q->cb = cb;
-	q->arg = arg;
-	size_t ql = len+2+sizeof(Header)+4;
-	q->ql = ql;
-	uint8_t *buf = (uint8_t *) malloc(ql);
-	if (buf == 0) {
-		free(q);
-		return -1;
-	}
-	q->buf = buf;
-	q->ts = xTaskGetTickCount();
-	bool local = (len > 6) && (0 == memcmp(".local",hn+len-6,6));
-	q->local = local;
-	memcpy(q->hostname,hn,len+1);
-	log_dbug(TAG,"add query %s",q->hostname);
-	bzero(buf,ql);
-	buf[2] = 1;	// recursion desired
-	buf[5] = 1;	// question count = 1
-	memcpy(buf+12,labels,len+2);
-	buf[12+2+len+1] = 1;
-	buf[12+2+len+3] = 1;
-	log_dbug(TAG,"sending %sDNS query",local?"m":"");
 	{
 		Lock lock(Mtx,__FUNCTION__);
 		log_dbug(TAG,"add query %s",q->hostname);
@@ -993,25 +1277,8 @@ int udns_query(const char *hn, ip_addr_t *ip, void (*cb)(const char *, const ip_
 	uint8_t c = 0;
 #if LWIP_TCPIP_CORE_LOCKING == 1
 	LWIP_LOCK();
-	if (local) {
-		if (MPCB) {
-			struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT,ql,PBUF_RAM);
-			err_t e = pbuf_take(pb,buf,ql);
-			assert(e == ERR_OK);
-//			log_hex(TAG,pb->payload,pb->len,"sending mDNS query");
-			err_t r = udp_send(MPCB,pb);
-			c = (r == 0);
-			pbuf_free(pb);
-		} else {
-			log_warn(TAG,"no socket for multi-cast query");
-		}
-	} else {
-		++Id;
-		memcpy(buf,&Id,2);
-		c = udns_send_ns(buf,ql);
-	}
+	c = query_send(q);
 	LWIP_UNLOCK();
-	// free(q->buf); - done when the query is answered and deleted
 #else
 	tcpip_send_msg_wait_sem(query_fn,q,&LwipSem);
 	c = q->cnt;
@@ -1058,6 +1325,100 @@ static err_t sendSelfQuery()
 }
 
 
+static Query *query_cyclic(TickType_t now)
+{
+	// Mtx must be held, LWIP locked or called from tcpip_task
+	// returns the list of timed out queries
+	Query *q = Queries, *prev = 0, *failed = 0;
+	while (q) {
+		Query *n = q->next;
+		if ((int32_t)(now - q->start) > QUERY_TIMEOUT * configTICK_RATE_HZ) {
+			log_dbug(TAG,"query %s timed out",q->hostname);
+			if (prev)
+				prev->next = n;
+			else
+				Queries = n;
+			if (q->prefetch) {
+				// retry on next cyclic while the old entry is valid
+				int i = cache_find(q->hostname,cache_hash(q->hostname));
+				if (i >= 0)
+					Cache[i]->refresh = false;
+			} else {
+				cache_add(q->hostname,strlen(q->hostname),0,CONFIG_UDNS_NEGATIVE_TTL);
+			}
+			q->next = failed;
+			failed = q;
+		} else {
+			if (q->buf && !q->local && (q->ts + configTICK_RATE_HZ < now)) {
+				log_dbug(TAG,"re-query %s",q->hostname);
+				udns_send_ns(q->buf,q->ql);
+				q->ts = now;
+			}
+			prev = q;
+		}
+		q = n;
+	}
+	// callers of udns_query get the failure of a negative cache hit
+	// here, after udns_query has returned
+	while (Query *d = Deferred) {
+		Deferred = d->next;
+		d->next = failed;
+		failed = d;
+	}
+	return failed;
+}
+
+
+static void query_failed(Query *q)
+{
+	while (q) {
+		Query *n = q->next;
+		if (q->cb)
+			q->cb(q->hostname,0,q->arg);
+		if (q->buf)
+			free(q->buf);
+		free(q);
+		q = n;
+	}
+}
+
+
+static void cache_cyclic(TickType_t now)
+{
+	// Mtx must be held, LWIP locked or called from tcpip_task
+	// drops expired entries and refreshes entries that are in use,
+	// when 3/4 of their lifetime have passed
+	int i = 0;
+	while (i < CACHE_SLOTS) {
+		DnsEntry *e = Cache[i];
+		if (e == 0) {
+			++i;
+			continue;
+		}
+		if (expired(e,now)) {
+			// shifts the next entry into slot i
+			cache_remove(i);
+			continue;
+		}
+		++i;
+		if (e->negative || e->refresh || ((int32_t)(e->used - e->added) <= 0))
+			continue;
+		if ((now - e->added) < (e->expire - e->added) / 4 * 3)
+			continue;
+		Query *q = query_new(e->host,0,0,true);
+		if (q == 0)
+			return;
+		log_dbug(TAG,"prefetch %s",e->host);
+		q->prefetch = true;
+		q->next = Queries;
+		Queries = q;
+		query_send(q);
+		e->refresh = true;
+		++Prefetches;
+	}
+}
+
+
 #if LWIP_TCPIP_CORE_LOCKING == 0
 static void udns_cyclic_fn(void *arg)
 {
@@ -1087,21 +1448,15 @@ static void udns_cyclic_fn(void *arg)
 	default:
 		log_fatal(TAG,"invalid State %d",State);
 	}
-	if (Queries) {
+	Query *failed;
+	{
 		Lock lock(Mtx,__FUNCTION__);
-		log_dbug(TAG,"locked");
-		TickType_t ts = xTaskGetTickCount();
-		Query *q = Queries;
-		while (q) {
-			log_dbug(TAG,"%s: q->ts=%u, ts=%u",q->hostname,q->ts,ts);
-			if ((q->ts + configTICK_RATE_HZ < ts) && (!q->local)) {
-				log_dbug(TAG,"re-query %s",q->hostname);
-				udns_send_ns(q->buf,q->ql);
-				q->ts = ts;
-			}
-			q = q->next;
-		}
+		TickType_t now = xTaskGetTickCount();
+		failed = query_cyclic(now);
+		cache_cyclic(now);
 	}
+	// callbacks without Mtx, as they may start new queries
+	query_failed(failed);
 	if (pdTRUE != xSemaphoreGive(LwipSem))
 		abort();
 }
@@ -1141,18 +1496,18 @@ static unsigned udns_cyclic(void *arg)
 	default:
 		abort();
 	}
-	Lock lock(Mtx,__FUNCTION__);
-	TickType_t ts = xTaskGetTickCount();
-	Query *q = Queries;
-	while (q) {
-		if ((q->ts + configTICK_RATE_HZ < ts) && (!q->local)) {
-			log_dbug(TAG,"re-query %s",q->hostname);
-			LWIP_LOCK();
-			udns_send_ns(q->buf,q->ql);
-			LWIP_UNLOCK();
-			q->ts = ts;
-		}
-		q = q->next;
+	MLock lock(Mtx,__FUNCTION__);
+	TickType_t now = xTaskGetTickCount();
+	LWIP_LOCK();
+	Query *failed = query_cyclic(now);
+	cache_cyclic(now);
+	LWIP_UNLOCK();
+	lock.unlock();
+	if (failed) {
+		// callbacks without Mtx, as they may start new queries
+		LWIP_LOCK();
+		query_failed(failed);
+		LWIP_UNLOCK();
 	}
 	return d;
 }
@@ -1275,9 +1630,10 @@ extern "C"
 int udns_set_maxcache(unsigned cs)
 {
 	assert(Mtx);
+	Lock lock(Mtx,__FUNCTION__);
 	MaxCache = cs;
 	while (CacheSize > MaxCache)
-		cache_remove_head();
+		cache_evict();
 	return 0;
 }
 
@@ -1373,6 +1729,7 @@ void udns_update_hostname()
 	if (Mtx) {
 		Lock lock(Mtx,__FUNCTION__);
 		State = mdns_wifiup;
+		RecValid = false;
 	}
 }
 
@@ -1399,36 +1756,29 @@ err_t dns_gethostbyname(const char *hostname, ip4_addr_t *addr, dns_found_callba
 }
 
 
-int udns(Terminal &t, int argc, const char *argv[])
+const char *udns(Terminal &t, int argc, const char *argv[])
 {
 	t.print("name server:");
-	char ipstr[40];
+	char ipstr[64];
 	for (const auto &ns : NameServer) {
 		if (!ip_addr_isany(&ns)) {
 			t.printf(" %s",ip2str_r(&ns,ipstr,sizeof(ipstr)));
 		}
 	}
-	t.println("\n\ncache enries:");
 	Lock lock(Mtx,__FUNCTION__);
-	DnsEntry *e = CacheS;
-	while (e) {
-//		if (IP_IS_V4(&e->ip))
-//			t.printf("%-15s %s\n",ip4addr_ntoa_r(ip_2_ip4(&e->ip),ipstr,sizeof(ipstr)),e->host);
-
-		char ipstr[64];
-		t.printf("%-40s %s\n",ip2str_r(&e->ip,ipstr,sizeof(ipstr)),e->host);
-		e = e->next;
+	t.printf("\n\ncache: %u hits, %u negative hits, %u misses, %u prefetches\n"
+		,Hits,NegHits,Misses,Prefetches);
+	t.printf("%u entries, %u/%u bytes\n",CacheEntries,CacheSize,MaxCache);
+	t.printf("mDNS: %u answered, %u suppressed\n",MdnsAnswered,MdnsSuppressed);
+	TickType_t now = xTaskGetTickCount();
+	for (DnsEntry *e : Cache) {
+		if ((e == 0) || expired(e,now))
+			continue;
+		t.printf("%-40s %6us %s\n"
+			,e->negative ? "<not found>" : ip2str_r(&e->ip,ipstr,sizeof(ipstr))
+			,(unsigned)((e->expire - now) / configTICK_RATE_HZ)
+			,e->host);
 	}
-	/*
-#if defined CONFIG_LWIP_IPV6 || defined CONFIG_IDF_TARGET_ESP32 || defined CONFIG_IDF_TARGET_ESP32S2 || defined CONFIG_IDF_TARGET_ESP32S3 || defined CONFIG_IDF_TARGET_ESP32C3
-	e = CacheS;
-	while (e) {
-		if (IP_IS_V6(&e->ip))
-			t.printf("%-40s %s\n",ip6addr_ntoa_r(ip_2_ip6(&e->ip),ipstr,sizeof(ipstr)),e->host);
-		e = e->next;
-	}
-#endif
-*/
 	CName *cn = CNames;
 	while (cn) {
 		t.printf("%s => %s\n",cn->alias,cn->cname);
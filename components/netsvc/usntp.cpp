@@ -113,11 +113,16 @@ static unsigned sntp_cyclic(void *arg)
 		if (LastUpdate)
 			return (unsigned) Interval * 1000;
 	} else if (!Queried && Server && (StationMode == station_connected)) {
-		if (err_t e = query_host(Server,0,sntp_connect,0))
-			log_warn(TAG,"query %s: %s",Server,esp_err_to_name(e));
-		else
-			log_info(TAG,"queried %s",Server);
+		// sntp_connect may be called before query_host returns and
+		// resets Queried for the next attempt
 		Queried = true;
+		int e = query_host(Server,0,sntp_connect,0);
+		if ((e < 0) && (e != ERR_INPROGRESS)) {
+			log_warn(TAG,"query %s: %d",Server,e);
+			Queried = false;
+		} else {
+			log_info(TAG,"queried %s",Server);
+		}
 	}
 	return 1000;
 }
@@ -80,6 +80,18 @@ const char *astream::c_str()
 }
 
 
+void astream::drop(size_t n)
+{
+	size_t s = m_at - m_buf;
+	if (n >= s) {
+		m_at = m_buf;
+		return;
+	}
+	memmove(m_buf,m_buf+n,s-n);
+	m_at -= n;
+}
+
+
 int astream::put(char c)
 {
 	if (m_at+3 >= m_end)
@@ -48,6 +48,9 @@ class astream : public stream
 	void reset()
 	{ m_at = m_buf; }
 
+	// removes the first n bytes
+	void drop(size_t n);
+
 	char *take();
 
 	private:
@@ -64,6 +64,79 @@ char *float_to_str(char *buf, float f)
 #endif
 
 
+// Formats f like printf("%.<prec>f") without the overhead of vsnprintf.
+// Returns a pointer to the terminating \0, or 0 if f is not finite or
+// out of range. prec must not exceed 9.
+char *fixed_to_str(char *buf, float f, unsigned prec)
+{
+	static const uint32_t Pow10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+	};
+	if (!isfinite(f) || (prec >= sizeof(Pow10)/sizeof(Pow10[0])))
+		return 0;
+	char *o = buf;
+	if (signbit(f)) {
+		*o++ = '-';
+		f = -f;
+	}
+	double x = rint((double)f * Pow10[prec]);
+	if (x >= 1E19)
+		return 0;
+	uint64_t v = (uint64_t) x;
+	uint64_t ip = v / Pow10[prec];
+	uint32_t fp = v - ip * Pow10[prec];
+	char tmp[20], *t = tmp;
+	if (ip >> 32) {
+		do {
+			*t++ = '0' + ip % 10;
+			ip /= 10;
+		} while (ip);
+	} else {
+		// 32bit arithmetic is much cheaper on the targets
+		uint32_t i = ip;
+		do {
+			*t++ = '0' + i % 10;
+			i /= 10;
+		} while (i);
+	}
+	do
+		*o++ = *--t;
+	while (t != tmp);
+	if (prec) {
+		*o++ = '.';
+		o += prec;
+		char *d = o;
+		do {
+			*--d = '0' + fp % 10;
+			fp /= 10;
+		} while (--prec);
+	}
+	*o = 0;
+	return o;
+}
+
+
+// Returns the precision of formats like %[width][.prec]f, as used by
+// EnvNumber, or -1 for other formats.
+int fmt_precision(const char *fmt)
+{
+	if ((fmt == 0) || (*fmt++ != '%'))
+		return -1;
+	while ((*fmt >= '0') && (*fmt <= '9'))
+		++fmt;
+	int p = 6;
+	if (*fmt == '.') {
+		++fmt;
+		p = 0;
+		while ((*fmt >= '0') && (*fmt <= '9'))
+			p = p * 10 + *fmt++ - '0';
+	}
+	if ((fmt[0] != 'f') || (fmt[1] != 0) || (p > 9))
+		return -1;
+	return p;
+}
+
+
 size_t chrcnt(const char *s, char c)
 {
 	size_t r = 0;
@@ -207,6 +207,8 @@ class countstream : public stream
 size_t chrcnt(const char *s, char c);
 size_t chrcntn(const char *s, char c, size_t n);
 char *float_to_str(char *buf, float f);
+char *fixed_to_str(char *buf, float f, unsigned prec);
+int fmt_precision(const char *fmt);
 int arg_bool(const char *v, bool *b);
 
 #endif
@@ -53,6 +53,8 @@ Button::Button(const char *name, xio_t gpio, xio_cfg_pull_t mode, bool active_hi
 , m_lev(event_register(name,"`long"))
 { 
 	First = this;
+	for (event_t e : {m_rev,m_pev,m_sev,m_mev,m_lev})
+		event_set_prio(e,ep_critical);
 	log_info(TAG,"button %s at gpio %u",name,gpio);
 }
 
@@ -138,8 +138,11 @@ void HttpRequest::parseField(char *at, char *end)
 	// remove TWS
 	while ((end[-1] == ' ') | (end[-1] == '\t'))
 		--end;
-	if ((0 == strcmp(fn,"Accept-Encoding"))
-		|| (0 == strcmp(fn,"Accept-Language"))
+	if (0 == strcmp(fn,"Accept-Encoding")) {
+		m_gzip = (0 != strstr(at,"gzip"));
+		return;
+	}
+	if ((0 == strcmp(fn,"Accept-Language"))
 		|| (0 == strcmp(fn,"Accept"))
 		|| (0 == strcmp(fn,"Host"))
 		|| (0 == strcmp(fn,"Referer"))
@@ -310,7 +313,7 @@ void HttpRequest::fillContent()
 		return;
 	}
 	do {
-		int n = m_con->read(m_content+m_clen0,m_contlen-m_clen0);
+		int n = m_con->read(m_content+m_clen0,m_contlen-m_clen0,HTTP_RECV_TIMEOUT);
 		if (n == -1) {
 			log_error(TAG,"error downloading: %s",m_con->error());
 			return;
@@ -330,7 +333,7 @@ void HttpRequest::discardContent()
 	char *tmp = (char *)malloc(asize);
 	assert(tmp);
 	do {
-		int n = m_con->read(tmp,asize < dsize ? asize : dsize);
+		int n = m_con->read(tmp,asize < dsize ? asize : dsize,HTTP_RECV_TIMEOUT);
 		if (n == -1) {
 			log_error(TAG,"error discarding: %s",m_con->error());
 			break;
@@ -28,6 +28,10 @@
 
 class LwTcp;
 
+// timeout for receiving request data, so that stalled clients
+// release their worker
+#define HTTP_RECV_TIMEOUT (10000/portTICK_PERIOD_MS)
+
 typedef enum
 {
 	hq_none = 0,
@@ -80,6 +84,9 @@ class HttpRequest
 	void setKeepAlive(bool a)
 	{ m_keepalive = a; }
 
+	bool acceptGzip() const
+	{ return m_gzip; }
+
 	size_t numArgs();
 	const estring &argName(size_t) const;
 	const estring &arg(size_t) const;
@@ -106,6 +113,7 @@ class HttpRequest
 	std::vector< std::pair<estring,estring> > m_args;
 	std::map<estring,estring> m_headers;
 	bool m_keepalive;
+	bool m_gzip = false;
 };
 
 #endif
@@ -49,6 +49,7 @@ const char HTTP_CREATED[] =      "201 Created";
 const char HTTP_ACCEPT[] =       "202 Accepted";
 const char HTTP_NO_CONT[] =      "204 No Content";
 const char HTTP_RST_CONT[] =     "205 Reset Content";
+const char HTTP_NOT_MODIFIED[] = "304 Not Modified";
 const char HTTP_BAD_REQ[] =      "400 Bad Request";
 const char HTTP_UNAUTH[] =       "401 Unauthorized";
 const char HTTP_FORBIDDEN[] =    "403 Forbidden";
@@ -70,6 +71,9 @@ const char CT_TEXT_PLAIN[]		= "text/plain";
 const char CT_TEXT_CSS[]		= "text/css";
 const char CT_TEXT_CSV[]		= "text/csv";
 const char CT_IMAGE_JPEG[]		= "image/jpeg";
+const char CT_IMAGE_PNG[]		= "image/png";
+const char CT_IMAGE_SVG[]		= "image/svg+xml";
+const char CT_TEXT_JAVASCRIPT[]		= "text/javascript";
 
 
 HttpResponse::HttpResponse(const char *r)
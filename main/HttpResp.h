@@ -50,6 +50,9 @@ extern const char CT_TEXT_HTML[];
 extern const char CT_TEXT_CSV[];
 extern const char CT_TEXT_CSS[];
 extern const char CT_IMAGE_JPEG[];
+extern const char CT_IMAGE_PNG[];
+extern const char CT_IMAGE_SVG[];
+extern const char CT_TEXT_JAVASCRIPT[];
 
 
 extern const char HTTP_OK[];
@@ -57,6 +60,7 @@ extern const char HTTP_CREATED[];
 extern const char HTTP_ACCEPT[];
 extern const char HTTP_NO_CONT[];
 extern const char HTTP_RST_CONT[];
+extern const char HTTP_NOT_MODIFIED[];
 extern const char HTTP_BAD_REQ[];
 extern const char HTTP_UNAUTH[];
 extern const char HTTP_FORBIDDEN[];
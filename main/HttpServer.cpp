@@ -29,9 +29,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/socket.h>
-
-#define HTTP_REQ_SIZE 2048
+#include <sys/stat.h>
 
 #if defined CONFIG_FATFS || defined CONFIG_SPIFFS
 #define HAVE_FS
@@ -56,6 +56,15 @@ using namespace std;
 
 #define TAG MODULE_WWW
 
+#ifndef CONFIG_HTTP_MAX_AGE
+#define CONFIG_HTTP_MAX_AGE 0
+#endif
+
+#ifdef CONFIG_ROMFS
+// content hashes of the ROMFS entries, calculated on first request
+static uint32_t *RomTags = 0;
+#endif
+
 
 HttpServer::HttpServer(const char *wwwroot, const char *rootmap)
 : m_wwwroot(wwwroot)
@@ -67,6 +76,10 @@ HttpServer::HttpServer(const char *wwwroot, const char *rootmap)
 	if (rootmap == 0)
 		rootmap = "/index.html";
 	assert(rootmap[0] == '/');
+#ifdef CONFIG_ROMFS
+	if (RomTags == 0)
+		RomTags = (uint32_t *) calloc(romfs_num_entries(),sizeof(uint32_t));
+#endif
 }
 
 
@@ -127,42 +140,126 @@ bool HttpServer::runDirectory(HttpRequest *req)
 }
 
 
+static const char *content_type(const char *fn)
+{
+	static const struct { char ext[5]; const char *type; } Types[] = {
+		{ "html", CT_TEXT_HTML },
+		{ "htm", CT_TEXT_HTML },
+		{ "css", CT_TEXT_CSS },
+		{ "js", CT_TEXT_JAVASCRIPT },
+		{ "json", CT_APP_JSON },
+		{ "csv", CT_TEXT_CSV },
+		{ "jpg", CT_IMAGE_JPEG },
+		{ "jpeg", CT_IMAGE_JPEG },
+		{ "png", CT_IMAGE_PNG },
+		{ "svg", CT_IMAGE_SVG },
+		{ "txt", CT_TEXT_PLAIN },
+	};
+	const char *dot = strrchr(fn,'.');
+	if (dot == 0)
+		return 0;
+	for (const auto &t : Types) {
+		if (0 == strcmp(dot+1,t.ext))
+			return t.type;
+	}
+	return 0;
+}
+
+
+// Adds the validator and cache headers. Returns true if the client
+// already has this version of the file.
+static bool check_cache(HttpRequest *req, HttpResponse &ans, const char *etag)
+{
+	char hdr[48];
+	snprintf(hdr,sizeof(hdr),"ETag: \"%s\"",etag);
+	ans.addHeader(hdr);
+#if CONFIG_HTTP_MAX_AGE > 0
+	snprintf(hdr,sizeof(hdr),"Cache-Control: max-age=%u",CONFIG_HTTP_MAX_AGE);
+	ans.addHeader(hdr);
+#else
+	// cache, but revalidate with If-None-Match
+	ans.addHeader("Cache-Control: no-cache");
+#endif
+	// the header parser drops the quotes
+	const estring &inm = req->getHeader("If-None-Match");
+	return !inm.empty() && (!strcmp(inm.c_str(),etag) || !strcmp(inm.c_str(),"*"));
+}
+
+
 #ifdef CONFIG_ROMFS
-static void send_romfs(int r, HttpRequest *req)
+static uint32_t romfs_etag(int r)
+{
+	if (RomTags && RomTags[r])
+		return RomTags[r];
+	uint32_t h = 2166136261U;
+	size_t s = romfs_size_fd(r);
+#ifdef CONFIG_ENABLE_FLASH_MMAP
+	const uint8_t *addr = (const uint8_t *) romfs_mmap(r);
+	for (size_t i = 0; i < s; ++i)
+		h = (h ^ addr[i]) * 16777619U;
+#else
+	char tmp[256];
+	size_t off = 0;
+	while (off < s) {
+		unsigned n = s - off > sizeof(tmp) ? sizeof(tmp) : s - off;
+		romfs_read_at(r,tmp,n,off);
+		for (unsigned i = 0; i < n; ++i)
+			h = (h ^ (uint8_t)tmp[i]) * 16777619U;
+		off += n;
+	}
+#endif
+	if (h == 0)
+		h = 1;
+	if (RomTags)
+		RomTags[r] = h;
+	return h;
+}
+
+
+// r: entry to send, gz: r is the precompressed variant, vary: a
+// precompressed variant exists
+static void send_romfs(int r, HttpRequest *req, bool gz, bool vary)
 {
 	HttpResponse ans;
 	LwTcp *con = req->getConnection();
 	const char *uri = req->getURI() + 1;
-	if (strstr(uri,".gz"))
-		ans.addHeader("Content-Encoding:gzip");
+	if (gz || strstr(uri,".gz"))
+		ans.addHeader("Content-Encoding: gzip");
+	if (vary)
+		ans.addHeader("Vary: Accept-Encoding");
+	const char *ct = content_type(uri);
+	ans.setContentType(ct ? ct : CT_TEXT_PLAIN);
+	char etag[12];
+	sprintf(etag,"%08x",(unsigned)romfs_etag(r));
+	if (check_cache(req,ans,etag)) {
+		ans.setResult(HTTP_NOT_MODIFIED);
+		ans.senddata(con);
+		return;
+	}
 	ans.setResult(HTTP_OK);
-	if (0 == strstr(uri,".html"))
-		ans.setContentType(CT_TEXT_PLAIN);
 	ssize_t s = romfs_size_fd(r);
 	ans.setContentLength(s);
-	ans.senddata(con);
+	if (!ans.senddata(con))
+		return;
 #ifdef CONFIG_ENABLE_FLASH_MMAP
-	char *addr = (char *) romfs_mmap(r);
+	// flash stays mapped, so LwIP can reference it directly
+	const char *addr = (const char *) romfs_mmap(r);
 	log_dbug(TAG,"mmaped romfs file to %p",addr);
-	if (-1 == con->write(addr,s,true)) {
-		log_warn(TAG,"error sending: %s",strerror(errno));
-		return;
-	}
+	if (-1 == con->stream(addr,s,false))
+		log_warn(TAG,"error sending: %s",con->error());
 #else
 	int off = 0;
 	char tmp[512];
-	do {
+	while (s > 0) {
 		unsigned n = s > sizeof(tmp) ? sizeof(tmp) : s;
 		romfs_read_at(r,tmp,n,off);
 		off += n;
-		// no copy, force sync
-		if (-1 == con->write(tmp,n,false)) {
+		if (-1 == con->stream(tmp,n,true)) {
 			log_warn(TAG,"error sending: %s",con->error());
 			return;
 		}
-		con->sync(true);
 		s -= n;
-	} while (s > 0);
+	}
 #endif // CONFIG_ENABLE_FLASH_MMAP
 }
 #endif // CONFIG_ROMFS
@@ -173,12 +270,22 @@ bool HttpServer::runFile(HttpRequest *req)
 #if defined CONFIG_ROMFS || defined HAVE_FS
 	const char *uri = req->getURI();
 	assert(*uri == '/');
+	size_t ul = strlen(uri);
+	// look for a precompressed variant, unless a .gz file is requested
+	bool gzok = (ul < 3) || strcmp(uri+ul-3,".gz");
 #endif
 #ifdef CONFIG_ROMFS
-	int r = romfs_open(uri+1);
+	int g = -1;
+	if (gzok) {
+		char gzn[ul+3];
+		memcpy(gzn,uri+1,ul-1);
+		memcpy(gzn+ul-1,".gz",4);
+		g = romfs_open(gzn);
+	}
+	int r = ((g >= 0) && req->acceptGzip()) ? g : romfs_open(uri+1);
 	if (r >= 0) {
 		log_dbug(TAG,"found %s in romfs",uri);
-		send_romfs(r,req);
+		send_romfs(r,req,r == g,g >= 0);
 		return true;
 	}
 #endif // CONFIG_ROMFS
@@ -187,17 +294,51 @@ bool HttpServer::runFile(HttpRequest *req)
 		log_warn(TAG,"wwwroot not set");
 		return false;
 	}
-	size_t ul = strlen(uri);
-	char path[m_rootlen + ul + 1];
+	char path[m_rootlen + ul + 4];
 	memcpy(path,m_wwwroot,m_rootlen);
 	memcpy(path+m_rootlen,uri,ul+1);
+	struct stat st;
+	bool gz = false, vary = false;
+	if (gzok) {
+		memcpy(path+m_rootlen+ul,".gz",4);
+		if (0 == stat(path,&st)) {
+			vary = true;
+			gz = req->acceptGzip();
+		}
+		if (!gz)
+			path[m_rootlen+ul] = 0;
+	}
 	log_dbug(TAG,"open(%s)",path);
 	int fd = open(path,O_RDONLY);
 	if (fd != -1) {
 		log_dbug(TAG,"sending file %s",path);
 		HttpResponse ans;
-		ans.setResult(HTTP_OK);
-		ans.senddata(req->getConnection(),fd);
+		if (gz)
+			ans.addHeader("Content-Encoding: gzip");
+		if (vary)
+			ans.addHeader("Vary: Accept-Encoding");
+		if (const char *ct = content_type(uri))
+			ans.setContentType(ct);
+		bool cached = false;
+		// Without a modification time, size alone does not identify
+		// the contents, so such files are sent without a validator.
+		if ((0 == fstat(fd,&st)) && (st.st_mtime > 0)) {
+			char etag[24];
+			snprintf(etag,sizeof(etag),"%lx-%lx",(unsigned long)st.st_mtime,(unsigned long)st.st_size);
+			struct tm tm;
+			gmtime_r(&st.st_mtime,&tm);
+			char lm[48];
+			strftime(lm,sizeof(lm),"Last-Modified: %a, %d %b %Y %H:%M:%S GMT",&tm);
+			ans.addHeader(lm);
+			cached = check_cache(req,ans,etag);
+		}
+		if (cached) {
+			ans.setResult(HTTP_NOT_MODIFIED);
+			ans.senddata(req->getConnection());
+		} else {
+			ans.setResult(HTTP_OK);
+			ans.senddata(req->getConnection(),fd);
+		}
 		close(fd);
 		return true;
 	}
@@ -305,7 +446,7 @@ void HttpServer::performPUT(HttpRequest *req)
 		int n;
 		do {
 			char buf[1024];
-			n = con->read(buf,sizeof(buf));
+			n = con->read(buf,sizeof(buf),HTTP_RECV_TIMEOUT);
 			if (n > 0)
 				n = write(fd,buf,n);
 		} while (n > 0);
@@ -328,6 +469,38 @@ void HttpServer::performPUT(HttpRequest *req)
 }
 
 
+// Returns true if the connection can be kept alive.
+bool HttpServer::performRequest(HttpRequest *req)
+{
+	LwTcp *con = req->getConnection();
+	con->countRequest();
+	httpreq_t t = req->getType();
+	if (t == hq_put) {
+		performPUT(req);
+	} else if (t == hq_post) {
+		performPOST(req);
+	} else if (t == hq_get) {
+		performGET(req);
+	} else if (t == hq_delete) {
+		estring fn = m_wwwroot;
+		fn += req->getURI();
+		HttpResponse ans;
+		if (unlink(fn.c_str()) == 0)
+			ans.setResult(HTTP_OK);
+		else if (errno == ENOENT)
+			ans.setResult(HTTP_NOT_FOUND);
+		else
+			ans.setResult(HTTP_INTERNAL_ERR);
+	} else {
+		HttpResponse ans;
+		ans.setResult(HTTP_BAD_REQ);
+		if (!ans.senddata(con))
+			return false;
+	}
+	return req->keepAlive() && (req->getError() == 0) && !con->isDetached();
+}
+
+
 void HttpServer::handleConnection(LwTcp *con)
 {
 	char *buf = (char *) malloc(HTTP_REQ_SIZE);
@@ -339,33 +512,9 @@ void HttpServer::handleConnection(LwTcp *con)
 	log_dbug(TAG,"new incoming connection");
 	HttpRequest *req = HttpRequest::parseRequest(con,buf,HTTP_REQ_SIZE);
 	while (req && (req->getError() == 0)) {
-		httpreq_t t = req->getType();
-		if (t == hq_put) {
-			performPUT(req);
-		} else if (t == hq_post) {
-			performPOST(req);
-		} else if (t == hq_get) {
-			performGET(req);
-		} else if (t == hq_delete) {
-			estring fn = m_wwwroot;
-			fn += req->getURI();
-			HttpResponse ans;
-			if (unlink(fn.c_str()) == 0)
-				ans.setResult(HTTP_OK);
-			else if (errno == ENOENT)
-				ans.setResult(HTTP_NOT_FOUND);
-			else
-				ans.setResult(HTTP_INTERNAL_ERR);
-		} else {
-			HttpResponse ans;
-			ans.setResult(HTTP_BAD_REQ);
-			if (!ans.senddata(con))
-				break;
-		}
-		bool a = req->keepAlive();
-		bool e = req->getError() != 0;
+		bool a = performRequest(req);
 		delete req;
-		if (!a || e)
+		if (!a)
 			break;
 		if (++count > 20)	// limit connection to 10 requests
 			break;
@@ -375,3 +524,26 @@ void HttpServer::handleConnection(LwTcp *con)
 }
 
 
+// Session of a worker pool: handles the requests that have been
+// received and returns true to park the connection until more data
+// arrives.
+bool HttpServer::handleRequests(LwTcp *con, char *buf, size_t bs)
+{
+	if (!con->hasData())
+		return con->isConnected();
+	do {
+		HttpRequest *req = HttpRequest::parseRequest(con,buf,bs);
+		if (req == 0)
+			return false;
+		bool a = (req->getError() == 0) && performRequest(req);
+		delete req;
+		if (!a)
+			return false;
+		// same limit as handleConnection
+		if (con->numRequests() > 20)
+			return false;
+	} while (con->hasData());
+	return con->isConnected();
+}
+
+
@@ -25,6 +25,8 @@
 #include <set>
 #include <assert.h>
 
+#define HTTP_REQ_SIZE 2048
+
 class HttpRequest;
 class HttpResponse;
 class LwTcp;
@@ -46,6 +48,7 @@ class HttpServer
 	{ return false; }
 
 	void handleConnection(LwTcp *);
+	bool handleRequests(LwTcp *, char *buf, size_t bs);
 
 	private:
 	HttpServer(const HttpServer &);
@@ -54,6 +57,7 @@ class HttpServer
 	bool runFile(HttpRequest *);
 	bool runDirectory(HttpRequest *);
 	bool runFunction(HttpRequest *);
+	bool performRequest(HttpRequest *);
 #ifdef WITH_MEMFILES
 	bool runMemory(HttpRequest *);
 #endif
@@ -49,6 +49,17 @@ using namespace std;
 #define TAG MODULE_ALARMS
 static EnvBool *Enabled = 0;
 
+// resolved action or event of an at-action, indexed like Config.at_actions
+struct AtBinding
+{
+	char *str = 0;		// copy of the action string, split at the argument
+	const char *arg = 0;
+	action_t act = 0;
+	event_t ev = 0;
+};
+
+static vector<AtBinding> Bindings;
+
 #ifdef CONFIG_HOLIDAYS
 static bool is_holiday(uint8_t d, uint8_t m, unsigned y)
 {
@@ -80,6 +91,36 @@ static bool is_holiday(uint8_t d, uint8_t m, unsigned y)
 #endif
 
 
+// resolves the action string once and again only after it has changed
+static const AtBinding &alarms_binding(size_t i, const char *aname)
+{
+	if (Bindings.size() <= i)
+		Bindings.resize(i+1);
+	AtBinding &b = Bindings[i];
+	if (b.str && ((b.act != 0) || (b.ev != 0))) {
+		size_t l = strlen(b.str);
+		if ((0 == memcmp(b.str,aname,l)) && (aname[l] == (b.arg ? ' ' : 0))
+			&& ((b.arg == 0) || (0 == strcmp(b.arg,aname+l+1))))
+			return b;
+	}
+	free(b.str);
+	b.str = strdup(aname);
+	b.arg = 0;
+	if (char *c = strchr(b.str,' ')) {
+		*c = 0;
+		b.arg = c+1;
+	}
+	if (strchr(b.str,'`')) {
+		b.act = 0;
+		b.ev = event_id(b.str);
+	} else {
+		b.act = action_handle(b.str);
+		b.ev = 0;
+	}
+	return b;
+}
+
+
 static unsigned alarms_loop(void *)
 {
 	static uint8_t last_m = 0xf0;
@@ -113,31 +154,17 @@ static unsigned alarms_loop(void *)
 		if (!x)
 			continue;
 		const char *aname = a.action().c_str();
-		size_t l = strlen(aname);
-		char action[l+1];
-		memcpy(action,aname,l+1);
 		log_dbug(TAG,"at %s %u:%02u => %s",Weekdays_de[wd],a.min_of_day()/60,a.min_of_day()%60,aname);
-		const char *arg = 0;
-		char *c = strchr(action,' ');
-		if (c) {
-			*c = 0;
-			arg = c+1;
-		}
-		if (strchr(aname,'`')) {
-			if (event_t e = event_id(aname)) {
-				if (arg)
-					event_trigger_arg(e,strdup(arg));
-				else
-					event_trigger(e);
-			} else {
-				log_warn(TAG,"unknown event %s",aname);
-			}
-		} else if (arg) {
-			if (action_activate_arg(aname,(void*)arg))
-				log_warn(TAG,"unknown action %s",aname);
+		const AtBinding &b = alarms_binding(i,aname);
+		if (b.ev) {
+			if (b.arg)
+				event_trigger_arg(b.ev,strdup(b.arg));
+			else
+				event_trigger(b.ev);
+		} else if (b.act) {
+			action_activate_h(b.act,(void*)b.arg);
 		} else {
-			if (action_activate(aname))
-				log_warn(TAG,"unknown action %s",aname);
+			log_warn(TAG,"unknown %s %s",strchr(aname,'`') ? "event" : "action",aname);
 		}
 	}
 	return 200;
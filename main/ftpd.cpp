@@ -442,22 +442,20 @@ static void store(ftpctx_t *ctx, const char *arg)
 	}
 	answer(ctx,"150 created %s",arg);
 	int n, total = 0;
-	char *buf = (char*)malloc(BUFSIZE);
-	if (buf == 0) {
-		answer(ctx,"552 error writing: out of memory");
-		log_warn(TAG,"unable to write to %s for storing: out of memory",arg);
-		goto cleanup;
-	}
 	do {
-		n = ctx->dcon->read(buf,BUFSIZE);
+		// write straight from the received pbufs
+		LwTcpSpan spans[4];
+		n = ctx->dcon->borrow(spans,sizeof(spans)/sizeof(spans[0]));
 		if (n > 0) {
-			int w = fwrite(buf,n,1,f);
-			if (-1 == w) {
-				answer(ctx,"552 error writing: %s",strerror(errno));
-				log_warn(TAG,"unable to write to %s for storing: %s",arg,strerror(errno));
-				goto cleanup;
+			for (unsigned i = 0; (i < sizeof(spans)/sizeof(spans[0])) && spans[i].size; ++i) {
+				if (spans[i].size != fwrite(spans[i].data,1,spans[i].size,f)) {
+					answer(ctx,"552 error writing: %s",strerror(errno));
+					log_warn(TAG,"unable to write to %s for storing: %s",arg,strerror(errno));
+					goto cleanup;
+				}
 			}
-			total += w;
+			ctx->dcon->release(n);
+			total += n;
 		} else if (n < 0) {
 			// 552: action aborted
 			answer(ctx,"552 error receiving for %s: %s",arg,ctx->dcon->error());
@@ -471,7 +469,6 @@ static void store(ftpctx_t *ctx, const char *arg)
 cleanup:
 	delete ctx->dcon;
 	ctx->dcon = 0;
-	free(buf);
 	fclose(f);
 #else
 	remove(fn);
@@ -482,19 +479,21 @@ cleanup:
 		return;
 	}
 	answer(ctx,"150 created %s",arg);
-	char *buf = (char*)malloc(BUFSIZE);
-	assert(buf);
 	int n, total = 0;
 	do {
-		n = ctx->dcon->read(buf,BUFSIZE);
+		// write straight from the received pbufs
+		LwTcpSpan spans[4];
+		n = ctx->dcon->borrow(spans,sizeof(spans)/sizeof(spans[0]));
 		if (n > 0) {
-			int w = write(fd,buf,n);
-			if (-1 == w) {
-				answer(ctx,"552 error writing: %s",strerror(errno));
-				log_warn(TAG,"unable to write to %s for storing: %s",arg,strerror(errno));
-				goto cleanup;
+			for (unsigned i = 0; (i < sizeof(spans)/sizeof(spans[0])) && spans[i].size; ++i) {
+				if (-1 == write(fd,spans[i].data,spans[i].size)) {
+					answer(ctx,"552 error writing: %s",strerror(errno));
+					log_warn(TAG,"unable to write to %s for storing: %s",arg,strerror(errno));
+					goto cleanup;
+				}
 			}
-			total += w;
+			ctx->dcon->release(n);
+			total += n;
 		} else if (n < 0) {
 			// 552: action aborted
 			answer(ctx,"552 receive error for %s: %s",arg,ctx->dcon->error());
@@ -508,7 +507,6 @@ cleanup:
 cleanup:
 	delete ctx->dcon;
 	ctx->dcon = 0;
-	free(buf);
 	close(fd);
 #endif
 }
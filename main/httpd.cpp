@@ -21,6 +21,8 @@
 #ifdef CONFIG_HTTP
 
 #include "actions.h"
+#include "astream.h"
+#include "cyclic.h"
 #include "swcfg.h"
 #include "globals.h"
 #include "HttpServer.h"
@@ -32,6 +34,7 @@
 #include "nvm.h"
 #include "lwtcp.h"
 #include "mem_term.h"
+#include "mstream.h"
 #include "netsvc.h"
 #include "romfs.h"
 #include "profiling.h"
@@ -57,9 +60,12 @@
 #include <esp_ota_ops.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <vector>
+
 #ifndef WWW_ROOT
 #define WWW_ROOT "/"
 #endif
@@ -68,6 +74,8 @@
 #define HTTP_PORT 80
 #endif
 
+#define JSON_CHUNK 1024	// < 0x10000, see webdata_json
+
 #if defined CONFIG_FATFS || defined CONFIG_SPIFFS
 #define HAVE_FS
 #endif
@@ -78,7 +86,9 @@ using namespace std;
 #define TAG MODULE_WWW
 
 static HttpServer *WWW = 0;
+#if CONFIG_HTTP_WORKERS == 0
 static SemaphoreHandle_t Sem = 0;
+#endif
 
 
 static void send_json(HttpRequest *req, void (*f)(stream&))
@@ -92,12 +102,338 @@ static void send_json(HttpRequest *req, void (*f)(stream&))
 }
 
 
+// RTData is serialized in chunks of JSON_CHUNK bytes, so memory use
+// does not depend on the size of the tree and rtd_lock is only held
+// while one chunk is generated.
 static void webdata_json(HttpRequest *req)
 {
-	send_json(req,runtimedata_to_json);
+	LwTcp *con = req->getConnection();
+	// HTTP/1.0 has no chunked encoding, the connection close ends the body
+	bool chunked = (req->getVersion() != hv_1_0);
+	HttpResponse res;
+	res.setResult(HTTP_OK);
+	res.setContentType(CT_APP_JSON);
+	if (chunked)
+		res.addHeader("Transfer-Encoding: chunked");
+	else	// without length the end of the body is the end of the connection
+		req->setKeepAlive(false);
+	char *buf = (char *) malloc(JSON_CHUNK+8);
+	if ((buf == 0) || !res.senddata(con)) {
+		req->setKeepAlive(false);
+		free(buf);
+		return;
+	}
+	EnvJson json(RTData);
+	for (;;) {
+		rtd_lock();
+		size_t n = json.read(buf+6,JSON_CHUNK);
+		rtd_unlock();
+		const char *data = buf+6;
+		size_t l = n;
+		if (chunked) {
+			// fixed width chunk size, leading zeros are valid
+			char hdr[8];
+			sprintf(hdr,"%04x\r\n",(unsigned)n);
+			memcpy(buf,hdr,6);
+			memcpy(buf+6+n,"\r\n",2);
+			data = buf;
+			l = n + 8;
+		} else if (n == 0) {
+			break;
+		}
+		if (0 != con->write(data,l)) {
+			req->setKeepAlive(false);
+			break;
+		}
+		if (n == 0)
+			break;
+	}
+	free(buf);
+}
+
+
+#ifdef CONFIG_HTTP_EVENTS
+// Server-sent events on /events: a viewer gets a snapshot of RTData on
+// connect and afterwards only the elements that have changed. Changes
+// are coalesced per frame and serialized once for all viewers. A viewer
+// that cannot keep up is dropped. EventSource reconnects automatically
+// and starts over with a new snapshot.
+
+#define EV_MAX_VIEWERS	4
+#define EV_HEARTBEAT	15000	// ms
+#define EV_BACKLOG	8192	// bytes not yet sent to a viewer
+#define EV_STALL	30000	// ms without progress
+
+struct EventElement
+{
+	EnvElement *elem;
+	uint32_t ver;
+	uint16_t key, klen;	// "\"<path>\":" in EvKeys
+};
+
+// frames are queued per viewer and sent as far as the send buffer
+// takes, so that a slow viewer never blocks the cyclic task
+struct EventViewer
+{
+	LwTcp *con;
+	astream *out;
+	size_t off;	// sent part of out
+	uint32_t ts;	// last progress
+	bool dead;	// dropped on the next cyclic run
+};
+
+static SemaphoreHandle_t EvMtx = 0;
+static EventViewer Viewers[EV_MAX_VIEWERS];
+static unsigned NumViewers = 0;
+static vector<EventElement> EvElements;
+static estring EvKeys;
+static unsigned EvGen = UINT_MAX;
+static astream *EvFrame = 0;
+static uint32_t EvSent = 0;
+
+
+static uint32_t event_version(EnvElement *e)
+{
+	if (e->toNumber() || e->toBool() || e->toString())
+		return e->version();
+	// elements like uptime are computed on read and have no version
+	char buf[64];
+	mstream s(buf,sizeof(buf));
+	e->writeValue(s);
+	uint32_t h = 2166136261U;
+	for (const char *c = buf, *end = buf+s.size(); c != end; ++c)
+		h = (h ^ (uint8_t)*c) * 16777619U;
+	return h;
 }
 
 
+static void event_value(stream &s, EnvElement *e)
+{
+	// same representation as in toStream
+	if (e->toString()) {
+		s << '"';
+		e->writeValue(s);
+		s << '"';
+	} else if (const char *dim = e->getDimension()) {
+		s << '"';
+		e->writeValue(s);
+		s << ' ';
+		s.print(dim);
+		s << '"';
+	} else {
+		e->writeValue(s);
+	}
+}
+
+
+static void events_plan(EnvObject *o)
+{
+	for (EnvElement *e : o->getChilds()) {
+		if (EnvObject *c = e->toObject()) {
+			events_plan(c);
+			continue;
+		}
+		EventElement ev;
+		ev.elem = e;
+		ev.ver = event_version(e);
+		ev.key = EvKeys.size();
+		char path[e->getPath(0,'/')+1];
+		e->getPath(path,'/');
+		EvKeys += '"';
+		EvKeys += path;
+		EvKeys += "\":";
+		ev.klen = EvKeys.size() - ev.key;
+		EvElements.push_back(ev);
+	}
+}
+
+
+// must be called with EvMtx and rtd_lock held
+static void events_replan()
+{
+	EvElements.clear();
+	EvKeys.clear();
+	events_plan(RTData);
+	EvGen = EnvObject::generation();
+}
+
+
+// must be called with EvMtx held
+// returns false if nothing has changed
+static bool events_frame(astream &f)
+{
+	f.reset();
+	rtd_lock();
+	if (EvGen != EnvObject::generation()) {
+		events_replan();
+		f << "event: full\ndata: ";
+		RTData->toStream(f);
+		f << "\n\n";
+	} else {
+		const char *keys = EvKeys.data();
+		char sep = '{';
+		for (EventElement &ev : EvElements) {
+			uint32_t v = event_version(ev.elem);
+			if (v == ev.ver)
+				continue;
+			ev.ver = v;
+			if (sep == '{')
+				f << "data: ";
+			f << sep;
+			f.write(keys+ev.key,ev.klen);
+			event_value(f,ev.elem);
+			sep = ',';
+		}
+		if (sep == ',')
+			f << "}\n\n";
+	}
+	rtd_unlock();
+	return f.size() != 0;
+}
+
+
+// appends a frame to the backlog of the viewer
+// returns false if the backlog is exceeded
+static bool events_queue(EventViewer &v, const char *f, size_t l, uint32_t now)
+{
+	if (v.off) {
+		v.out->drop(v.off);
+		v.off = 0;
+	}
+	if (v.out->size() == 0)
+		v.ts = now;
+	else if (v.out->size() + l > EV_BACKLOG)
+		return false;
+	return (int)l == v.out->write(f,l);
+}
+
+
+// sends as much of the backlog as the send buffer takes
+// returns false on error or if the viewer has stalled
+static bool events_flush(EventViewer &v, uint32_t now)
+{
+	size_t s = v.out->size();
+	if (v.off == s)
+		return true;
+	int n = v.con->trywrite(v.out->buffer()+v.off,s-v.off);
+	if (n < 0)
+		return false;
+	if (n > 0) {
+		v.off += n;
+		v.ts = now;
+		if (v.off == s) {
+			v.out->reset();
+			v.off = 0;
+		}
+		return true;
+	}
+	return now - v.ts < EV_STALL;
+}
+
+
+static void events_drop(unsigned i)
+{
+	log_dbug(TAG,"dropping event viewer");
+	EventViewer &v = Viewers[i];
+	v.con->close();
+	delete v.con;
+	delete v.out;
+	Viewers[i] = Viewers[--NumViewers];
+}
+
+
+static unsigned events_cyclic(void *)
+{
+	Lock lock(EvMtx,__FUNCTION__);
+	if (NumViewers == 0)
+		return CONFIG_HTTP_EVENT_INTERVAL;
+	uint32_t now = uptime();
+	bool send = true;
+	if (!events_frame(*EvFrame)) {
+		if (now - EvSent < EV_HEARTBEAT)
+			send = false;
+		else	// comment line to detect dead viewers
+			*EvFrame << ":\n\n";
+	}
+	if (send)
+		EvSent = now;
+	unsigned i = 0;
+	while (i < NumViewers) {
+		EventViewer &v = Viewers[i];
+		if (!v.dead && send && !events_queue(v,EvFrame->buffer(),EvFrame->size(),now))
+			v.dead = true;
+		// the HTTP session might still access the connection,
+		// until it has been handed over
+		if (!v.con->isHandedOver()) {
+			++i;
+		} else if (!v.dead && v.con->isConnected() && events_flush(v,now)) {
+			++i;
+		} else {
+			events_drop(i);
+		}
+	}
+	return CONFIG_HTTP_EVENT_INTERVAL;
+}
+
+
+static void events_open(HttpRequest *req)
+{
+	LwTcp *con = req->getConnection();
+	HttpResponse res;
+	bool full;
+	{
+		Lock lock(EvMtx,__FUNCTION__);
+		full = (NumViewers == EV_MAX_VIEWERS);
+	}
+	// responses are sent without EvMtx, as senddata might block
+	if (full) {
+		res.setResult(HTTP_SVC_UNAVAIL);
+		res.senddata(con);
+		return;
+	}
+	res.setResult(HTTP_OK);
+	res.setContentType("text/event-stream");
+	res.addHeader("Cache-Control: no-cache");
+	if (!res.senddata(con))
+		return;
+	// the snapshot may exceed the send buffer, so it is queued like
+	// any other frame
+	astream *out = new astream(1024);
+	*out << "retry: 2000\nevent: full\ndata: ";
+	// hold EvMtx so that no frame is sent between snapshot and
+	// registration of the viewer
+	Lock lock(EvMtx,__FUNCTION__);
+	if (NumViewers == EV_MAX_VIEWERS) {
+		delete out;
+		req->setKeepAlive(false);
+		return;
+	}
+	rtd_lock();
+	// without viewers, nobody depends on the versions of the plan, so
+	// it is brought up to date to make the next frame a delta
+	if (NumViewers == 0)
+		events_replan();
+	RTData->toStream(*out);
+	rtd_unlock();
+	*out << "\n\n";
+	if (out->buffer() == 0) {
+		delete out;
+		req->setKeepAlive(false);
+		return;
+	}
+	con->detach();
+	EventViewer &v = Viewers[NumViewers++];
+	v.con = con;
+	v.out = out;
+	v.off = 0;
+	v.ts = uptime();
+	// closing is left to events_cyclic after the hand over
+	v.dead = !events_flush(v,v.ts);
+	log_dbug(TAG,"%u event viewers",NumViewers);
+}
+#endif
+
+
 static void publish_config(stream &json)
 {
 	// security: do not publish confidential data!
@@ -156,6 +492,46 @@ static void actions_json(HttpRequest *req)
 }
 
 
+static void write_action_stats(void *p, const Action *a)
+{
+	PubAction *s = (PubAction *)p;
+	uint32_t n = a->num;
+	if (n == 0)
+		return;
+	stream &json = s->out;
+	if (s->comma)
+		json << ",\n";
+	else
+		s->comma = true;
+	json << "{\"name\":\"" << a->name << "\",\"num\":" << n << ",\"sum\":" << a->sum
+		<< ",\"min\":" << a->min << ",\"max\":" << a->max
+		<< ",\"p50\":" << a->percentile(50) << ",\"p99\":" << a->percentile(99)
+		<< ",\"hist\":[";
+	for (unsigned b = 0; b < ACTION_BUCKETS; ++b) {
+		if (b)
+			json << ',';
+		json << a->hist[b];
+	}
+	json << "]}";
+}
+
+
+// times in us, histogram bucket i counts runtimes below 2^(i+5)us
+static void publish_action_stats(stream &json)
+{
+	PubAction a(json);
+	json << "{\"actions\":[\n";
+	action_iterate(write_action_stats,(void*)&a);
+	json << "\n]}\n";
+}
+
+
+static void action_stats_json(HttpRequest *req)
+{
+	send_json(req,publish_action_stats);
+}
+
+
 #ifdef CONFIG_HTTP_REVEAL_CONFIG
 static void config_bin(HttpRequest *req)
 {
@@ -413,10 +789,11 @@ static void updateFirmware(HttpRequest *r)
 		}
 		memcpy(tmp,r->getContent(),s0);
 		if (s0 != s) {
-			int n = c->read((char*)tmp+s0,s - s0);
+			int n = c->read((char*)tmp+s0,s - s0,HTTP_RECV_TIMEOUT);
 			if (n < 0)
-				log_error(TAG,"error receiving data: %s",strerror(errno));
-			s0 += n;
+				log_error(TAG,"error receiving data: %s",c->error());
+			else
+				s0 += n;
 		}
 		bool r = false;
 		if (s == s0) {
@@ -474,8 +851,8 @@ static void updateFirmware(HttpRequest *r)
 	while (s > 0) {
 		sprintf(st,"updating at 0x%x, %d to go",(unsigned)addr,s);
 		UpdateState->set(st);
-		log_dbug(TAG,st);
-		int n = c->read(buf,s > FLASHBUFSIZE ? FLASHBUFSIZE : s);
+		log_dbug(TAG,"%s",st);
+		int n = c->read(buf,s > FLASHBUFSIZE ? FLASHBUFSIZE : s,HTTP_RECV_TIMEOUT);
 		if (0 > n) {
 			snprintf(st,sizeof(st),"receive error: %s",c->error());
 			UpdateState->set(st);
@@ -499,7 +876,7 @@ static void updateFirmware(HttpRequest *r)
 		if (e) {
 			snprintf(st,sizeof(st),"write error: %d",e);
 			UpdateState->set(st);
-			log_warn(TAG,st);
+			log_warn(TAG,"%s",st);
 			free(buf);
 			if (ota)
 				esp_ota_end(ota);
@@ -568,6 +945,13 @@ static void postConfig(HttpRequest *r)
 }
 
 
+#if CONFIG_HTTP_WORKERS > 0
+static bool httpd_pool_session(LwTcp *con, char *buf, size_t bs)
+{
+	PROFILE_FUNCTION();
+	return WWW && WWW->handleRequests(con,buf,bs);
+}
+#else
 static void httpd_session(LwTcp *con)
 {
 	PROFILE_FUNCTION();
@@ -579,10 +963,14 @@ static void httpd_session(LwTcp *con)
 	} else {
 		log_warn(TAG,"too many connections");
 	}
-	con->close();
+	if (!con->isDetached())
+		con->close();
+	else
+		con->handOver();
 	xSemaphoreGive(Sem);
 	vTaskDelete(0);
 }
+#endif
 
 
 void httpd_setup()
@@ -645,11 +1033,18 @@ void httpd_setup()
 #endif
 	WWW->addFunction("/config.json",config_json);
 	WWW->addFunction("/actions.json",actions_json);
+	WWW->addFunction("/action_stats.json",action_stats_json);
 #ifdef CONFIG_HTTP_REVEAL_CONFIG
 	WWW->addFunction("/config.bin",config_bin);	// reveals passwords
 #endif
 	WWW->addFunction("/alarms.json",alarms_json);
 	WWW->addFunction("/data.json",webdata_json);
+#ifdef CONFIG_HTTP_EVENTS
+	EvMtx = xSemaphoreCreateMutex();
+	EvFrame = new astream(1024);
+	WWW->addFunction("/events",events_open);
+	cyclic_add_task("events",events_cyclic,0,0);
+#endif
 	WWW->addFunction("/run_exe",exeShell);
 	WWW->addFunction("/post_config",postConfig);
 #ifdef CONFIG_CAMERA
@@ -658,8 +1053,12 @@ void httpd_setup()
 #ifdef CONFIG_ESP_COREDUMP_ENABLE_TO_FLASH
 	WWW->addFunction("/core",getCore);
 #endif
+#if CONFIG_HTTP_WORKERS > 0
+	listen_pool(port,httpd_pool_session,"httpd",7,4096,CONFIG_HTTP_WORKERS,CONFIG_HTTP_ACCEPT_QUEUE,HTTP_REQ_SIZE,CONFIG_HTTP_IDLE_TIMEOUT);
+#else
 	Sem = xSemaphoreCreateCounting(4,4);
 	listen_port(port,m_tcp,httpd_session,"httpd","_http",7,4096);
+#endif
 }
 
 #endif	// CONFIG_HTTP
@@ -28,6 +28,7 @@ typedef enum { m_sock = 0, m_tcp = 1, m_udp = 2, m_bcast = 3 } inet_mode_t;
 struct LwTcp;
 
 int listen_port(int port, inet_mode_t mode, void (*session)(LwTcp *), const char *basename, const char *service, unsigned prio, unsigned stack);
+int listen_pool(int port, bool (*session)(LwTcp *, char *, size_t), const char *basename, unsigned prio, unsigned stack, unsigned workers, unsigned queue, unsigned bufsize, unsigned idle);
 
 #ifdef __cplusplus
 }
@@ -22,9 +22,11 @@
 
 #include "actions.h"
 #include "astream.h"
+#include "cyclic.h"
 #include "globals.h"
 #include "influx.h"
 #include "env.h"
+#include "estring.h"
 #include "log.h"
 #include "netsvc.h"
 #include "swcfg.h"
@@ -41,8 +43,12 @@
 #include <lwip/tcp.h>
 #include <lwip/udp.h>
 #include <lwip/priv/tcpip_priv.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #ifdef write
@@ -80,6 +86,348 @@ static sys_sem_t LwipSem = 0;
 #endif
 
 
+#ifdef CONFIG_INFLUX_SPILL
+#define INFLUX_SPILLFILE "/flash/influx.spl"
+#endif
+
+// maximum payload of a UDP datagram
+#define INFLUX_UDP_MAX	1400
+
+// queue time marks of the ring, see InfluxRing::mark
+#define INFLUX_MARKS	8
+
+
+// Preallocated ring of line-protocol points, each terminated by '\n'.
+// Points carry an explicit timestamp, so they can be sent late and out
+// of order after a network outage. Accessed with Mtx held, except
+// spill_io.
+//
+// Spilling: points that are pushed out of the full ring are moved to a
+// RAM stage. The influx cyclic task writes the stage to the spill file
+// and reads the file back when there is room in the ring, so no flash
+// I/O happens with Mtx held.
+class InfluxRing
+{
+	public:
+	explicit InfluxRing(size_t s);
+
+	bool push(const char *d, size_t l, const struct timeval &tv);
+	size_t lines(size_t max) const;
+	size_t segment(size_t off, size_t n, const char **p) const;
+	unsigned pop(size_t n);
+
+	size_t size() const
+	{ return fill; }
+
+	// time since the oldest point in the ring was queued
+	uint32_t age(uint32_t now) const
+	{ return fill ? now - marks[0].t : 0; }
+
+	unsigned queued = 0, flushed = 0, dropped = 0;
+	uint64_t bytes = 0;
+#ifdef CONFIG_INFLUX_SPILL
+	unsigned spilled = 0;
+	void spill_io();
+#endif
+
+	private:
+	void put(const char *d, size_t l);
+	void mark(uint32_t now);
+	unsigned count(size_t off, size_t n) const;
+	size_t skip(size_t n) const;
+#ifdef CONFIG_INFLUX_SPILL
+	bool stage_out(size_t n);
+
+	char *stage = 0, *iobuf = 0;
+	size_t scap = 0, stagel = 0;
+	FILE *spillf = 0;
+	long rdoff = 0, wroff = 0;
+#endif
+
+	char *buf;
+	size_t cap, head = 0, fill = 0;
+	// Coarse queue times: the points from marks[i].pos on were queued
+	// at marks[i].t or later. Positions count all bytes ever queued.
+	struct {
+		uint32_t pos, t;
+	} marks[INFLUX_MARKS];
+	uint32_t rdpos = 0;
+	uint8_t nmarks = 0;
+};
+
+
+InfluxRing::InfluxRing(size_t s)
+: buf((char *) malloc(s))
+, cap(buf ? s : 0)
+{
+#ifdef CONFIG_INFLUX_SPILL
+	unlink(INFLUX_SPILLFILE);
+#endif
+}
+
+
+void InfluxRing::put(const char *d, size_t l)
+{
+	size_t t = head + fill;
+	if (t >= cap)
+		t -= cap;
+	size_t n = cap - t;
+	if (n > l)
+		n = l;
+	memcpy(buf+t,d,n);
+	memcpy(buf,d+n,l-n);
+	fill += l;
+}
+
+
+// returns a pointer to the data at offset off and the number of
+// contiguous bytes available up to n
+size_t InfluxRing::segment(size_t off, size_t n, const char **p) const
+{
+	size_t o = head + off;
+	if (o >= cap)
+		o -= cap;
+	*p = buf + o;
+	return (cap - o) < n ? cap - o : n;
+}
+
+
+// number of points in n bytes at offset off
+unsigned InfluxRing::count(size_t off, size_t n) const
+{
+	unsigned r = 0;
+	while (n) {
+		const char *p;
+		size_t s = segment(off,n,&p);
+		for (size_t i = 0; i < s; ++i)
+			r += (p[i] == '\n');
+		off += s;
+		n -= s;
+	}
+	return r;
+}
+
+
+// size of the oldest complete lines that cover at least n bytes
+size_t InfluxRing::skip(size_t n) const
+{
+	size_t i = 0, o = head;
+	while (i < fill) {
+		bool nl = buf[o] == '\n';
+		++i;
+		if (nl && (i >= n))
+			return i;
+		if (++o == cap)
+			o = 0;
+	}
+	return fill;
+}
+
+
+// Returns the size of the complete lines that fit into max bytes, or
+// the size of the first line if it exceeds max.
+size_t InfluxRing::lines(size_t max) const
+{
+	size_t r = 0, i = 0, o = head;
+	while (i < fill) {
+		if (buf[o] == '\n') {
+			if ((i >= max) && r)
+				break;
+			r = i + 1;
+			if (r >= max)
+				break;
+		}
+		++i;
+		if (++o == cap)
+			o = 0;
+	}
+	return r;
+}
+
+
+// removes n bytes and returns the number of points removed
+unsigned InfluxRing::pop(size_t n)
+{
+	unsigned r = count(0,n);
+	head += n;
+	if (head >= cap)
+		head -= cap;
+	fill -= n;
+	rdpos += n;
+	if (fill == 0) {
+		head = 0;
+		nmarks = 0;
+	} else {
+		// the first remaining point is covered by the last mark
+		// at or before it
+		unsigned m = 0;
+		while ((m + 1 < nmarks) && ((int32_t)(marks[m+1].pos - rdpos) <= 0))
+			++m;
+		if (m) {
+			nmarks -= m;
+			memmove(marks,marks+m,nmarks*sizeof(marks[0]));
+		}
+	}
+	return r;
+}
+
+
+// Records the queue time of a point that is about to be put. A new mark
+// is only added if the last one is older than 1/INFLUX_MARKS of the
+// maximum age, otherwise the point shares the older last mark. So the
+// age is never underestimated and points are not sent late.
+void InfluxRing::mark(uint32_t now)
+{
+	if ((nmarks == 0) || ((nmarks < INFLUX_MARKS) && (now - marks[nmarks-1].t >= CONFIG_INFLUX_MAXAGE*1000/INFLUX_MARKS))) {
+		marks[nmarks].pos = rdpos + fill;
+		marks[nmarks].t = now;
+		++nmarks;
+	}
+}
+
+
+bool InfluxRing::push(const char *d, size_t l, const struct timeval &tv)
+{
+	while (l && ((d[l-1] == '\n') || (d[l-1] == ' ')))
+		--l;
+	const char *sp = (const char *) memchr(d,' ',l);
+	if ((sp == 0) || (sp+1 == d+l) || memchr(d,'\n',l)) {
+		log_warn(TAG,"invalid point: %.*s",l,d);
+		return false;
+	}
+	char ts[24];
+	size_t tl = 0;
+	if (tv.tv_sec > 1600000000) {
+		// nanoseconds with millisecond resolution
+		tl = sprintf(ts," %lu%03u000000",(unsigned long)tv.tv_sec,(unsigned)(tv.tv_usec/1000));
+	}
+	size_t n = l + tl + 1;
+	if (n > cap) {
+		++dropped;
+		return false;
+	}
+	if (fill + n > cap) {
+		// make room by removing the oldest points
+		size_t o = skip(fill + n - cap);
+#ifdef CONFIG_INFLUX_SPILL
+		if (stage_out(o))
+			spilled += pop(o);
+		else
+#endif
+		dropped += pop(o);
+	}
+	mark(uptime());
+	put(d,l);
+	put(ts,tl);
+	put("\n",1);
+	++queued;
+	return true;
+}
+
+
+#ifdef CONFIG_INFLUX_SPILL
+// copies the oldest n bytes to the stage
+bool InfluxRing::stage_out(size_t n)
+{
+	if (stage == 0) {
+		// allocated on first use, never released
+		scap = cap / 2;
+		stage = (char *) malloc(2*scap);
+		if (stage == 0)
+			return false;
+		iobuf = stage + scap;
+	}
+	if (stagel + n > scap)
+		return false;
+	size_t off = 0;
+	while (off < n) {
+		const char *p;
+		size_t s = segment(off,n-off,&p);
+		memcpy(stage+stagel+off,p,s);
+		off += s;
+	}
+	stagel += n;
+	return true;
+}
+
+
+// influx cyclic task: writes the stage to the spill file and reads
+// spilled points back into free space of the ring. Mtx is only held
+// while data is copied.
+void InfluxRing::spill_io()
+{
+	if (stage == 0)
+		return;
+	size_t n;
+	{
+		Lock lock(Mtx,__FUNCTION__);
+		n = stagel;
+		memcpy(iobuf,stage,n);
+		stagel = 0;
+	}
+	if (n) {
+		if (spillf == 0) {
+			spillf = fopen(INFLUX_SPILLFILE,"w+");
+			rdoff = 0;
+			wroff = 0;
+			if (spillf == 0)
+				log_warn(TAG,"create %s: %s",INFLUX_SPILLFILE,strerror(errno));
+		}
+		if (spillf && (0 == fseek(spillf,wroff,SEEK_SET)) && (1 == fwrite(iobuf,n,1,spillf))) {
+			wroff += n;
+		} else {
+			if (spillf)
+				log_warn(TAG,"write %s: %s",INFLUX_SPILLFILE,strerror(errno));
+			unsigned np = 0;
+			for (size_t i = 0; i < n; ++i)
+				np += (iobuf[i] == '\n');
+			Lock lock(Mtx,__FUNCTION__);
+			spilled -= np < spilled ? np : spilled;
+			dropped += np;
+		}
+	}
+	if (spillf == 0)
+		return;
+	size_t room;
+	{
+		Lock lock(Mtx,__FUNCTION__);
+		room = cap - fill;
+	}
+	if (room > scap)
+		room = scap;
+	size_t r = 0;
+	if (room && (0 == fseek(spillf,rdoff,SEEK_SET)))
+		r = fread(iobuf,1,room,spillf);
+	// only take complete lines
+	while (r && (iobuf[r-1] != '\n'))
+		--r;
+	if (r) {
+		unsigned np = 0;
+		for (size_t i = 0; i < r; ++i)
+			np += (iobuf[i] == '\n');
+		Lock lock(Mtx,__FUNCTION__);
+		mark(uptime());
+		put(iobuf,r);
+		spilled -= np < spilled ? np : spilled;
+		rdoff += r;
+	} else if ((room == scap) && (rdoff < wroff)) {
+		// no complete line fits into an empty I/O buffer
+		log_warn(TAG,"discarding corrupt %s",INFLUX_SPILLFILE);
+		rdoff = wroff;
+	}
+	if (rdoff >= wroff) {
+		// all spilled points are back in RAM
+		fclose(spillf);
+		spillf = 0;
+		unlink(INFLUX_SPILLFILE);
+	}
+}
+#endif
+
+
+static InfluxRing *Ring = 0;
+
+
 static void handle_err(void *arg, err_t e)
 {
 	log_warn(TAG,"handle error %s",strlwiperr(e));
@@ -174,6 +522,36 @@ static void influx_term(void * = 0)
 }
 
 
+static int influx_mkheader()
+{
+	Lock lock(Mtx,__FUNCTION__);
+	const Influx &influx = Config.influx();
+	size_t hl = influx.measurement().size();
+	size_t nl = Config.nodename().size();
+	if (nl)
+		hl += 6 + nl;
+	char *nh = (char*)realloc(Header,hl+1);			// 1 for \0
+	if (nh == 0) {
+		HL = 0;
+		if (Header) {
+			free(Header);
+			Header = 0;
+		}
+		log_error(TAG,"Out of memory.");
+		return 1;
+	}
+	Header = nh;
+	strcpy(Header,influx.measurement().c_str());
+	if (nl) {
+		strcat(Header,",node=");
+		strcat(Header,Config.nodename().c_str());
+	}
+	Header[hl] = 0;
+	HL = hl;
+	return 0;
+}
+
+
 static void influx_init(void * = 0)
 {
 	if ((StationMode != station_connected) || !Config.has_influx() || !Config.has_nodename())
@@ -186,6 +564,8 @@ static void influx_init(void * = 0)
 		influx_term();
 	}
 	if (State == offline) {
+		if (influx_mkheader())
+			return;
 		const char *host = influx.hostname().c_str();
 		int e = query_host(host,0,influx_connect,0);
 		if (e < 0)
@@ -212,28 +592,6 @@ static void influx_connect(const char *hn, const ip_addr_t *addr, void *arg)
 	}
 	const Influx &influx = Config.influx();
 	uint16_t port = influx.port();
-	size_t hl = influx.measurement().size();
-	size_t nl = Config.nodename().size();	// 1 for trailing space of header
-	if (nl)
-		hl += 6 + nl;
-	char *nh = (char*)realloc(Header,hl+1);			// 1 for \0
-	if (nh == 0) {
-		HL = 0;
-		if (Header) {
-			free(Header);
-			Header = 0;
-		}
-		log_error(TAG,"Out of memory.");
-		return;
-	}
-	Header = nh;
-	strcpy(Header,influx.measurement().c_str());
-	if (nl) {
-		strcat(Header,",node=");
-		strcat(Header,Config.nodename().c_str());
-	}
-	Header[hl] = 0;
-	HL = hl;
 	char addrstr[32];
 	inet_ntoa_r(*addr,addrstr,sizeof(addrstr));
 	assert((0 == UPCB) && (0 == TPCB));
@@ -271,26 +629,24 @@ static void influx_connect(const char *hn, const ip_addr_t *addr, void *arg)
 }
 
 
+// Returns 0 if data should be queued. Points are buffered while the
+// connection is being (re-)established.
 static int influx_send_check()
 {
 	switch (State) {
 	case offline:
 		influx_init();
-		return 1;
-	case stopped:
-	case connecting:
-	case bug:
-		return 1;
+		break;
 	case term:
 	case error:
 		influx_term();
-		return 1;
-	case running:
-		return 0;
+		break;
 	default:
 		break;
 	}
-	return 1;
+	if ((State == stopped) || (State == bug) || (Ring == 0))
+		return 1;
+	return Header == 0;
 }
 
 
@@ -310,135 +666,199 @@ void influx_sendf(const char *fmt, ...)
 	if (influx_send_check())
 		return;
 	char buf[128], *b;
-	va_list val;
+	va_list val, val2;
 	size_t n;
 	va_start(val,fmt);
+	va_copy(val2,val);
 	{
 		Lock lock(Mtx,__FUNCTION__);
 		n = vsnprintf(buf+HL,sizeof(buf)-HL,fmt,val);
-		if ((n + HL) > sizeof(buf)) {
-			b = (char *)malloc(n+1);
-			vsprintf(b+HL,fmt,val);
+		if ((n + HL) >= sizeof(buf)) {
+			b = (char *)malloc(n+HL+1);
+			if (b)
+				vsprintf(b+HL,fmt,val2);
 		} else {
 			b = buf;
 		}
-		memcpy(b,Header,HL);
+		if (b)
+			memcpy(b,Header,HL);
 	}
+	va_end(val2);
 	va_end(val);
-	influx_send(b,n);
+	if (b == 0)
+		return;
+	influx_send(b,n+HL);
 	if (b != buf)
 		free(b);
 }
 
 
-#ifndef CONFIG_IDF_TARGET_ESP8266
-typedef struct send_s {
-	const void *data;
-	size_t len;
-} send_t;
-
-static void send_fn(void *arg)
-{
-	send_t *s = (send_t *)arg;
-	void *sp = memchr(s->data,' ',s->len);
-	if ((sp == 0) || (0 == memchr(sp,' ',s->len-((char*)sp-(char*)s->data)))) {
-		State = bug;
-		log_warn(TAG,"BUG: %.*s",s->len,s->data);
-		xSemaphoreGive(LwipSem);
-		return;
-	}
-	log_dbug(TAG,"send '%.*s'",s->len,s->data);
-	err_t e;
+// Sends buffered points as one HTTP POST or as MTU sized datagrams.
+// Executed in LwIP context with Mtx held by the caller.
+static void flush_fn(void *)
+{
+#ifdef CONFIG_IDF_TARGET_ESP8266
+	LWIP_LOCK();
+#endif
+	err_t e = 0;
 	if (TPCB) {
-		char len[16];
-		int n = sprintf(len,"%u\r\n\r\n",s->len);
-		e = tcp_write(TPCB,TcpHdr,THL,TCP_WRITE_FLAG_MORE);
-		if (e == 0)
-			e = tcp_write(TPCB,len,n,TCP_WRITE_FLAG_MORE|TCP_WRITE_FLAG_COPY);
-		if (e == 0)
-			e = tcp_write(TPCB,s->data,s->len,TCP_WRITE_FLAG_COPY);
-		if (e == 0)
-			tcp_output(TPCB);
+		size_t avail = tcp_sndbuf(TPCB);
+		avail = avail > THL + 16 ? avail - THL - 16 : 0;
+		size_t n = Ring->lines(avail);
+		// all or nothing, a partial request would corrupt the stream
+		if (n && (n <= avail) && (tcp_sndqueuelen(TPCB) + 4 <= TCP_SND_QUEUELEN)) {
+			char len[16];
+			int ll = sprintf(len,"%u\r\n\r\n",n);
+			e = tcp_write(TPCB,TcpHdr,THL,TCP_WRITE_FLAG_MORE);
+			if (e == 0)
+				e = tcp_write(TPCB,len,ll,TCP_WRITE_FLAG_MORE|TCP_WRITE_FLAG_COPY);
+			size_t off = 0;
+			while ((e == 0) && (off < n)) {
+				const char *p;
+				size_t s = Ring->segment(off,n-off,&p);
+				off += s;
+				e = tcp_write(TPCB,p,s,TCP_WRITE_FLAG_COPY|(off < n ? TCP_WRITE_FLAG_MORE : 0));
+			}
+			if (e == 0) {
+				tcp_output(TPCB);
+				log_dbug(TAG,"POST %u bytes",n);
+				Ring->bytes += THL + ll + n;
+				Ring->flushed += Ring->pop(n);
+			}
+		} else {
+			log_devel(TAG,"flush deferred, sndbuf %u",tcp_sndbuf(TPCB));
+		}
 	} else if (UPCB) {
-		struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT,s->len,PBUF_RAM);
-		pbuf_take(pbuf,s->data,s->len);
-		e = udp_send(UPCB,pbuf);
-		pbuf_free(pbuf);
-	} else {
-		e = 0;
+		while (Ring->size()) {
+			size_t n = Ring->lines(INFLUX_UDP_MAX);
+			struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT,n,PBUF_RAM);
+			if (pbuf == 0) {
+				e = ERR_MEM;
+				break;
+			}
+			size_t off = 0;
+			while (off < n) {
+				const char *p;
+				size_t s = Ring->segment(off,n-off,&p);
+				pbuf_take_at(pbuf,p,s,off);
+				off += s;
+			}
+			e = udp_send(UPCB,pbuf);
+			pbuf_free(pbuf);
+			if (e)
+				break;
+			log_dbug(TAG,"datagram %u bytes",n);
+			Ring->bytes += n;
+			Ring->flushed += Ring->pop(n);
+		}
 	}
+#ifdef CONFIG_IDF_TARGET_ESP8266
+	LWIP_UNLOCK();
+#else
 	xSemaphoreGive(LwipSem);
+#endif
 	if (e) {
 		State = error;
 		log_warn(TAG,"send: %s",strlwiperr(e));
 	}
 }
-#endif
 
 
-int influx_send(const char *data, size_t l)
+// Mtx must be held
+static void influx_flush()
 {
-	Lock lock(Mtx,__FUNCTION__);
+	if ((State != running) || (Ring->size() == 0))
+		return;
 #ifdef CONFIG_IDF_TARGET_ESP8266
-	err_t e;
-	log_dbug(TAG,"send '%.*s'",l,data);
-	LWIP_LOCK();
-	if (TPCB) {
-		char len[16];
-		int n = sprintf(len,"%u\r\n\r\n",l);
-		e = tcp_write(TPCB,TcpHdr,THL,TCP_WRITE_FLAG_MORE);
-		if (e == 0)
-			e = tcp_write(TPCB,len,n,TCP_WRITE_FLAG_MORE|TCP_WRITE_FLAG_COPY);
-		if (e == 0)
-			e = tcp_write(TPCB,data,l,TCP_WRITE_FLAG_COPY);
-		if (e == 0)
-			tcp_output(TPCB);
-	} else if (UPCB) {
-		struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT,l,PBUF_RAM);
-		pbuf_take(pbuf,data,l);
-		e = udp_send(UPCB,pbuf);
-		pbuf_free(pbuf);
-	} else {
-		e = 0;
-	}
-	LWIP_UNLOCK();
-	if (e) {
-		State = error;
-		log_warn(TAG,"send: %s",strlwiperr(e));
-	}
+	flush_fn(0);
 #else
-	send_t a;
-	a.data = data;
-	a.len = l;
-	tcpip_send_msg_wait_sem(send_fn,&a,&LwipSem);
+	tcpip_send_msg_wait_sem(flush_fn,0,&LwipSem);
 #endif
+}
+
+
+// Queues one point. The batch is flushed when it exceeds
+// CONFIG_INFLUX_BATCH bytes or its oldest point CONFIG_INFLUX_MAXAGE
+// seconds.
+int influx_send(const char *data, size_t l)
+{
+	if (l == 0)
+		l = strlen(data);
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	Lock lock(Mtx,__FUNCTION__);
+	if ((Ring == 0) || !Ring->push(data,l,tv))
+		return 1;
+	if ((Ring->size() >= CONFIG_INFLUX_BATCH) || (Ring->age(uptime()) >= CONFIG_INFLUX_MAXAGE*1000))
+		influx_flush();
 	return 0;
 }
 
 
-static void add_element(EnvNumber *e, stream &str, char extra)
+static unsigned influx_cyclic(void *)
+{
+	if (Ring == 0)
+		return 1000;
+#ifdef CONFIG_INFLUX_SPILL
+	Ring->spill_io();
+#endif
+	if (Ring->size() == 0)
+		return 1000;
+	if (influx_send_check())
+		return 1000;
+	Lock lock(Mtx,__FUNCTION__);
+	if (Ring->age(uptime()) >= CONFIG_INFLUX_MAXAGE*1000)
+		influx_flush();
+	return 1000;
+}
+
+
+// Field plan of send_rtdata: pre-rendered keys and the numbers they
+// refer to. Rebuilt when elements are added to or removed from RTData.
+struct InfluxField
+{
+	EnvNumber *num;
+	uint16_t key, klen;	// "<object>_<name>=" in Keys
+};
+
+static vector<InfluxField> Fields;
+static estring Keys;
+static unsigned PlanGen = UINT_MAX;
+
+
+static void plan_field(EnvNumber *n, const char *obj)
 {
-	if (extra)
-		str << extra;
-	str << e->name();
-	str << '=';
-	e->writeValue(str);
+	InfluxField f;
+	f.num = n;
+	f.key = Keys.size();
+	if (obj) {
+		Keys += obj;
+		Keys += '_';
+	}
+	Keys += n->name();
+	Keys += '=';
+	f.klen = Keys.size() - f.key;
+	Fields.push_back(f);
 }
 
 
-static char send_elements(EnvObject *o, stream &str, char comma)
+// must be called with rtd_lock held
+static void plan_build()
 {
-	const char *name = o->name();
-	for (EnvElement *e : o->getChilds()) {
-		EnvNumber *n = e->toNumber();
-		if (n && n->isValid()) {
-			str << comma;
-			str << name;
-			add_element(n,str,'_');
-			comma = ',';
+	Fields.clear();
+	Keys.clear();
+	for (EnvElement *e : RTData->getChilds()) {
+		if (EnvObject *o = e->toObject()) {
+			for (EnvElement *c : o->getChilds()) {
+				if (EnvNumber *n = c->toNumber())
+					plan_field(n,o->name());
+			}
+		} else if (EnvNumber *n = e->toNumber()) {
+			plan_field(n,0);
 		}
 	}
-	return comma;
+	PlanGen = EnvObject::generation();
+	log_dbug(TAG,"field plan: %u fields, %u bytes",Fields.size(),Keys.size());
 }
 
 
@@ -449,22 +869,32 @@ static void send_rtdata(void *)
 	astream str;
 	{
 		Lock lock(Mtx,__FUNCTION__);
-		str << Header;
+		str.write(Header,HL);
 	}
 	rtd_lock();
-	char comma = ' ';
-	for (EnvElement *e : RTData->getChilds()) {
-		if (EnvObject *o = e->toObject()) {
-			comma = send_elements(o,str,comma);
-		} else if (EnvNumber *n = e->toNumber()) {
-			if (n->isValid()) {
-				add_element(n,str,comma);
-				comma = ',';
-			}
-		}
+	if (PlanGen != EnvObject::generation())
+		plan_build();
+	char sep = ' ';
+	const char *keys = Keys.data();
+	for (const InfluxField &f : Fields) {
+		EnvNumber *n = f.num;
+		if (!n->isValid())
+			continue;
+		str << sep;
+		str.write(keys+f.key,f.klen);
+		char buf[32];
+		char *e = 0;
+		int p = n->getPrecision();
+		if (p >= 0)
+			e = fixed_to_str(buf,n->get(),p);
+		if (e)
+			str.write(buf,e-buf);
+		else
+			n->writeValue(str);
+		sep = ',';
 	}
 	rtd_unlock();
-	if (comma != ' ') {
+	if (sep != ' ') {
 		str << '\n';
 		influx_send(str.buffer(),str.size());
 	}
@@ -541,8 +971,13 @@ void influx_setup()
 	if (LwipSem == 0)
 		LwipSem = xSemaphoreCreateBinary();
 #endif
-	action_add("influx!sysinfo",send_sys_info,0,"send system info");
-	action_add("influx!rtdata",send_rtdata,0,"send runtime data");
+	if (Ring == 0)
+		Ring = new InfluxRing(CONFIG_INFLUX_BUFFER);
+	cyclic_add_task("influx",influx_cyclic);
+	if (Action *a = action_add("influx!sysinfo",send_sys_info,0,"send system info"))
+		a->concurrent = true;
+	if (Action *a = action_add("influx!rtdata",send_rtdata,0,"send runtime data"))
+		a->concurrent = true;
 	action_add("influx!init",influx_init,0,"init influx connection");
 	action_add("influx!term",influx_term,0,"term influx connection");
 	log_info(TAG,"setup");
@@ -578,12 +1013,22 @@ const char *influx(Terminal &t, int argc, const char *args[])
 				mode = States[State];
 			}
 			t.println(mode);
+			if (Ring) {
+				Lock lock(Mtx,__FUNCTION__);
+				t.printf("points     : %u queued, %u flushed, %u dropped, %u buffered bytes\n"
+					,Ring->queued,Ring->flushed,Ring->dropped,Ring->size());
+				t.printf("wire       : %llu bytes\n",Ring->bytes);
+#ifdef CONFIG_INFLUX_SPILL
+				t.printf("spilled    : %u points in " INFLUX_SPILLFILE "\n",Ring->spilled);
+#endif
+			}
 		} else {
 			return "Not configured.";
 		}
 	} else if (argc == 2) {
 		if (!strcmp("init",args[1])) {
-			action_dispatch("influx!init",0);
+			static action_t InitAction = action_handle("influx!init");
+			action_dispatch_h(InitAction,0);
 		} else if (0 == strcmp(args[1],"clear")) {
 			Config.clear_influx();
 		} else if (0 == strcmp(args[1],"stop")) {
@@ -593,6 +1038,11 @@ const char *influx(Terminal &t, int argc, const char *args[])
 				State = offline;
 		} else if (0 == strcmp(args[1],"term")) {
 			State = term;
+		} else if (0 == strcmp(args[1],"flush")) {
+			if (Ring) {
+				Lock lock(Mtx,__FUNCTION__);
+				influx_flush();
+			}
 		} else {
 			return "Invalid argument #1.";
 		}
@@ -154,18 +154,42 @@ static int f_event_trigger(lua_State *L)
 }
 
 
-static int f_action_activate(lua_State *L)
+static int f_action_handle(lua_State *L)
 {
 	const char *an = luaL_checkstring(L,1);
-	const char *arg = 0;
-	Action *a = action_get(an);
-	if (a == 0) {
+	action_t h = action_handle(an);
+	if (h == 0) {
 		lua_pushfstring(L,"unknwon action '%s'",an);
 		lua_error(L);
 	}
-	if (lua_type(L,2) == LUA_TSTRING) {
-		arg = strdup(lua_tostring(L,2));
+	lua_pushinteger(L,h);
+	return 1;
+}
+
+
+static int f_action_activate(lua_State *L)
+{
+	Action *a;
+	if (lua_type(L,1) == LUA_TNUMBER) {
+		lua_Integer h = lua_tointeger(L,1);
+		// action_t is narrower than lua_Integer
+		a = ((h > 0) && (h == (action_t)h)) ? action_from_handle(h) : 0;
+		if (a == 0) {
+			lua_pushliteral(L,"invalid action handle");
+			lua_error(L);
+		}
+	} else {
+		const char *an = luaL_checkstring(L,1);
+		a = action_get(an);
+		if (a == 0) {
+			lua_pushfstring(L,"unknwon action '%s'",an);
+			lua_error(L);
+		}
 	}
+	// the string stays valid while the action executes synchronously
+	const char *arg = 0;
+	if (lua_type(L,2) == LUA_TSTRING)
+		arg = lua_tostring(L,2);
 	a->activate((void*)arg);
 	return 0;
 }
@@ -472,7 +496,8 @@ static const LuaFn CoreFunctions[] = {
 	{ "print", f_print, "print to terminal/console" },
 	// math.random yields a float....
 	{ "random", f_random, "create a 32-bit integer random number" },
-	{ "action_activate", f_action_activate, "activate an action (action[,arg])" },
+	{ "action_activate", f_action_activate, "activate an action (action or handle[,arg])" },
+	{ "action_handle", f_action_handle, "get handle of an action (action)" },
 	{ "event_attach", f_event_attach, "attach an action to an event (event,action[,arg])" },
 	{ "event_trigger", f_event_trigger, "trigger an event (event[,arg])" },
 	{ "event_create", f_event_create, "create an event (event) = <int>" },
@@ -851,7 +876,8 @@ void xlua_setup()
 		return;
 	if (0 == Mtx)
 		Mtx = xSemaphoreCreateMutex();
-	action_add("lua!run",xlua_script,0,"run argument as Lua script");
+	if (Action *a = action_add("lua!run",xlua_script,0,"run argument as Lua script"))
+		a->concurrent = true;	// serialized by Mtx
 	for (const auto &fn : Config.luafiles()) {
 		const char *f = fn.c_str();
 		if (f[0] == '/') {
@@ -42,6 +42,20 @@ const char *inetadm(Terminal &term, int argc, const char *args[])
 			}
 			return 0;
 		}
+		if (!strcmp(args[1],"-s")) {
+			while (l) {
+				if (l->isPool()) {
+					unsigned a = l->numAccepted(), r = l->numRequests();
+					unsigned rpc10 = a ? r * 10 / a : 0;
+					term.printf("%s: %u workers, %u busy, %u queued, %u parked, %u%% utilisation\n"
+						,l->getName(),l->numWorkers(),l->numBusy(),l->numQueued(),l->numParked(),l->utilisation());
+					term.printf("%s: %u connections, %u requests, %u.%u per connection, %u resumed, %u rejected\n"
+						,l->getName(),a,r,rpc10/10,rpc10%10,l->numResumed(),l->numRejected());
+				}
+				l = l->getNext();
+			}
+			return 0;
+		}
 		return "Invalid argument #1.";;
 	}
 	if (argc != 3)
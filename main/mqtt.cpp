@@ -20,7 +20,7 @@
 
 
 // LIMITATIONS / DESIGN OPTIMIZATIONS:
-// - Only packets with "remaining length" < 128 are handled.
+// - Only received packets with "remaining length" < 16384 are handled.
 //   Other packets are rejected.
 // - QoS > 0: retries are missing
 // - no TLS
@@ -29,6 +29,7 @@
 #ifndef CONFIG_ESPTOOLPY_FLASHSIZE_1MB
 #define FEATURE_QOS
 #define FEATURE_KEEPALIVE
+#define FEATURE_ONCHANGE
 #endif
 
 #ifdef CONFIG_MQTT
@@ -40,6 +41,7 @@
 #include "mqtt.h"
 #include "mstream.h"
 #include "netsvc.h"
+#include "nvm.h"
 #include "settings.h"
 #include "support.h"
 #include "strstream.h"
@@ -58,8 +60,12 @@
 #include <lwip/priv/tcpip_priv.h>
 #include <lwip/tcp.h>
 
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <map>
 
@@ -85,6 +91,10 @@ extern "C" {
 using namespace std;
 
 static int mqtt_pub_int(const char *t, const char *v, int len, int retain, int qos, bool needlock, bool withHost = true);
+#ifdef FEATURE_QOS
+static void qos_send(bool more);
+static void qos_kick();
+#endif
 
 #if 0
 #define log_devel log_dbug
@@ -94,6 +104,9 @@ static int mqtt_pub_int(const char *t, const char *v, int len, int retain, int q
 
 
 #define TAG MODULE_MQTT
+
+// maximum remaining length of a SUBSCRIBE with several filters
+#define MQTT_SUB_BATCH	512
 static struct MqttClient *Client = 0;
 static void mqtt_pub_rtdata(void *);
 #if LWIP_TCPIP_CORE_LOCKING == 0
@@ -102,58 +115,829 @@ static sys_sem_t LwipSem = 0;
 
 
 #ifdef FEATURE_QOS
-struct PubReq
+#define QOS_RETAIN	0x01
+#define QOS_HOST	0x02	// topic needs hostname prefix
+#define QOS_SENT	0x04	// sent before, retransmit with DUP
+#define QOS_ACKED	0x08
+
+#ifdef CONFIG_MQTT_QOS_SPILL
+#define QOS_SPILLFILE	"/flash/mqtt.qos"
+#define QOS_STAGE	1024	// size of the RAM stages of the spill file
+#endif
+
+// header of a QoS1 message in the ring, topic and value follow
+struct QosMsg
+{
+	uint16_t size;		// including header and padding, 0 for wrap-around
+	uint16_t pid;		// packet id of last transmission
+	uint16_t tlen, vlen;
+	uint8_t flags;
+
+	const char *topic() const
+	{ return (const char *)(this+1); }
+
+	const char *value() const
+	{ return topic() + tlen; }
+};
+
+
+#ifdef CONFIG_MQTT_QOS_SPILL
+// transfer between the RAM stages and the spill file
+struct SpillIO
+{
+	class QosQueue *queue;
+	unsigned in, inum;	// bytes and messages read from the file
+	unsigned out, onum;	// bytes and messages to write to the file
+	unsigned lost;		// messages lost on file errors
+	unsigned room;		// free bytes in the input stage
+};
+#endif
+
+
+// Preallocated ring of QoS1 messages in publishing order. Messages from
+// head to next have been sent, messages from next to tail wait for
+// transmission. Only accessed in LwIP context, except spill_io.
+//
+// Spilling: when the ring is full, messages are appended to the output
+// stage sout. The mqtt cyclic task writes sout to the spill file and
+// reads the file back to the input stage sin, so no flash I/O happens
+// in LwIP context. The order is: ring, sin, file, sout.
+class QosQueue
+{
+	public:
+	explicit QosQueue(size_t s);
+
+	bool push(const char *t, size_t tl, const char *v, size_t vl, uint8_t flags);
+	QosMsg *unsent();
+	void sent(QosMsg *);
+	bool ack(uint16_t pid);
+	void rewind();
+
+	unsigned queued = 0, inflight = 0, retrans = 0, dropped = 0;
+#ifdef CONFIG_MQTT_QOS_SPILL
+	void stage(SpillIO &);
+	void spill_io();
+
+	unsigned spilled = 0;	// messages in the stages and the file
+#endif
+
+	private:
+	unsigned norm(unsigned off) const;
+	QosMsg *alloc(size_t s);
+	void pop();
+#ifdef CONFIG_MQTT_QOS_SPILL
+	unsigned unstage(uint8_t *st, unsigned len);
+	void unstage();
+	unsigned spill_read(unsigned room, unsigned &num);
+
+	uint8_t *sout = 0, *sin = 0, *sio = 0;
+	unsigned soutl = 0, soutn = 0, sinl = 0;
+	unsigned nfile = 0;	// messages in the file or being written
+	FILE *spillf = 0;
+	long rdoff = 0, wroff = 0;
+#endif
+
+	uint8_t *buf;
+	unsigned cap, head = 0, next = 0, tail = 0, nsent = 0;
+};
+
+
+QosQueue::QosQueue(size_t s)
+: buf((uint8_t *) malloc(s))
+, cap(buf ? s : 0)
+{
+#ifdef CONFIG_MQTT_QOS_SPILL
+	unlink(QOS_SPILLFILE);
+#endif
+}
+
+
+unsigned QosQueue::norm(unsigned off) const
+{
+	if ((cap - off < sizeof(QosMsg)) || (((QosMsg *)(buf+off))->size == 0))
+		return 0;
+	return off;
+}
+
+
+QosMsg *QosQueue::alloc(size_t s)
+{
+	unsigned off;
+	if (queued == 0) {
+		if (s > cap)
+			return 0;
+		head = 0;
+		next = 0;
+		off = 0;
+	} else if (tail > head) {
+		if (cap - tail >= s) {
+			off = tail;
+		} else if (head >= s) {
+			if (cap - tail >= sizeof(QosMsg))
+				((QosMsg *)(buf+tail))->size = 0;
+			off = 0;
+		} else {
+			return 0;
+		}
+	} else if (head - tail >= s) {
+		off = tail;
+	} else {
+		return 0;
+	}
+	tail = off + s;
+	++queued;
+	return (QosMsg *)(buf+off);
+}
+
+
+void QosQueue::pop()
 {
-	PubReq(const char *t, const char *v, unsigned l)
-	: topic(strdup(t))
-	, len(l)
+	head = norm(head);
+	head += ((QosMsg *)(buf+head))->size;
+	--queued;
+	--nsent;
+}
+
+
+bool QosQueue::push(const char *t, size_t tl, const char *v, size_t vl, uint8_t flags)
+{
+	size_t s = (sizeof(QosMsg) + tl + vl + 3) & ~3;
+	if (s <= UINT16_MAX) {
+		QosMsg h;
+		h.size = s;
+		h.pid = 0;
+		h.tlen = tl;
+		h.vlen = vl;
+		h.flags = flags;
+		QosMsg *m = 0;
+#ifdef CONFIG_MQTT_QOS_SPILL
+		// keep order: once spilling, everything goes to the stage
+		if (spilled == 0)
+#endif
+			m = alloc(s);
+		if (m) {
+			*m = h;
+			memcpy((char *)m->topic(),t,tl);
+			memcpy((char *)m->value(),v,vl);
+			return true;
+		}
+#ifdef CONFIG_MQTT_QOS_SPILL
+		size_t rl = sizeof(h) + tl + vl;
+		if ((sout == 0) && (s <= cap)) {
+			// allocated on first use, never released
+			if (uint8_t *b = (uint8_t *) malloc(3*QOS_STAGE)) {
+				sout = b;
+				sin = b + QOS_STAGE;
+				sio = b + 2*QOS_STAGE;
+			}
+		}
+		if (sout && (s <= cap) && (soutl + rl <= QOS_STAGE)) {
+			memcpy(sout+soutl,&h,sizeof(h));
+			memcpy(sout+soutl+sizeof(h),t,tl);
+			memcpy(sout+soutl+sizeof(h)+tl,v,vl);
+			soutl += rl;
+			++soutn;
+			++spilled;
+			return true;
+		}
+#endif
+	}
+	++dropped;
+	return false;
+}
+
+
+QosMsg *QosQueue::unsent()
+{
+	while (queued > nsent) {
+		next = norm(next);
+		QosMsg *m = (QosMsg *)(buf+next);
+		if (0 == (m->flags & QOS_ACKED))
+			return m;
+		// acknowledged before reconnect
+		next += m->size;
+		++nsent;
+	}
+	return 0;
+}
+
+
+void QosQueue::sent(QosMsg *m)
+{
+	assert((uint8_t *)m == buf + next);
+	m->flags |= QOS_SENT;
+	next += m->size;
+	++nsent;
+	++inflight;
+}
+
+
+bool QosQueue::ack(uint16_t pid)
+{
+	bool r = false;
+	unsigned off = head;
+	for (unsigned i = 0; i < nsent; ++i) {
+		off = norm(off);
+		QosMsg *m = (QosMsg *)(buf+off);
+		if ((m->pid == pid) && (0 == (m->flags & QOS_ACKED))) {
+			m->flags |= QOS_ACKED;
+			--inflight;
+			r = true;
+			break;
+		}
+		off += m->size;
+	}
+	while (nsent && (((QosMsg *)(buf+norm(head)))->flags & QOS_ACKED))
+		pop();
+#ifdef CONFIG_MQTT_QOS_SPILL
+	unstage();
+#endif
+	return r;
+}
+
+
+// connection was lost: everything not acknowledged must be sent again
+void QosQueue::rewind()
+{
+	next = head;
+	nsent = 0;
+	inflight = 0;
+}
+
+
+#ifdef CONFIG_MQTT_QOS_SPILL
+// moves messages of stage st to the ring, returns the bytes consumed
+unsigned QosQueue::unstage(uint8_t *st, unsigned len)
+{
+	unsigned off = 0;
+	while (off < len) {
+		QosMsg h;
+		memcpy(&h,st+off,sizeof(h));
+		QosMsg *m = alloc(h.size);
+		if (m == 0)
+			break;
+		*m = h;
+		memcpy((char *)m->topic(),st+off+sizeof(h),h.tlen+h.vlen);
+		off += sizeof(h) + h.tlen + h.vlen;
+		--spilled;
+	}
+	return off;
+}
+
+
+// refills the ring from the stages, keeping the order
+void QosQueue::unstage()
+{
+	if (spilled == 0)
+		return;
+	if (unsigned n = unstage(sin,sinl)) {
+		sinl -= n;
+		memmove(sin,sin+n,sinl);
+	}
+	if ((sinl == 0) && (nfile == 0) && soutl) {
+		unsigned n = unstage(sout,soutl);
+		uint8_t *at = sout;
+		while (at != sout+n) {
+			QosMsg h;
+			memcpy(&h,at,sizeof(h));
+			at += sizeof(h) + h.tlen + h.vlen;
+			--soutn;
+		}
+		soutl -= n;
+		memmove(sout,sout+n,soutl);
+	}
+}
+
+
+// LwIP context: takes the messages read from the file, refills the
+// ring, and hands the output stage over to spill_io for writing
+void QosQueue::stage(SpillIO &a)
+{
+	if (a.in) {
+		memcpy(sin+sinl,sio,a.in);
+		sinl += a.in;
+		nfile -= a.inum;
+	}
+	if (a.lost) {
+		nfile -= a.lost;
+		spilled -= a.lost;
+		dropped += a.lost;
+	}
+	unstage();
+	a.out = soutl;
+	a.onum = soutn;
+	if (soutl) {
+		memcpy(sio,sout,soutl);
+		nfile += soutn;
+		soutl = 0;
+		soutn = 0;
+	}
+	a.room = QOS_STAGE - sinl;
+}
+
+
+// reads complete messages of up to room bytes from the file to sio
+unsigned QosQueue::spill_read(unsigned room, unsigned &num)
+{
+	unsigned len = 0;
+	num = 0;
+	while (num < nfile) {
+		QosMsg h;
+		if ((0 != fseek(spillf,rdoff,SEEK_SET)) || (1 != fread(&h,sizeof(h),1,spillf)))
+			return len;
+		unsigned rl = sizeof(h) + h.tlen + h.vlen;
+		if (len + rl > room)
+			break;
+		memcpy(sio+len,&h,sizeof(h));
+		if ((h.tlen + h.vlen) && (1 != fread(sio+len+sizeof(h),h.tlen+h.vlen,1,spillf)))
+			return len;
+		rdoff += rl;
+		len += rl;
+		++num;
+	}
+	return len;
+}
+
+
+#if LWIP_TCPIP_CORE_LOCKING == 0
+static void qos_stage_fn(void *arg)
+{
+	SpillIO *a = (SpillIO *) arg;
+	a->queue->stage(*a);
+	xSemaphoreGive(LwipSem);
+}
+#endif
+
+
+// mqtt cyclic task: performs the flash I/O of the spill file
+void QosQueue::spill_io()
+{
+	if ((spilled == 0) && (spillf == 0))
+		return;
+	SpillIO a;
+	memset(&a,0,sizeof(a));
+	a.queue = this;
+	for (;;) {
+#if LWIP_TCPIP_CORE_LOCKING == 1
+		LWIP_LOCK();
+		stage(a);
+		LWIP_UNLOCK();
+#else
+		tcpip_send_msg_wait_sem(qos_stage_fn,&a,&LwipSem);
+#endif
+		a.in = 0;
+		a.inum = 0;
+		a.lost = 0;
+		if (a.out) {
+			if (spillf == 0) {
+				spillf = fopen(QOS_SPILLFILE,"w+");
+				rdoff = 0;
+				wroff = 0;
+				if (spillf == 0)
+					log_warn(TAG,"create %s: %s",QOS_SPILLFILE,strerror(errno));
+			}
+			if (spillf && (0 == fseek(spillf,wroff,SEEK_SET)) && (1 == fwrite(sio,a.out,1,spillf))) {
+				wroff += a.out;
+			} else {
+				if (spillf)
+					log_warn(TAG,"write %s: %s",QOS_SPILLFILE,strerror(errno));
+				a.lost = a.onum;
+			}
+		}
+		if (spillf && (nfile > a.lost) && a.room) {
+			a.in = spill_read(a.room,a.inum);
+			if ((a.in == 0) && (a.room == QOS_STAGE)) {
+				// no message fits into an empty stage
+				log_warn(TAG,"read %s: %s",QOS_SPILLFILE,strerror(errno));
+				a.lost = nfile;
+				fclose(spillf);
+				spillf = 0;
+				unlink(QOS_SPILLFILE);
+			}
+		}
+		if ((a.in == 0) && (a.lost == 0))
+			break;
+	}
+	if (spillf && (nfile == 0)) {
+		// all spilled messages are back in RAM
+		fclose(spillf);
+		spillf = 0;
+		unlink(QOS_SPILLFILE);
+	}
+}
+#endif	// CONFIG_MQTT_QOS_SPILL
+#endif	// FEATURE_QOS
+
+
+// Outgoing MQTT packet: fixed header, variable header and topic are
+// assembled in a small header buffer, the payload is passed to LwIP
+// separately, so it is copied only once.
+class MqttFrame
+{
+	public:
+	MqttFrame(uint8_t type, size_t vl, size_t pl = 0);
+
+	~MqttFrame()
 	{
-		value = (char *) malloc(l);
-		memcpy(value,v,l);
+		if (buf != hdr)
+			free(buf);
 	}
 
-	PubReq(const PubReq &p)
-	: topic(strdup(p.topic))
-	, len(p.len)
+	void put8(uint8_t v)
+	{ *at++ = v; }
+
+	void put16(uint16_t v)
 	{
-		value = (char *) malloc(len);
-		memcpy(value,p.value,len);
+		*at++ = v >> 8;
+		*at++ = v & 0xff;
 	}
 
-	PubReq(PubReq &&p)
-	: topic(p.topic)
-	, value(p.value)
-	, len(p.len)
+	void put(const void *d, size_t l)
 	{
-		p.topic = 0;
-		p.value = 0;
+		memcpy(at,d,l);
+		at += l;
 	}
 
-	~PubReq()
+	void putstr(const char *s, size_t l)
 	{
-		if (topic)
-			free(topic);
-		if (value)
-			free(value);
+		put16(l);
+		put(s,l);
 	}
 
+	void payload(const void *d, size_t l)
+	{
+		assert(l == plen);
+		pay = d;
+	}
+
+	bool valid() const
+	{ return buf != 0; }
+
+	size_t size() const
+	{ return (at - buf) + plen; }
+
+	size_t copy(uint8_t *) const;
 
-	char *topic;
-	char *value = 0;
-	unsigned len;
+	err_t write(struct tcp_pcb *pcb, bool more, const char *name);
 
 	private:
-	PubReq &operator = (const PubReq &);
+	uint8_t hdr[64], *buf, *at, *end = 0;
+	const void *pay = 0;
+	size_t plen;
+
+	MqttFrame(const MqttFrame &);
+	MqttFrame &operator = (const MqttFrame &);
 };
-#endif
 
 
+MqttFrame::MqttFrame(uint8_t type, size_t vl, size_t pl)
+: plen(pl)
+{
+	size_t rl = vl + pl;
+	if (rl > 0xfffffff) {
+		// exceeds the 4 byte remaining length
+		buf = 0;
+		return;
+	}
+	size_t hl = vl + 5;
+	if (hl <= sizeof(hdr))
+		buf = hdr;
+	else if (0 == (buf = (uint8_t *) malloc(hl)))
+		return;
+	at = buf;
+	*at++ = type;
+	do {
+		uint8_t b = rl & 0x7f;
+		rl >>= 7;
+		if (rl)
+			b |= 0x80;
+		*at++ = b;
+	} while (rl);
+	end = at + vl;
+}
+
+
+size_t MqttFrame::copy(uint8_t *d) const
+{
+	assert(at == end);
+	size_t hl = at - buf;
+	memcpy(d,buf,hl);
+	memcpy(d+hl,pay,plen);
+	return hl + plen;
+}
+
+
+// executed in LwIP context
+err_t MqttFrame::write(struct tcp_pcb *pcb, bool more, const char *name)
+{
+	if (pcb == 0)
+		return ERR_CONN;
+	if (buf == 0)
+		return ERR_MEM;
+	assert(at == end);
+	size_t hl = at - buf;
+	// a partially queued frame would corrupt the stream,
+	// so make sure everything fits before writing anything
+	if ((tcp_sndbuf(pcb) < hl + plen) || (tcp_sndqueuelen(pcb) + 2 + plen / pcb->mss > TCP_SND_QUEUELEN)) {
+		log_warn(TAG,"%s: no buffer for %u bytes",name,hl+plen);
+		return ERR_MEM;
+	}
+	uint8_t mf = more ? TCP_WRITE_FLAG_MORE : 0;
+	err_t e = tcp_write(pcb,buf,hl,TCP_WRITE_FLAG_COPY | (plen ? TCP_WRITE_FLAG_MORE : mf));
+	const char *p = (const char *) pay;
+	size_t l = plen;
+	while ((e == 0) && (l > 0)) {
+		uint16_t n = l > 0x8000 ? 0x8000 : l;
+		l -= n;
+		e = tcp_write(pcb,p,n,TCP_WRITE_FLAG_COPY | (l ? TCP_WRITE_FLAG_MORE : mf));
+		p += n;
+	}
+	if (e) {
+		log_warn(TAG,"%s write %d",name,e);
+	} else if (!more) {
+		e = tcp_output(pcb);
+		if (e)
+			log_warn(TAG,"%s output %d",name,e);
+	}
+	return e;
+}
+
+
+typedef void (*subcb_t)(const char *,const void *,size_t);
+
 struct Subscription
 {
-	void (*callback)(const char *,const void*,size_t);
-	uint16_t lastid = 0;
+	subcb_t callback;
+	Subscription *next;
+};
+
+
+// Node of the topic trie. A node represents one level of a topic
+// filter. Nodes, subscriptions and level strings are taken from arenas
+// and are never freed. New nodes are initialized completely before they
+// are linked, so the trie can be matched in LwIP context while
+// subscribe() extends it.
+struct TopicNode
+{
+	const char *level;		// interned, compared by pointer
+	TopicNode *child, *sibling;
+	Subscription *subs;
+	const char *filter;		// set if a filter ends at this node
+	TopicNode *nextf;		// next filter in subscription order
+	EnvString *value;
+	uint16_t len;
+	bool track;			// update value on publish
+
+	bool is(char c) const
+	{ return (len == 1) && (level[0] == c); }
+};
+
+
+// bump allocator for objects that live until reboot
+template <typename T, unsigned N>
+class Arena
+{
+	public:
+	T *alloc()
+	{
+		if ((chunks == 0) || (chunks->num == N)) {
+			Chunk *c = (Chunk *) malloc(sizeof(Chunk));
+			if (c == 0)
+				return 0;
+			c->next = chunks;
+			c->num = 0;
+			chunks = c;
+		}
+		T *r = chunks->elements + chunks->num++;
+		memset(r,0,sizeof(T));
+		return r;
+	}
+
+	private:
+	struct Chunk
+	{
+		Chunk *next;
+		unsigned num;
+		T elements[N];
+	};
+	Chunk *chunks = 0;
+};
+
+
+// Subscribed topic filters with MQTT wildcards '+' and '#'. Matching
+// walks the trie level by level, so its cost depends on the depth of the
+// topic and not on the number of subscriptions.
+class TopicTrie
+{
+	public:
+	TopicTrie();
+
+	TopicNode *add(const char *filter, subcb_t cb);
+	TopicNode *find(const char *filter) const;
+	unsigned match(const char *t, size_t tl, void (*fn)(const TopicNode *, void *), void *arg) const;
+
+	const TopicNode *filters() const
+	{ return first; }
+
+	private:
+	struct StrChunk
+	{
+		StrChunk *next;
+		uint16_t fill, size;
+		char data[];
+	};
+
+	const char *intern(const char *s, size_t l);
+	unsigned match(const TopicNode *n, const char *l, const char *e, bool top, void (*fn)(const TopicNode *, void *), void *arg) const;
+
+	TopicNode root;
+	TopicNode *first = 0, *last = 0;
+	StrChunk *strs = 0;
+	Arena<TopicNode,8> nodes;
+	Arena<Subscription,8> subs;
+};
+
+
+TopicTrie::TopicTrie()
+{
+	bzero(&root,sizeof(root));
+	root.level = "";
+}
+
+
+const char *TopicTrie::intern(const char *s, size_t l)
+{
+	for (StrChunk *c = strs; c; c = c->next) {
+		const char *p = c->data, *e = c->data + c->fill;
+		while (p < e) {
+			size_t pl = strlen(p);
+			if ((pl == l) && (0 == memcmp(p,s,l)))
+				return p;
+			p += pl + 1;
+		}
+	}
+	if ((strs == 0) || (strs->fill + l + 1 > strs->size)) {
+		size_t s = l + 1 < 128 ? 128 : l + 1;
+		StrChunk *c = (StrChunk *) malloc(sizeof(StrChunk) + s);
+		if (c == 0)
+			return 0;
+		c->next = strs;
+		c->fill = 0;
+		c->size = s;
+		strs = c;
+	}
+	char *r = strs->data + strs->fill;
+	memcpy(r,s,l);
+	r[l] = 0;
+	strs->fill += l + 1;
+	return r;
+}
+
+
+TopicNode *TopicTrie::find(const char *filter) const
+{
+	const TopicNode *n = &root;
+	const char *l = filter;
+	for (;;) {
+		const char *s = strchr(l,'/');
+		size_t ll = s ? s - l : strlen(l);
+		const TopicNode *c = n->child;
+		while (c && ((c->len != ll) || memcmp(c->level,l,ll)))
+			c = c->sibling;
+		if (c == 0)
+			return 0;
+		n = c;
+		if (s == 0)
+			break;
+		l = s + 1;
+	}
+	return n->filter ? (TopicNode *) n : 0;
+}
+
+
+TopicNode *TopicTrie::add(const char *filter, subcb_t cb)
+{
+	size_t fl = strlen(filter);
+	if ((fl == 0) || (fl > UINT16_MAX))
+		return 0;
+	for (size_t i = 0; i < fl; ++i) {
+		// wildcards must occupy a whole level, '#' only the last one
+		char c = filter[i];
+		if (((c == '+') || (c == '#'))
+			&& (((i != 0) && (filter[i-1] != '/'))
+			|| ((c == '#') && (i + 1 != fl))
+			|| ((c == '+') && (filter[i+1] != 0) && (filter[i+1] != '/')))) {
+			log_warn(TAG,"invalid filter %s",filter);
+			return 0;
+		}
+	}
+	TopicNode *n = &root;
+	const char *l = filter;
+	for (;;) {
+		const char *s = strchr(l,'/');
+		size_t ll = s ? s - l : strlen(l);
+		const char *lv = intern(l,ll);
+		if (lv == 0)
+			return 0;
+		TopicNode *c = n->child;
+		while (c && (c->level != lv))
+			c = c->sibling;
+		if (c == 0) {
+			c = nodes.alloc();
+			if (c == 0)
+				return 0;
+			c->level = lv;
+			c->len = ll;
+			c->sibling = n->child;
+			n->child = c;
+		}
+		n = c;
+		if (s == 0)
+			break;
+		l = s + 1;
+	}
+	Subscription *x = subs.alloc();
+	if (x == 0)
+		return 0;
+	x->callback = cb;
+	if (Subscription *p = n->subs) {
+		while (p->next)
+			p = p->next;
+		p->next = x;
+	} else {
+		n->subs = x;
+	}
+	if (n->filter == 0) {
+		n->filter = intern(filter,fl);
+		if (n->filter == 0)
+			return 0;
+		if (last)
+			last->nextf = n;
+		else
+			first = n;
+		last = n;
+	}
+	return n;
+}
+
+
+unsigned TopicTrie::match(const char *t, size_t tl, void (*fn)(const TopicNode *, void *), void *arg) const
+{
+	return match(&root,t,t+tl,true,fn,arg);
+}
+
+
+unsigned TopicTrie::match(const TopicNode *n, const char *l, const char *e, bool top, void (*fn)(const TopicNode *, void *), void *arg) const
+{
+	const char *s = (const char *) memchr(l,'/',e-l);
+	size_t ll = s ? s - l : e - l;
+	// wildcards do not match topics starting with '$'
+	bool wc = !top || (ll == 0) || (l[0] != '$');
+	unsigned r = 0;
+	for (const TopicNode *c = n->child; c; c = c->sibling) {
+		if (c->is('#')) {
+			if (wc && c->filter) {
+				fn(c,arg);
+				++r;
+			}
+		} else if ((wc && c->is('+')) || ((c->len == ll) && (0 == memcmp(c->level,l,ll)))) {
+			if (s) {
+				r += match(c,s+1,e,false,fn,arg);
+				continue;
+			}
+			if (c->filter) {
+				fn(c,arg);
+				++r;
+			}
+			// parent level of "a/#" matches, too
+			for (const TopicNode *g = c->child; g; g = g->sibling) {
+				if (g->is('#') && g->filter) {
+					fn(g,arg);
+					++r;
+				}
+			}
+		}
+	}
+	return r;
+}
+
+
+#ifdef FEATURE_ONCHANGE
+// last published state of an RTData element
+struct PubState
+{
+	uint32_t ts;
+	float value;
+	uint16_t ver;
 };
 
+// change-driven publishing settings, kept in NVS
+#define NVM_REPUBLISH	"mqtt.republish"
+#define NVM_DEADBAND	"mqtt.deadband"
+static uint16_t Republish = 0;	// [s], 0: publish all values on every cycle
+static float Deadband = 0;
+#endif
+
 
 typedef enum { offline = 0, connecting, running, stopped } state_t;
 
@@ -169,17 +953,19 @@ struct MqttClient
 {
 	MqttClient();
 
-	int subscribe(const char *t, void (*callback)(const char *,const void *,size_t));
+	int subscribe(const char *t, subcb_t callback, bool track = false);
 
 	struct tcp_pcb *pcb;
 	unsigned ltime = 0;
 	ip_addr_t ip;
 	EnvObject *signals;
-	multimap<estring,Subscription> subscriptions;
-	map<estring,EnvString *> values;
-	map<uint16_t,const char *> subs;
+	TopicTrie topics;
+	map<uint16_t,const TopicNode *> subs;
+#ifdef FEATURE_ONCHANGE
+	map<EnvElement *,PubState> published;
+#endif
 #ifdef FEATURE_QOS
-	map<uint16_t,PubReq> pubs;
+	QosQueue qos;
 #endif
 	uint16_t packetid = 0;
 #ifdef FEATURE_KEEPALIVE
@@ -289,6 +1075,9 @@ static const LuaFn Functions[] = {
 
 MqttClient::MqttClient()
 : pcb(0)
+#ifdef FEATURE_QOS
+, qos(CONFIG_MQTT_QOS_BUFFER)
+#endif
 , mtx(xSemaphoreCreateRecursiveMutex())
 , sem(xSemaphoreCreateBinary())
 , state(offline)
@@ -370,6 +1159,24 @@ static int mqtt_term()
 }
 
 
+struct PubMsg
+{
+	const char *topic;
+	const uint8_t *data;
+	size_t len;
+};
+
+
+static void dispatch_pub(const TopicNode *n, void *arg)
+{
+	PubMsg *m = (PubMsg *) arg;
+	if (n->track && n->value)
+		n->value->set((const char *)m->data,m->len);
+	for (const Subscription *s = n->subs; s; s = s->next)
+		s->callback(m->topic,m->data,m->len);
+}
+
+
 static int parse_publish(uint8_t *buf, unsigned rlen, uint8_t qos)
 {
 	unsigned tl = buf[0] << 8 | buf[1];
@@ -382,80 +1189,174 @@ static int parse_publish(uint8_t *buf, unsigned rlen, uint8_t qos)
 	char topic[tl+1];
 	memcpy(topic,buf+2,tl);
 	topic[tl] = 0;
-	auto x = Client->subscriptions.find(topic);
-	if (x != Client->subscriptions.end()) {
-		if (qos) {
-			// packet id for qos != 0
-			pl += 2;
-			ps -= 2;
-		}
-		log_hex(TAG,pl,ps,"pub topic %s",topic);
-		x->second.callback(topic,pl,ps);
-	} else {
-		log_warn(TAG,"not subscribed to %s",topic);
+	if (qos) {
+		// packet id for qos != 0
+		pl += 2;
+		ps -= 2;
 	}
+	log_hex(TAG,pl,ps,"pub topic %s",topic);
+	PubMsg m = { topic, pl, ps };
+	if (0 == Client->topics.match(topic,tl,dispatch_pub,&m))
+		log_warn(TAG,"not subscribed to %s",topic);
 	return 0;
 }
 
 
-static err_t send_sub(const char *t, bool commit, bool lock)
+#if LWIP_TCPIP_CORE_LOCKING == 0
+struct FrameArg
+{
+	MqttFrame *frame;
+	struct tcp_pcb *pcb;
+	const char *name;
+	bool more;
+	err_t err;
+};
+
+
+// executed in LwIP context
+static void mqtt_frame_fn(void *arg)
+{
+	FrameArg *a = (FrameArg *) arg;
+	a->err = a->frame->write(a->pcb,a->more,a->name);
+	xSemaphoreGive(LwipSem);
+}
+#endif
+
+
+static err_t mqtt_send(MqttFrame &f, bool more, bool lock, const char *name)
 {
-	size_t tl = strlen(t);
-	char request[tl+7];
-	char *b = request;
-	*b++ = SUBSCRIBE;
-	*b++ = sizeof(request) - 2;
-	uint16_t pkgid = ++Client->packetid;
-	*b++ = pkgid >> 8;
-	*b++ = pkgid & 0xff;
-	*b++ = 0;
-	*b++ = tl;
-	memcpy(b,t,tl);
-	b += tl;
-	*b++ = 0;	// qos = 0
-	assert(request+sizeof(request)==b);
-	log_dbug(TAG,"subscribe '%s', pkgid=%u",t,pkgid);
-	Client->subs.insert(make_pair(pkgid,t));
 #if LWIP_TCPIP_CORE_LOCKING == 1
 	if (lock)
 		LWIP_LOCK();
+	err_t e = f.write(Client->pcb,more,name);
+	if (lock)
+		LWIP_UNLOCK();
+#else
+	err_t e;
+	if (lock) {
+		FrameArg a;
+		a.frame = &f;
+		a.pcb = Client->pcb;
+		a.name = name;
+		a.more = more;
+		a.err = 0;
+		tcpip_send_msg_wait_sem(mqtt_frame_fn,&a,&LwipSem);
+		e = a.err;
+	} else {
+		e = f.write(Client->pcb,more,name);
+	}
+#endif
+	return e;
+}
+
+
+// write raw data of complete frames
+static err_t mqtt_write(const void *d, size_t l, bool more, const char *name)
+{
+#if LWIP_TCPIP_CORE_LOCKING == 1
+	LWIP_LOCK();
 	uint8_t flags = TCP_WRITE_FLAG_COPY;
-	if (!commit)
+	if (more)
 		flags |= TCP_WRITE_FLAG_MORE;
-	err_t e = tcp_write(Client->pcb,request,sizeof(request),flags);
+	err_t e = Client->pcb ? tcp_write(Client->pcb,d,l,flags) : ERR_CONN;
 	if (e) {
-		log_warn(TAG,"subscribe write %d",e);
-	} else if (commit) {
+		log_warn(TAG,"%s write %d",name,e);
+	} else if (!more) {
 		e = tcp_output(Client->pcb);
 		if (e)
-			log_warn(TAG,"subscribe output %d",e);
+			log_warn(TAG,"%s output %d",name,e);
 	}
-	if (lock)
-		LWIP_UNLOCK();
+	LWIP_UNLOCK();
 #else
-	err_t e = 0;
-	if (lock) {
-		tcpwrite_arg_t r;
-		r.pcb = Client->pcb;
-		r.data = request;
-		r.size = sizeof(request);
-		r.name = "subscribe";
-		r.sem = LwipSem;
-		tcpip_send_msg_wait_sem(commit ? tcpwriteout_fn : tcpwrite_fn,&r,&LwipSem);
-	} else {
-		uint8_t flags = TCP_WRITE_FLAG_COPY;
-		if (!commit)
-			flags |= TCP_WRITE_FLAG_MORE;
-		e = tcp_write(Client->pcb,request,sizeof(request),flags);
-		if (e) {
-			log_warn(TAG,"subscribe write %d",e);
-		} else if (commit) {
-			e = tcp_output(Client->pcb);
-			if (e)
-				log_warn(TAG,"subscribe output %d",e);
+	tcpwrite_arg_t r;
+	r.pcb = Client->pcb;
+	r.data = (const char *) d;
+	r.size = l;
+	r.name = name;
+	r.sem = LwipSem;
+	tcpip_send_msg_wait_sem(more ? tcpwrite_fn : tcpwriteout_fn,&r,&LwipSem);
+	err_t e = r.err;
+#endif
+	return e;
+}
+
+
+// Collects complete frames to pass them to LwIP with a single tcp_write.
+// This needs only one LwIP lock round-trip per segment instead of one
+// per message and yields MSS sized segments.
+class MqttBatch
+{
+	public:
+	explicit MqttBatch(size_t s)
+	: buf((uint8_t *) malloc(s))
+	, cap(buf ? s : 0)
+	{ }
+
+	~MqttBatch()
+	{ free(buf); }
+
+	err_t add(MqttFrame &f)
+	{
+		size_t s = f.size();
+		if (fill + s > cap)
+			flush(true);
+		if (s > cap)
+			check(mqtt_send(f,true,true,"batch"));
+		else
+			fill += f.copy(buf+fill);
+		return err;
+	}
+
+	// returns the first error of all writes
+	err_t flush(bool more)
+	{
+		if (fill) {
+			check(mqtt_write(buf,fill,more,"batch"));
+			fill = 0;
 		}
+		return err;
 	}
-#endif
+
+	private:
+	void check(err_t e)
+	{
+		if (err == 0)
+			err = e;
+	}
+
+	uint8_t *buf;
+	size_t cap, fill = 0;
+	err_t err = 0;
+
+	MqttBatch(const MqttBatch &);
+	MqttBatch &operator = (const MqttBatch &);
+};
+
+
+// Subscribes filter n and as many of its successors as fit into one
+// SUBSCRIBE packet. Returns the first filter that has not been sent.
+static const TopicNode *send_sub(const TopicNode *n, bool commit, bool lock)
+{
+	size_t vl = 2;
+	const TopicNode *e = n;
+	do {
+		vl += strlen(e->filter) + 3;
+		e = e->nextf;
+	} while (e && (vl + strlen(e->filter) + 3 <= MQTT_SUB_BATCH));
+	MqttFrame f(SUBSCRIBE,vl);
+	if (!f.valid())
+		return e;
+	uint16_t pkgid = ++Client->packetid;
+	if (pkgid == 0)
+		pkgid = ++Client->packetid;
+	f.put16(pkgid);
+	for (const TopicNode *x = n; x != e; x = x->nextf) {
+		f.putstr(x->filter,strlen(x->filter));
+		f.put8(0);	// qos = 0
+		log_dbug(TAG,"subscribe '%s', pkgid=%u",x->filter,pkgid);
+	}
+	Client->subs.insert(make_pair(pkgid,n));
+	mqtt_send(f,!commit || (e != 0),lock,"subscribe");
 	return e;
 }
 
@@ -467,8 +1368,16 @@ static void parse_conack(uint8_t *buf, size_t rlen)
 		if ((status == 0) && (Client->pcb != 0)) {
 			log_devel(TAG,"CONACK OK");
 			Client->state = running;
-			for (const auto &s : Client->subscriptions)
-				send_sub(s.first.c_str(),false,false);
+#ifdef FEATURE_ONCHANGE
+			Client->published.clear();
+#endif
+			const TopicNode *n = Client->topics.filters();
+			while (n)
+				n = send_sub(n,false,false);
+#ifdef FEATURE_QOS
+			Client->qos.rewind();
+			qos_send(true);
+#endif
 			err_t e = tcp_output(Client->pcb);
 			if (e == 0)
 				return;
@@ -492,17 +1401,11 @@ static void parse_puback(uint8_t *buf, size_t rlen)
 {
 	if (rlen == 2) {
 		uint16_t pid = buf[0] << 8 | buf[1];
-		auto x = Client->pubs.find(pid);
-		if (x != Client->pubs.end()) {
-			if ((rlen == 4) && (buf[2] & 0x80)) {
-				log_warn(TAG,"PUBACK for pid %x, topic %s failed: reason %x",(unsigned)pid,x->second.topic,buf[2]);
-			} else {
-				log_devel(TAG,"PUBACK %x for %s",(unsigned)pid,x->second.topic);
-			}
-			Client->pubs.erase(x);
-		} else {
-			log_warn(TAG,"PUBACK %x for unknown topic",(unsigned)pid);
-		}
+		if (Client->qos.ack(pid))
+			log_devel(TAG,"PUBACK %x",(unsigned)pid);
+		else
+			log_warn(TAG,"PUBACK %x for unknown pid",(unsigned)pid);
+		qos_send(false);
 	} else {
 		log_warn(TAG,"PUBACK rlen %u",rlen);
 	}
@@ -512,18 +1415,23 @@ static void parse_puback(uint8_t *buf, size_t rlen)
 
 static void parse_suback(uint8_t *buf, size_t rlen)
 {
-	if (rlen == 3) {
+	if (rlen >= 3) {
 		uint16_t pid = buf[0] << 8 | buf[1];
 		log_devel(TAG,"SUBACK %x",(unsigned)pid);
-		if (buf[2] & 0x80) {
-			const char *t = "<unknown>";
-			auto x = Client->subs.find(pid);
-			if (x != Client->subs.end())
-				t = x->second;
-			log_warn(TAG,"subscribe pid %x, topic %s failed",(unsigned)pid,t);
-		}
-		if (0 == Client->subs.erase(pid))
+		const TopicNode *n = 0;
+		auto x = Client->subs.find(pid);
+		if (x != Client->subs.end())
+			n = x->second;
+		else
 			log_warn(TAG,"SUBACK: unknown pid %x",(unsigned)pid);
+		// one return code per filter of the batch
+		for (size_t i = 2; i < rlen; ++i) {
+			if (buf[i] & 0x80)
+				log_warn(TAG,"subscribe pid %x, topic %s failed",(unsigned)pid,n ? n->filter : "<unknown>");
+			if (n)
+				n = n->nextf;
+		}
+		Client->subs.erase(pid);
 	} else {
 		log_warn(TAG,"SUBACK rlen %u",rlen);
 	}
@@ -666,54 +1574,32 @@ static err_t handle_connect(void *arg, struct tcp_pcb *pcb, err_t x)
 		flags |= 0x80;
 		ts += ps + 2;
 	}
-	char tmp[ts];
-	char *b = tmp;
-	*b++ = CONNECT;		// MQTT connect
-	*b++ = sizeof(tmp) - 2;	// length of request
-	*b++ = 0x0;		// protocol name length high-byte
-	*b++ = 0x4;		// protocol name length low-byte
-	*b++ = 'M';
-	*b++ = 'Q';
-	*b++ = 'T';
-	*b++ = 'T';
-	*b++ = 4;	// protocol version
-	*b++ = flags;
+	MqttFrame f(CONNECT,ts-2);
+	if (!f.valid())
+		return ERR_MEM;
+	f.putstr("MQTT",4);	// protocol name
+	f.put8(4);		// protocol version
+	f.put8(flags);
 #ifdef FEATURE_KEEPALIVE
-	*b++ = (uint8_t)(Client->keepalive >> 8);	// timeout MSB
-	*b++ = (uint8_t)(Client->keepalive & 0xff);	// timeout LSB
+	f.put16(Client->keepalive);	// timeout
 #else
-	*b++ = 0;	// no timeout MSB
-	*b++ = 0;	// no timeout LSB
-#endif
-	*b++ = 0;	// client-name length MSB
-	*b++ = HostnameLen;	// client-name length LSB
-	memcpy(b,Hostname,HostnameLen);
-	b += HostnameLen;
-	if (us) {	// has username
-		*b++ = 0;
-		*b++ = us;
-		memcpy(b,mqtt.username().data(),us);
-		b += us;
-	}
-	if (ps) {	// has password
-		*b++ = 0;	// password length MSB
-		*b++ = ps;	// password length LSB
-		memcpy(b,mqtt.password().data(),ps);
-		b += ps;
-	}
-	assert(b-tmp == sizeof(tmp));
+	f.put16(0);		// no timeout
+#endif
+	f.putstr(Hostname,HostnameLen);	// client-name
+	if (us)		// has username
+		f.putstr(mqtt.username().data(),us);
+	if (ps)		// has password
+		f.putstr(mqtt.password().data(),ps);
 	if (Client->pcb == 0)
 		Client->pcb = pcb;
 	if (pcb != Client->pcb) {
 		tcp_close(pcb);
 		return 0;
 	}
-	log_devel(TAG,"connect write %d",sizeof(tmp));
-	err_t e = tcp_write(pcb,tmp,sizeof(tmp),TCP_WRITE_FLAG_COPY);
-	if (e) {
-		log_warn(TAG,"connect: write error %s",strlwiperr(e));
+	log_devel(TAG,"connect write %d",ts);
+	err_t e = f.write(pcb,false,"connect");
+	if (e)
 		return e;
-	}
 
 //	return mqtt_pub_int("version",Version,strlen(Version),1,0,false);
 	return 0;
@@ -762,12 +1648,20 @@ static unsigned mqtt_cyclic(void *)
 {
 	if (Client == 0)
 		return 1000;
+#ifdef CONFIG_MQTT_QOS_SPILL
+	// also while offline, when spilling is most likely
+	Client->qos.spill_io();
+#endif
 	if (Client->state == offline) {
 		log_devel(TAG,"ts=0, state=%s, %sabled",States[Client->state],Config.mqtt().enable()?"en":"dis");
 		if (Config.mqtt().enable())
 			mqtt_start();
 		return 1000;
 	}
+#ifdef FEATURE_QOS
+	if (Client->state == running)
+		qos_kick();
+#endif
 	uint32_t now = uptime();
 	int32_t rem = (Client->recv_ts + Client->keepalive*1000) - now;
 	log_devel(TAG,"cyclic %d+%d-%d=%d",Client->recv_ts,Client->keepalive,now,rem);
@@ -786,88 +1680,161 @@ static unsigned mqtt_cyclic(void *)
 #endif	// FEATURE_KEEPALIVE
 
 
+static size_t pub_vlen(size_t tl, bool withHost, int qos)
+{
+	return (withHost ? HostnameLen+tl+3 : tl+2) + (qos?2:0);
+}
+
+
+static void pub_topic(MqttFrame &f, const char *t, size_t tl, bool withHost)
+{
+	if (withHost) {
+		f.put16(HostnameLen+tl+1);
+		f.put(Hostname,HostnameLen);
+		f.put8('/');
+		f.put(t,tl);
+	} else {
+		f.putstr(t,tl);
+	}
+}
+
+
+#ifdef FEATURE_QOS
+// executed in LwIP context
+static void qos_send(bool more)
+{
+	if ((Client->pcb == 0) || (Client->state != running))
+		return;
+	QosQueue &q = Client->qos;
+	bool out = false;
+	while (q.inflight < CONFIG_MQTT_QOS_WINDOW) {
+		QosMsg *m = q.unsent();
+		if (m == 0)
+			break;
+		bool host = (m->flags & QOS_HOST) != 0;
+		bool dup = (m->flags & QOS_SENT) != 0;
+		MqttFrame f(PUBLISH | 0x2 | (m->flags & QOS_RETAIN) | (dup ? 0x8 : 0),pub_vlen(m->tlen,host,1),m->vlen);
+		if (!f.valid())
+			break;
+		pub_topic(f,m->topic(),m->tlen,host);
+		if (!dup) {
+			if (++Client->packetid == 0)
+				++Client->packetid;
+			m->pid = Client->packetid;
+		}
+		f.put16(m->pid);
+		f.payload(m->value(),m->vlen);
+		if (f.write(Client->pcb,true,"qos"))
+			break;	// retry on next PUBACK or cyclic
+		if (dup)
+			++q.retrans;
+		q.sent(m);
+		out = true;
+	}
+	if (out && !more)
+		tcp_output(Client->pcb);
+}
+
+
+struct QosArg
+{
+	const char *topic, *value;
+	size_t tlen, vlen;
+	uint8_t flags;
+	bool more;
+	err_t err;
+};
+
+
+// executed in LwIP context
+static void qos_publish(QosArg *a)
+{
+	if (Client->qos.push(a->topic,a->tlen,a->value,a->vlen,a->flags))
+		a->err = 0;
+	else
+		a->err = ERR_MEM;
+	qos_send(a->more);
+}
+
+
+#if LWIP_TCPIP_CORE_LOCKING == 0
+static void qos_publish_fn(void *arg)
+{
+	qos_publish((QosArg *) arg);
+	xSemaphoreGive(LwipSem);
+}
+
+
+static void qos_send_fn(void *)
+{
+	qos_send(false);
+	xSemaphoreGive(LwipSem);
+}
+#endif
+
+
+static void qos_kick()
+{
+	if (Client->qos.queued == Client->qos.inflight)
+		return;
+#if LWIP_TCPIP_CORE_LOCKING == 1
+	LWIP_LOCK();
+	qos_send(false);
+	LWIP_UNLOCK();
+#else
+	tcpip_send_msg_wait_sem(qos_send_fn,0,&LwipSem);
+#endif
+}
+#endif
+
+
 static int mqtt_pub_int(const char *t, const char *v, int len, int retain, int qos, bool needlock, bool withHost)
 {
-	if ((Client == 0) || (Client->state != running))
+	if (Client == 0)
 		return 1;
 	if ((len == 0) && (v != 0))
 		len = strlen(v);
-	bool more = (qos & 0x4) != 0;
+	bool more = (qos & MQTT_PUB_MORE) != 0;
 	qos &= 0x3;
 	size_t tl = strlen(t);
-	char request[len+(withHost?HostnameLen+1:0)+tl+4+(qos?2:0)];
-	char *b = request;
-	*b++ = PUBLISH | (qos << 1) | retain;
-	*b++ = sizeof(request)-2;
-	*b++ = 0;
-	if (withHost) {
-		*b++ = HostnameLen+tl+1;
-		memcpy(b,Hostname,HostnameLen);
-		b += HostnameLen;
-		*b++ = '/';
-	} else {
-		*b++ = tl;
-	}
-	memcpy(b,t,tl);
-	b += tl;
-	if (qos) {
-		// TODO qos: add packet id
-		uint16_t id = ++Client->packetid;
-		*b++ = id >> 8;
-		*b++ = id & 0xff;
 #ifdef FEATURE_QOS
-		Client->pubs.insert(make_pair(id,PubReq(t,v,len)));
-#endif
-	}
-	memcpy(b,v,len);
-	log_devel(TAG,"publish %s %.*s",t,len,v);
+	if (qos) {
+		// QoS2 is not supported, QoS1 messages are queued even when offline
+		QosArg a;
+		a.topic = t;
+		a.value = v;
+		a.tlen = tl;
+		a.vlen = len;
+		a.flags = (retain ? QOS_RETAIN : 0) | (withHost ? QOS_HOST : 0);
+		a.more = more;
+		a.err = 0;
+		log_devel(TAG,"publish qos1 %s %.*s",t,len,v);
 #if LWIP_TCPIP_CORE_LOCKING == 1
-	uint8_t flags = TCP_WRITE_FLAG_COPY;
-	if (more)
-		flags |= TCP_WRITE_FLAG_MORE;
-	if (needlock) {
-		LWIP_LOCK();
-	}
-	const char *m = 0;
-	err_t e = tcp_write(Client->pcb,request,sizeof(request),flags);
-	if (e) {
-		m = "write";
-	} else if (!more)  {
-		e = tcp_output(Client->pcb);
-		m = "output";
-	}
-	if (needlock) {
-		LWIP_UNLOCK();
-	}
-	if (e)
-		log_warn(TAG,"pub %s %d",m,e);
+		if (needlock)
+			LWIP_LOCK();
+		qos_publish(&a);
+		if (needlock)
+			LWIP_UNLOCK();
 #else
-	err_t e = 0;
-	if (needlock) {
-		tcpwrite_arg_t r;
-		r.data = request;
-		r.size = sizeof(request);
-		r.name = "publish";
-		r.sem = LwipSem;
-		r.pcb = Client->pcb;
-		tcpip_send_msg_wait_sem(more ? tcpwrite_fn : tcpwriteout_fn,&r,&LwipSem);
-	} else {
-		uint8_t flags = TCP_WRITE_FLAG_COPY;
-		if (more)
-			flags |= TCP_WRITE_FLAG_MORE;
-		const char *m = 0;
-		e = tcp_write(Client->pcb,request,sizeof(request),flags);
-		if (e) {
-			m = "write";
-		} else if (!more) {
-			e = tcp_output(Client->pcb);
-			m = "output";
-		}
-		if (e)
-			log_warn(TAG,"pub %s %d",m,e);
+		if (needlock)
+			tcpip_send_msg_wait_sem(qos_publish_fn,&a,&LwipSem);
+		else
+			qos_publish(&a);
+#endif
+		return a.err;
 	}
 #endif
-	return e;
+	if (Client->state != running)
+		return 1;
+	MqttFrame f(PUBLISH | (qos << 1) | retain,pub_vlen(tl,withHost,qos),len);
+	if (!f.valid())
+		return ERR_MEM;
+	pub_topic(f,t,tl,withHost);
+	if (qos)
+		f.put16(++Client->packetid);
+	f.payload(v,len);
+	log_devel(TAG,"publish %s %.*s",t,len,v);
+	return mqtt_send(f,more,needlock,"pub");
 }
 
 
@@ -883,8 +1850,38 @@ int mqtt_pub_nl(const char *t, const char *v, int len, int retain, int qos)
 }
 
 
-static void pub_element(EnvElement *e, const char *parent = "")
+#ifdef FEATURE_ONCHANGE
+// returns true if e changed beyond the deadband or is due for republishing
+static bool pub_changed(EnvElement *e, uint32_t now, unsigned rep)
 {
+	EnvNumber *n = e->toNumber();
+	auto i = Client->published.find(e);
+	if (i != Client->published.end()) {
+		PubState &s = i->second;
+		if (now - s.ts < rep * 1000) {
+			if (s.ver == e->version())
+				return false;
+			if (n && n->isValid() && !isnan(s.value) && (fabsf(n->get() - s.value) < Deadband))
+				return false;
+		}
+	}
+	PubState &s = Client->published[e];
+	s.ts = now;
+	s.ver = e->version();
+	s.value = n ? n->get() : NAN;
+	return true;
+}
+#endif
+
+
+static void pub_element(MqttBatch &b, EnvElement *e, const char *parent, uint32_t now)
+{
+#ifdef FEATURE_ONCHANGE
+	if (unsigned rep = Republish) {
+		if (!pub_changed(e,now,rep))
+			return;
+	}
+#endif
 	size_t pl = strlen(parent);
 	const char *en = e->name();
 	size_t nl = strlen(en);
@@ -893,6 +1890,7 @@ static void pub_element(EnvElement *e, const char *parent = "")
 		memcpy(name,parent,pl);
 		name[pl] = '/';
 		memcpy(name+pl+1,en,nl+1);
+		nl += pl + 1;
 	} else {
 		memcpy(name,en,nl+1);
 	}
@@ -903,7 +1901,12 @@ static void pub_element(EnvElement *e, const char *parent = "")
 		str << ' ';
 		str << dim;
 	}
-	mqtt_pub_int(name,str.c_str(),str.size(),0,4,true);
+	MqttFrame f(PUBLISH,pub_vlen(nl,true,0),str.size());
+	if (!f.valid())
+		return;
+	pub_topic(f,name,nl,true);
+	f.payload(str.c_str(),str.size());
+	b.add(f);
 }
 
 
@@ -933,7 +1936,7 @@ static void mqtt_pub_uptime(void * = 0)
 		n += snprintf(value+n,sizeof(value)-n,"%d:%02u",h,m);
 	}
 	if ((n > 0) && (n <= sizeof(value))) {
-		if (err_t e = mqtt_pub("uptime",value,n,0,4)) {
+		if (err_t e = mqtt_pub("uptime",value,n,0,MQTT_PUB_MORE)) {
 			log_warn(TAG,"publish 'uptime' failed: %d",e);
 		} else {
 			log_devel(TAG,"published uptime %s",value);
@@ -958,6 +1961,8 @@ static void mqtt_pub_rtdata(void *)
 			mqtt_start();
 	} else if (Client->pcb != 0) {
 		mqtt_pub_uptime();
+		MqttBatch batch(TCP_MSS);
+		uint32_t now = uptime();
 		rtd_lock();
 		for (EnvElement *e : RTData->getChilds()) {
 			const char *n = e->name();
@@ -966,12 +1971,18 @@ static void mqtt_pub_rtdata(void *)
 			} else if (EnvObject *o = e->toObject()) {
 				const char *n = e->name();
 				for (auto c : o->getChilds()) {
-					pub_element(c,n);
+					pub_element(batch,c,n,now);
 				}
 			} else {
-				pub_element(e);
+				pub_element(batch,e,"",now);
 			}
 		}
+		if (batch.flush(true)) {
+#ifdef FEATURE_ONCHANGE
+			// publish everything again on next cycle
+			Client->published.clear();
+#endif
+		}
 		rtd_unlock();
 #if LWIP_TCPIP_CORE_LOCKING == 1
 		LWIP_LOCK();
@@ -1006,7 +2017,7 @@ static void mqtt_publish(void *arg)
 #if LWIP_TCPIP_CORE_LOCKING == 1
 		LWIP_LOCK();
 #endif
-		mqtt_pub_int(topic,value,strlen(value),0,4,false,false);
+		mqtt_pub_int(topic,value,strlen(value),0,MQTT_PUB_MORE,false,false);
 #if LWIP_TCPIP_CORE_LOCKING == 1
 		tcp_output(Client->pcb);
 		LWIP_UNLOCK();
@@ -1030,16 +2041,19 @@ int mqtt_sub(const char *t, void (*callback)(const char *,const void *,size_t))
 }
 
 
-int MqttClient::subscribe(const char *topic, void (*callback)(const char *,const void *,size_t))
+int MqttClient::subscribe(const char *topic, subcb_t callback, bool track)
 {
-	Subscription s;
-	s.callback = callback;
 	RLock lock(mtx,__FUNCTION__);
-	subscriptions.insert(make_pair((estring)topic,s));
-	EnvString *str = signals->add(topic,"");
-	values.insert(make_pair((estring)topic,str));
-	if (state == running) {
-		send_sub(topic,true,true);
+	TopicNode *n = topics.add(topic,callback);
+	if (n == 0)
+		return 1;
+	if (track)
+		n->track = true;
+	if (n->value == 0) {
+		// new filter
+		n->value = signals->add(topic,"");
+		if (state == running)
+			send_sub(n,true,true);
 	}
 	return 0;
 }
@@ -1177,18 +2191,13 @@ void mqtt_start(void *arg)
 }
 
 
+// value has been updated by dispatch_pub
 static void update_signal(const char *t, const void *d, size_t s)
 {
-	auto i = Client->values.find(t);
-	if (i == Client->values.end()) {
-		log_warn(TAG,"topic %s: no value",t);
-	} else {
-		i->second->set((const char *)d,s);
-		log_dbug(TAG,"topic %s update '%.*s'",t,s,d);
-		// no argument, because it would override the action arg
-		event_trigger(Client->upev);
-//		event_trigger_arg(Client->upev,strdup(t));
-	}
+	log_dbug(TAG,"topic %s update '%.*s'",t,s,d);
+	// no argument, because it would override the action arg
+	event_trigger(Client->upev);
+//	event_trigger_arg(Client->upev,strdup(t));
 }
 
 
@@ -1196,12 +2205,18 @@ void mqtt_setup(void)
 {
 	action_add("mqtt!start",mqtt_start,0,"mqtt start");
 	action_add("mqtt!stop",mqtt_stop,0,"mqtt stop");
-	action_add("mqtt!pub_rtdata",mqtt_pub_rtdata,0,"mqtt publish data");
-	action_add("mqtt!publish",mqtt_publish,0,"publish MQTT a space separated topic/data pair");
+	if (Action *a = action_add("mqtt!pub_rtdata",mqtt_pub_rtdata,0,"mqtt publish data"))
+		a->concurrent = true;
+	if (Action *a = action_add("mqtt!publish",mqtt_publish,0,"publish MQTT a space separated topic/data pair"))
+		a->concurrent = true;
 	if (0 == event_callback("wifi`got_ip","mqtt!start"))
 		abort();
 	if (!Config.has_mqtt())
 		return;
+#ifdef FEATURE_ONCHANGE
+	Republish = nvm_read_u16(NVM_REPUBLISH,0);
+	Deadband = nvm_read_float(NVM_DEADBAND,0);
+#endif
 	if (Client == 0)
 		Client = new MqttClient;
 #ifdef FEATURE_KEEPALIVE
@@ -1213,7 +2228,7 @@ void mqtt_setup(void)
 #endif
 
 	for (const auto &s : Config.mqtt().subscribtions())
-		Client->subscribe(s.c_str(),update_signal);
+		Client->subscribe(s.c_str(),update_signal,true);
 	log_dbug(TAG,"initialized");
 }
 
@@ -1230,6 +2245,9 @@ const char *mqtt(Terminal &term, int argc, const char *args[])
 				"pass: %s\n"
 #ifdef FEATURE_KEEPALIVE
 				"timeout: %us\n"
+#endif
+#ifdef FEATURE_ONCHANGE
+				"republish: %us, deadband %g\n"
 #endif
 				"%sabled, %s\n"
 				, m->uri().c_str()
@@ -1237,9 +2255,23 @@ const char *mqtt(Terminal &term, int argc, const char *args[])
 				, m->password().c_str()
 #ifdef FEATURE_KEEPALIVE
 				, m->keepalive()
+#endif
+#ifdef FEATURE_ONCHANGE
+				, Republish
+				, Deadband
 #endif
 				, m->enable() ? "en" : "dis"
 				, States[Client ? Client->state : 0]);
+#ifdef FEATURE_QOS
+			if (Client) {
+				const QosQueue &q = Client->qos;
+				term.printf("qos1: %u queued, %u in flight, %u retransmitted, %u dropped\n"
+					,q.queued,q.inflight,q.retrans,q.dropped);
+#ifdef CONFIG_MQTT_QOS_SPILL
+				term.printf("qos1: %u spilled to " QOS_SPILLFILE "\n",q.spilled);
+#endif
+			}
+#endif
 		} else {
 			return "Not configured.";
 		}
@@ -1273,6 +2305,26 @@ const char *mqtt(Terminal &term, int argc, const char *args[])
 		if ((e == args[2]) || (a < 0))
 			return "Invalid argument #2.";
 		m->set_keepalive(a);
+#endif
+#ifdef FEATURE_ONCHANGE
+	} else if (!strcmp(args[1],"deadband")) {
+		if (argc < 3)
+			return "Missing argument.";
+		char *e;
+		float d = strtof(args[2],&e);
+		if ((e == args[2]) || (d < 0))
+			return "Invalid argument #2.";
+		Deadband = d;
+		nvm_store_float(NVM_DEADBAND,d);
+	} else if (!strcmp(args[1],"republish")) {
+		if (argc < 3)
+			return "Missing argument.";
+		char *e;
+		long a = strtol(args[2],&e,0);
+		if ((e == args[2]) || (a < 0) || (a > UINT16_MAX))
+			return "Invalid argument #2.";
+		Republish = a;
+		nvm_store_u16(NVM_REPUBLISH,a);
 #endif
 	} else if (!strcmp(args[1],"enable")) {
 		m->set_enable(true);
@@ -1291,14 +2343,15 @@ const char *mqtt(Terminal &term, int argc, const char *args[])
 			return "Not initialized.";
 		}
 		if (argc == 2) {
-			for (const auto &s : Client->subscriptions) 
-				term.printf("%s: %s\n",s.first.c_str(),Client->values[s.first]->get());
+			for (const TopicNode *n = Client->topics.filters(); n; n = n->nextf)
+				term.printf("%s: %s\n",n->filter,n->value ? n->value->get() : "");
 		} else {
-			if (Client->subscriptions.find(args[2]) != Client->subscriptions.end()) {
+			if (Client->topics.find(args[2])) {
 				return "Already subscribed.";
 			}
+			if (Client->subscribe(args[2],update_signal,true))
+				return "Invalid argument #2.";
 			m->add_subscribtions(args[2]);
-			Client->subscribe(args[2],update_signal);
 			return 0;
 		}
 	} else {
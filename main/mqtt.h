@@ -19,6 +19,9 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+// flags that can be or'ed to the qos argument of mqtt_pub
+#define MQTT_PUB_MORE	0x4	// more data follows, defer tcp_output
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -142,7 +142,7 @@ static const char *send_http_get(Terminal &t, LwTcp &P, const char *server, int
 }
 
 
-static const char *to_fd(Terminal &t, void *arg, char *buf, size_t s)
+static const char *to_fd(Terminal &t, void *arg, const char *buf, size_t s)
 {
 	//t.printf("to_fd(): %u bytes\n",s);
 	if (-1 != write((int)arg,buf,s))
@@ -151,7 +151,7 @@ static const char *to_fd(Terminal &t, void *arg, char *buf, size_t s)
 }
 
 
-static const char *to_ota(Terminal &t, void *arg, char *buf, size_t s)
+static const char *to_ota(Terminal &t, void *arg, const char *buf, size_t s)
 {
 	esp_err_t err = esp_ota_write((esp_ota_handle_t)arg,buf,s);
 	if (err == ESP_OK)
@@ -161,7 +161,7 @@ static const char *to_ota(Terminal &t, void *arg, char *buf, size_t s)
 }
 
 
-static const char *socket_to_x(Terminal &t, LwTcp &P, const char *(*sink)(Terminal&,void*,char*,size_t), void *arg)
+static const char *socket_to_x(Terminal &t, LwTcp &P, const char *(*sink)(Terminal&,void*,const char*,size_t), void *arg)
 {
 	char *buf = (char*)malloc(OTABUF_SIZE), *data;
 	if (buf == 0)
@@ -195,23 +195,34 @@ static const char *socket_to_x(Terminal &t, LwTcp &P, const char *(*sink)(Termin
 		goto done;
 	}
 	r -= (data-buf);
-	if (r == 0)
-		goto read_data;
-	while (r > 0) {
+	if (r > 0) {
 		if (const char *e = sink(t,arg,data,r)) {
 			ret = e;
 			goto done;
 		}
 		numD += r;
+	}
+	// the body is passed to the sink straight from the received pbufs
+	while (numD < contlen) {
+		LwTcpSpan spans[4];
+		r = P.borrow(spans,sizeof(spans)/sizeof(spans[0]),60000);
+		if (r <= 0)
+			break;
+		for (unsigned i = 0; (i < sizeof(spans)/sizeof(spans[0])) && spans[i].size && (numD < contlen); ++i) {
+			size_t s = spans[i].size;
+			if (s > contlen - numD)
+				s = contlen - numD;
+			if (const char *e = sink(t,arg,spans[i].data,s)) {
+				ret = e;
+				goto done;
+			}
+			numD += s;
+		}
+		P.release(r);
 		if (ia) {
 			t.printf("\r%d/%u written",numD,contlen);
 			t.sync(false);
 		}
-		if (numD == contlen)
-			break;
-read_data:
-		r = P.read(buf,OTABUF_SIZE,60000);
-		data = buf;
 	}
 	if (r < 0) {
 		ret = P.error();
@@ -229,7 +240,7 @@ done:
 #ifndef CONFIG_ESPTOOLPY_FLASHSIZE_1MB
 typedef struct recv_arg
 {
-	const char *(*sink)(Terminal &,void*,char*,size_t);
+	const char *(*sink)(Terminal &,void*,const char*,size_t);
 	void *arg;
 	char *buf;
 	size_t size;
@@ -254,7 +265,7 @@ static void tftp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_a
 }
 
 
-static const char *tftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,char*,size_t), void *arg)
+static const char *tftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,const char*,size_t), void *arg)
 {
 	struct udp_pcb *pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
 	udp_bind(pcb,IP_ANY_TYPE,0);
@@ -383,7 +394,7 @@ static const char *tftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal
 }
 
 
-static const char *ftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,char*,size_t), void *arg)
+static const char *ftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,const char*,size_t), void *arg)
 {
 	if (uri->user == 0) {
 		uri->user = "ftp";
@@ -522,7 +533,7 @@ static const char *ftp_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal
 }
 
 
-static const char *file_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,char*,size_t), void *arg)
+static const char *file_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,const char*,size_t), void *arg)
 {
 	t.printf("open file %s\n",uri->file);
 	int fd = open(uri->file,O_RDONLY);
@@ -565,7 +576,7 @@ static const char *file_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal
 #endif	// !CONFIG_ESPTOOLPY_FLASHSIZE_1MB
 
 
-static const char *http_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,char*,size_t), void *arg)
+static const char *http_to(Terminal &t, uri_t *uri, const char *(*sink)(Terminal &,void*,const char*,size_t), void *arg)
 {
 	t.printf("host %s, port %u, file %s\n",uri->host,uri->port,uri->file);
 	LwTcp P;
@@ -613,7 +624,7 @@ const char *http_download(Terminal &t, char *addr, const char *fn)
 }
 
 
-const char *to_part(Terminal &t, void *arg, char *buf, size_t s)
+const char *to_part(Terminal &t, void *arg, const char *buf, size_t s)
 {
 	esp_partition_t *p = (esp_partition_t *)arg;
 	//t.printf("to_part %u@%x\n",s,*addr);
@@ -110,6 +110,7 @@ extern "C" {
 #include <errno.h>
 #include <fcntl.h>
 #include <estring.h>
+#include <algorithm>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -145,8 +146,51 @@ static void action_print(void *p, const Action *a)
 static void action_perf(void *p, const Action *a)
 {
 	Terminal *t = (Terminal*)p;
+	if (uint32_t n = a->num)
+		t->printf("\t%-20s %5u %9lu (%6u/%6lu/%6u/%6u)\n",a->name,n,(unsigned long)a->sum,a->min,(unsigned long)(a->sum/n),a->percentile(99),a->max);
+}
+
+
+static void action_collect(void *p, const Action *a)
+{
 	if (a->num)
-		t->printf("\t%-20s %5u %9u (%6u/%6u/%6u)\n",a->name,a->num,a->sum,a->min,a->sum/a->num,a->max);
+		((vector<const Action *> *)p)->push_back(a);
+}
+
+
+static const char *action_top(Terminal &t, int argc, const char *args[])
+{
+	bool p99;
+	if (0 == strcmp(args[2],"p99"))
+		p99 = true;
+	else if (0 == strcmp(args[2],"total"))
+		p99 = false;
+	else
+		return "Invalid argument #2.";
+	long n = 10;
+	if (argc == 4) {
+		char *e;
+		n = strtol(args[3],&e,0);
+		if ((*e != 0) || (n <= 0))
+			return "Invalid argument #3.";
+	}
+	vector<const Action *> all;
+	action_iterate(action_collect,&all);
+	// snapshot the keys, as statistics may change while sorting
+	vector<pair<uint64_t,const Action *>> top;
+	top.reserve(all.size());
+	for (const Action *a : all)
+		top.push_back(make_pair(p99 ? a->percentile(99) : a->sum,a));
+	if ((size_t)n > top.size())
+		n = top.size();
+	partial_sort(top.begin(),top.begin()+n,top.end(),
+		[](const pair<uint64_t,const Action *> &l, const pair<uint64_t,const Action *> &r) {
+			return l.first > r.first;
+		});
+	t.printf("\t%-20s %5s %9s (%6s/%6s/%6s/%6s)\n","name","count","total","min.","avg.","p99","max.");
+	for (long i = 0; i < n; ++i)
+		action_perf(&t,top[i].second);
+	return 0;
 }
 
 
@@ -154,6 +198,8 @@ static const char *action(Terminal &t, int argc, const char *args[])
 {
 	if (argc == 1)
 		return help_cmd(t,args[0]);
+	if ((argc >= 3) && (argc <= 4) && (0 == strcmp(args[1],"-t")))
+		return action_top(t,argc,args);
 	if (argc == 3) {
 		if (action_activate_arg(args[1],(void*)args[2]))
 			return "Invalid argument #1.";
@@ -167,8 +213,10 @@ static const char *action(Terminal &t, int argc, const char *args[])
 	} else if (args[1][1] == 'l') {
 		action_iterate(action_print,(void*)&t);
 	} else if (0 == strcmp(args[1],"-p")) {
-		t.printf("\t%-20s %5s %9s (%6s/%6s/%6s)\n","name","count","total","min.","avg.","max.");
+		t.printf("\t%-20s %5s %9s (%6s/%6s/%6s/%6s)\n","name","count","total","min.","avg.","p99","max.");
 		action_iterate(action_perf,(void*)&t);
+	} else if (args[1][1] == 'r') {
+		action_stats_reset();
 	} else if (args[1][1] == 'F') {
 		if (0 == t.getPrivLevel())
 			return "Access denied.";
@@ -177,6 +225,8 @@ static const char *action(Terminal &t, int argc, const char *args[])
 		if (0 == t.getPrivLevel())
 			return "Access denied.";
 		Config.set_actions_enable(Config.actions_enable()&~2);
+	} else {
+		return "Invalid argument #1.";
 	}
 	return 0;
 }
@@ -272,8 +322,12 @@ const char *event(Terminal &t, int argc, const char *args[])
 					time /= 1000;
 					++s;
 				}
-				t.printf("%s (%ux, %lu%cs) =>\n",name,event_occur(e),(unsigned long)time,*s);
 				const EventHandler *h = event_handler(e);
+				event_prio_t p = event_get_prio(e);
+				t.printf("%s (%ux, %lu%cs%s%s%s) =>\n",name,event_occur(e),(unsigned long)time,*s
+					,p != ep_normal ? ", " : ""
+					,p != ep_normal ? event_prio_name(p) : ""
+					,h->coalesce ? ", coalesce" : "");
 				for (const auto &c : h->callbacks)
 					t.printf("\t%s (%s)%s\n", c.action->name, c.arg ? c.arg : "", c.enabled ? "" : " [disabled]");
 			}
@@ -281,6 +335,9 @@ const char *event(Terminal &t, int argc, const char *args[])
 		} else if (com == 's') {
 			event_status(t);
 			err = 0;
+		} else if (com == 'q') {
+			event_latency(t);
+			err = 0;
 		}
 	} else if (argc == 3) {
 		if (com == 't') {
@@ -301,6 +358,18 @@ const char *event(Terminal &t, int argc, const char *args[])
 		}
 		if (0 == t.getPrivLevel())
 			return "Access denied.";
+		if (com == 'p') {
+			int p = event_prio_parse(args[3]);
+			if (p < 0)
+				return "Invalid argument #3.";
+			return event_set_prio(event_id(args[2]),(event_prio_t)p) ? "Invalid argument #2." : 0;
+		}
+		if (com == 'c') {
+			bool c;
+			if (arg_bool(args[3],&c))
+				return "Invalid argument #3.";
+			return event_set_coalesce(event_id(args[2]),c) ? "Invalid argument #2." : 0;
+		}
 		Action *a = action_get(args[3]);
 		event_t e = event_id(args[2]);
 		if (a == 0) {
@@ -2930,7 +2999,7 @@ ExeName ExeNames[] = {
 	{"stt",0,thresholds,"view/set schmitt-trigger thresholds",stt_man},
 #endif
 	{"su",0,su,"set user privilege level",su_man},
-	{"subtasks",0,subtasks,"statistics of cyclic subtasks",0},
+	{"subtasks",0,subtasks,"statistics of cyclic subtasks",subtasks_man},
 #ifdef CONFIG_TERMSERV
 	{"term",0,uart_termcon,"open terminal on UART",console_man},
 #endif
@@ -270,8 +270,9 @@ unsigned cyclic_check_heap(void *)
 void cyclic_task(void*)
 {
 	for (;;) {
+		// sleep until the next deadline or a new subtask is added
 		unsigned d = cyclic_execute();
-		vTaskDelay(d / portTICK_PERIOD_MS);
+		ulTaskNotifyTake(pdTRUE,(d + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
 	}
 }
 
@@ -304,6 +305,7 @@ void app_main()
 	verify_heap();
 	uart_setup();		// init configured uarts, set diag uart
 	cyclic_setup();
+	cyclic_attach(RTData);
 	verify_heap();
 #ifdef CONFIG_VERIFY_HEAP
 	cyclic_add_task("check_heap",cyclic_check_heap,0);
@@ -37,16 +37,20 @@
 
 #include <lwip/tcpip.h>
 #include <lwip/inet.h>
+#include <lwip/tcp.h>
 #include <lwip/udp.h>
 #include <lwip/pbuf.h>
+#include <lwip/priv/tcpip_priv.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 
 #define SYSLOG_PORT 514
+#define SYSLOG_TCP_PORT 601
 #define PBUF_SIZE 256
 #define MAX_FRAME_SIZE 1472
+#define RETRY_INTERVAL 5000	// ms between connection attempts
 
 #define STRINGLIT_CONCAT(a,b) a b
 
@@ -60,15 +64,25 @@
 using namespace std;
 
 
-enum { ntp_flag=(1<<3), sent_flag = (1<<4), sending_flag = (1<<5) };
+// inflight: written to TCP, but not acknowledged yet
+enum { ntp_flag=(1<<3), sent_flag = (1<<4), sending_flag = (1<<5), inflight_flag = (1<<6) };
+
+typedef enum { frame_single, frame_lf, frame_octets } frame_t;
+
+#ifdef CONFIG_LOG_BINARY
+// msg holds a binary log record body
+#define LOG_MSGSIZE LOG_BINSIZE
+#else
+#define LOG_MSGSIZE LOG_MAXLEN
+#endif
 
 struct LogMsg
 {
 	uint32_t ts;
 	logmod_t mod;
 	uint8_t ml;
-	uint8_t flags;	// 0..2 log_level_t, 3: ntp, 4: sent
-	char msg[LOG_MAXLEN];	// not 0-terminated
+	uint8_t flags;	// 0..2 log_level_t, 3: ntp, 4: sent, 5: sending, 6: inflight
+	char msg[LOG_MSGSIZE];	// not 0-terminated
 };
 
 struct Syslog
@@ -77,17 +91,25 @@ struct Syslog
 	~Syslog();
 
 	struct udp_pcb *pcb = 0;
+	struct tcp_pcb *tpcb = 0;
 	LogMsg *msgs = 0;
+	char *frame = 0;
 	uint64_t ntpbase = 0;
-	uint32_t sent = 0;
+	uint32_t sent = 0, suppressed = 0, datagrams = 0;
+	uint32_t inflight = 0;		// unacknowledged TCP bytes
+	uptime_t retry = 0, refill = 0;
 #ifdef ESP32
 	atomic<int16_t> unsent, overwr, lost;
 #else
 	int16_t unsent, overwr, lost;
 #endif
 	uint16_t at = 0, num;
+	uint16_t port = SYSLOG_PORT;
+	uint16_t tokens = 0;		// rate limit
+	uint16_t dropped = 0;		// suppressed since last summary
 	event_t ev;
 	bool triggered = false;
+	bool tcp = false, connected = false;
 	LogMsg *create_msg();
 	void resize(size_t);
 
@@ -100,6 +122,9 @@ struct Syslog
 #define TAG MODULE_LOG
 static SemaphoreHandle_t Mtx = 0;
 static Syslog *Ctx = 0;
+#ifndef CONFIG_IDF_TARGET_ESP8266
+static SemaphoreHandle_t LwipSem = 0;
+#endif
 
 
 static void syslog_start(void*);
@@ -113,16 +138,24 @@ Syslog::Syslog(size_t s)
 		s = 512;
 	num = s / sizeof(LogMsg);
 	msgs = (LogMsg *) calloc(num,sizeof(LogMsg));
+	frame = (char *) malloc(MAX_FRAME_SIZE);
 }
 
 
 Syslog::~Syslog()
 {
-	if (pcb) {
-		LWIP_LOCK();
+	LWIP_LOCK();
+	if (pcb)
 		udp_remove(pcb);
-		LWIP_UNLOCK();
+	if (tpcb) {
+		tcp_arg(tpcb,0);
+		tcp_err(tpcb,0);
+		if (tcp_close(tpcb))
+			tcp_abort(tpcb);
 	}
+	LWIP_UNLOCK();
+	free(frame);
+	free(msgs);
 }
 
 
@@ -152,10 +185,18 @@ void Syslog::resize(size_t s)
 }
 
 
-static int sendmsg(LogMsg *m)
+// Formats one message as RFC5424 into buf.
+// Returns 0 if the frame does not fit.
+static size_t format(LogMsg *m, char *buf, size_t size, frame_t ft)
 {
-	if (m->msg[0] == 0)
-		return 0;
+#ifdef CONFIG_LOG_BINARY
+	char text[LOG_MAXLEN];
+	const char *msg = text;
+	size_t ml = log_bin_format(text,sizeof(text),(const uint8_t *)m->msg,m->ml);
+#else
+	const char *msg = m->msg;
+	size_t ml = m->ml;
+#endif
 	int n;
 	char header[64];
 	const char *mod = ModNames+ModNameOff[m->mod];
@@ -182,19 +223,129 @@ static int sendmsg(LogMsg *m)
 	}
 	assert(n < sizeof(header));
 	log_devel(TAG,"send %.*s",n,header);
-	LWIP_LOCK();	//-- this caused a hang - why? still true?
-	struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT, n+m->ml, PBUF_RAM);
-	pbuf_take(pbuf,header,n);
-	pbuf_take_at(pbuf,m->msg,m->ml,n);
-	err_t e = udp_send(Ctx->pcb,pbuf);
-	pbuf_free(pbuf);
-	if (e) {
-		udp_remove(Ctx->pcb);
-		Ctx->pcb = 0;
-		log_local(TAG,"sendto %d",e);
+	size_t l = n + ml;
+	size_t fl = l;
+	char prefix[8];
+	int pl = 0;
+	if (ft == frame_octets) {
+		// RFC 6587, 3.4.1: MSG-LEN SP SYSLOG-MSG
+		pl = sprintf(prefix,"%u ",l);
+		fl += pl;
+	} else if (ft == frame_lf) {
+		++fl;
 	}
+	if (fl > size)
+		return 0;
+	memcpy(buf,prefix,pl);
+	memcpy(buf+pl,header,n);
+	memcpy(buf+pl+n,msg,ml);
+	if (ft == frame_lf)
+		buf[fl-1] = '\n';
+	return fl;
+}
+
+
+typedef struct flush_arg_s {
+	const char *data;
+	size_t len;
+	err_t err;
+	int count;
+} flush_arg_t;
+
+
+static unsigned mark(uint8_t from, uint8_t to);
+
+
+// Executed in LwIP context, Mtx must not be held.
+static void flush_fn(void *arg)
+{
+#ifdef CONFIG_IDF_TARGET_ESP8266
+	LWIP_LOCK();
+#endif
+	flush_arg_t *a = (flush_arg_t *) arg;
+	if (struct tcp_pcb *pcb = Ctx->tpcb) {
+		if ((tcp_sndbuf(pcb) < a->len) || (tcp_sndqueuelen(pcb) + 2 > TCP_SND_QUEUELEN)) {
+			a->err = ERR_MEM;
+		} else {
+			a->err = tcp_write(pcb,a->data,a->len,TCP_WRITE_FLAG_COPY);
+			if (a->err == 0) {
+				// in LwIP context, so that the ack cannot overtake
+				{
+					Lock lock(Mtx,__FUNCTION__);
+					Ctx->inflight += a->len;
+					a->count = mark(sending_flag,inflight_flag);
+				}
+				tcp_output(pcb);
+			}
+		}
+	} else if (struct udp_pcb *pcb = Ctx->pcb) {
+		struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT,a->len,PBUF_RAM);
+		if (pbuf) {
+			pbuf_take(pbuf,a->data,a->len);
+			a->err = udp_send(pcb,pbuf);
+			pbuf_free(pbuf);
+		} else {
+			a->err = ERR_MEM;
+		}
+		if (a->err && (a->err != ERR_MEM)) {
+			udp_remove(pcb);
+			Ctx->pcb = 0;
+		}
+	} else {
+		a->err = ERR_CONN;
+	}
+#ifdef CONFIG_IDF_TARGET_ESP8266
 	LWIP_UNLOCK();
-	return e;
+#else
+	xSemaphoreGive(LwipSem);
+#endif
+}
+
+
+// Mtx must be held. Replaces flag 'from' by 'to' on all messages.
+static unsigned mark(uint8_t from, uint8_t to)
+{
+	unsigned x = 0;
+	for (LogMsg *m = Ctx->msgs, *e = Ctx->msgs+Ctx->num; m != e; ++m) {
+		if (m->flags & from) {
+			m->flags = (m->flags & ~from) | to;
+			if ((to == sent_flag) && (Ctx->unsent > 0)) {
+				--Ctx->unsent;
+				++Ctx->sent;
+			}
+			++x;
+		}
+	}
+	return x;
+}
+
+
+// Sends the frame, Mtx must be held and is released during sending.
+// Returns the number of messages sent or -1 on error.
+static int flush(MLock &lock, size_t len)
+{
+	flush_arg_t a;
+	a.data = Ctx->frame;
+	a.len = len;
+	a.err = 0;
+	a.count = -1;
+	lock.unlock();
+#ifdef CONFIG_IDF_TARGET_ESP8266
+	flush_fn(&a);
+#else
+	tcpip_send_msg_wait_sem(flush_fn,&a,&LwipSem);
+#endif
+	lock.lock();
+	if (a.err) {
+		mark(sending_flag,0);
+		if (a.err != ERR_MEM)
+			log_local(TAG,"send: %s",strlwiperr(a.err));
+		return -1;
+	}
+	if (a.count >= 0)
+		return a.count;
+	++Ctx->datagrams;
+	return mark(sending_flag,sent_flag);
 }
 
 
@@ -205,6 +356,14 @@ void syslog_stop()
 			Ctx->pcb = 0;
 			udp_remove(pcb);
 		}
+		if (struct tcp_pcb *pcb = Ctx->tpcb) {
+			Ctx->tpcb = 0;
+			Ctx->connected = false;
+			tcp_arg(pcb,0);
+			tcp_err(pcb,0);
+			if (tcp_close(pcb))
+				tcp_abort(pcb);
+		}
 	}
 }
 
@@ -213,70 +372,172 @@ void sendall(void * = 0)
 {
 	if (Ctx == 0)
 		return;
-	if (Ctx->pcb == 0) {
-		log_local(TAG,"no pcb");
-		syslog_start(0);	// hangs on startup on IDF v4.x with station connect not finishing
+	if ((Ctx->pcb == 0) && (Ctx->tpcb == 0)) {
+		uptime_t now = uptime();
+		if ((int32_t)(now - Ctx->retry) >= 0) {
+			Ctx->retry = now + RETRY_INTERVAL;
+			log_local(TAG,"no pcb");
+			syslog_start(0);	// hangs on startup on IDF v4.x with station connect not finishing
+		}
 		return;
 	}
+	if (Ctx->tpcb && !Ctx->connected)
+		return;
+	if (Ctx->frame == 0)
+		return;
+#if defined CONFIG_SYSLOG_UDP_BATCH
+	frame_t ft = Ctx->tcp ? frame_octets : frame_lf;
+#else
+	frame_t ft = Ctx->tcp ? frame_octets : frame_single;
+#endif
 	unsigned x = 0;
+	size_t fl = 0;
 	MLock lock(Mtx);
-	LogMsg *at = Ctx->msgs+Ctx->at;
-	LogMsg *end = Ctx->msgs+Ctx->num;
-	LogMsg *m = at;
-	do {
-		if (m->msg[0] && (m->flags & sent_flag) == 0) {
-			m->flags |= sending_flag;
-			lock.unlock();
-			int r = sendmsg(m);
-			m->flags &= ~sending_flag;
-			if (r) {
-				event_trigger_nd(Ctx->ev);
-#if CONFIG_IDF_TARGET_ESP32S2
-				if (x) {
-					vTaskDelay(10);	// needed for UDP stack to catch up
-					lock.lock();
-					continue;
-				}
-#endif
-				goto done;
-			}
-			lock.lock();
-			m->flags |= sent_flag;
-			if (Ctx->unsent > 0) {
-				--Ctx->unsent;
-				++Ctx->sent;
+	unsigned start = Ctx->at;
+	unsigned i = 0;
+	while (i < Ctx->num) {
+		LogMsg *m = Ctx->msgs + (start + i) % Ctx->num;
+		if ((m->ml == 0) || (m->flags & (sent_flag|sending_flag|inflight_flag))) {
+			++i;
+			continue;
+		}
+		size_t n = format(m,Ctx->frame+fl,MAX_FRAME_SIZE-fl,ft);
+		if (n == 0) {
+			if (fl == 0) {
+				// cannot happen with LOG_MAXLEN < MAX_FRAME_SIZE
+				m->flags |= sent_flag;
+				continue;
 			}
-			++x;
+			// frame full, send it and retry this message
+			int r = flush(lock,fl);
+			fl = 0;
+			if (r < 0)
+				goto done;
+			x += r;
+			continue;
 		}
-		++m;
-		if (m == end)
-			m = Ctx->msgs;
-	} while (m != at);
+		m->flags |= sending_flag;
+		fl += n;
+		++i;
+		if (ft == frame_single) {
+			int r = flush(lock,fl);
+			fl = 0;
+			if (r < 0)
+				goto done;
+			x += r;
+		}
+	}
+	if (fl) {
+		int r = flush(lock,fl);
+		if (r < 0)
+			goto done;
+		x += r;
+	}
 	Ctx->triggered = false;
 	lock.unlock();
+	log_local(TAG,"sent %u messages",x);
+	return;
 done:
+	// retried on next message, TCP retries when data is acknowledged
+	if (!Ctx->tcp)
+		event_trigger_nd(Ctx->ev);
+	lock.unlock();
 	log_local(TAG,"sent %u messages",x);
 }
 
 
+static void syslog_tcp_err(void *arg, err_t e)
+{
+	// pcb is already freed by LwIP
+	Lock lock(Mtx,__FUNCTION__);
+	Ctx->tpcb = 0;
+	Ctx->connected = false;
+	Ctx->inflight = 0;
+	// unacknowledged messages are sent again after reconnect
+	mark(inflight_flag,0);
+	log_local(TAG,"connection error: %s",strlwiperr(e));
+}
+
+
+static err_t syslog_tcp_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	bool more;
+	{
+		Lock lock(Mtx,__FUNCTION__);
+		Ctx->inflight = Ctx->inflight > len ? Ctx->inflight - len : 0;
+		if (Ctx->inflight == 0)
+			mark(inflight_flag,sent_flag);
+		more = Ctx->unsent > 0;
+	}
+	if (more)
+		event_trigger_nd(Ctx->ev);
+	return 0;
+}
+
+
+static err_t syslog_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t e)
+{
+	if (p) {
+		// syslog receivers do not send data
+		tcp_recved(pcb,p->tot_len);
+		pbuf_free(p);
+		return 0;
+	}
+	// closed by peer
+	tcp_arg(pcb,0);
+	tcp_err(pcb,0);
+	tcp_sent(pcb,0);
+	tcp_recv(pcb,0);
+	err_t r = tcp_close(pcb);
+	if (r)
+		tcp_abort(pcb);
+	syslog_tcp_err(0,ERR_CLSD);
+	return r ? ERR_ABRT : ERR_OK;
+}
+
+
+static err_t syslog_tcp_connected(void *arg, struct tcp_pcb *pcb, err_t e)
+{
+	{
+		Lock lock(Mtx,__FUNCTION__);
+		Ctx->connected = true;
+	}
+	log_local(TAG,"connected");
+	event_trigger_nd(Ctx->ev);
+	return 0;
+}
+
+
 static void syslog_hostip(const char *hn, const ip_addr_t *ip, void *arg)
 {
 	// no LWIP_LOCK as called from tcpip_task
-	if ((ip == 0) || (Ctx->pcb))
+	if ((ip == 0) || Ctx->pcb || Ctx->tpcb)
 		return;
 	if (Ctx->ev == 0)
 		Ctx->ev = event_id("syslog`msg");
 	err_t e;
-	{
-		Lock lock(Mtx,__FUNCTION__);
-		udp_pcb *pcb;
-		if (Ctx->pcb) {
-			pcb = Ctx->pcb;
-			Ctx->pcb = 0;
-			udp_remove(pcb);
+	if (Ctx->tcp) {
+		struct tcp_pcb *pcb = tcp_new();
+		if (pcb == 0)
+			return;
+		tcp_err(pcb,syslog_tcp_err);
+		tcp_recv(pcb,syslog_tcp_recv);
+		tcp_sent(pcb,syslog_tcp_sent);
+		{
+			Lock lock(Mtx,__FUNCTION__);
+			Ctx->tpcb = pcb;
+			Ctx->connected = false;
+		}
+		e = tcp_connect(pcb,ip,Ctx->port,syslog_tcp_connected);
+		if (e) {
+			Lock lock(Mtx,__FUNCTION__);
+			Ctx->tpcb = 0;
+			tcp_abort(pcb);
 		}
-		pcb = udp_new();
-		e = udp_connect(pcb,ip,SYSLOG_PORT);
+	} else {
+		Lock lock(Mtx,__FUNCTION__);
+		udp_pcb *pcb = udp_new();
+		e = udp_connect(pcb,ip,Ctx->port);
 		if (e) {
 			udp_remove(pcb);
 		} else {
@@ -287,7 +548,7 @@ static void syslog_hostip(const char *hn, const ip_addr_t *ip, void *arg)
 	if (e) {
 		log_warn(TAG,"connect %s: %s",hn,strlwiperr(e));
 	} else {
-		log_local(TAG,"connected to %s",hn);
+		log_local(TAG,"%s %s",Ctx->tcp ? "connecting to" : "connected to",hn);
 	}
 }
 
@@ -299,10 +560,35 @@ static void syslog_start(void*)
 		return;
 	if (!Config.has_syslog_host())
 		return;
+	// [udp://|tcp://]host[:port]
 	const char *host = Config.syslog_host().c_str();
-	err_t e = query_host(host,0,syslog_hostip,0);
+	bool tcp = false;
+	if (0 == strncmp(host,"tcp://",6)) {
+		tcp = true;
+		host += 6;
+	} else if (0 == strncmp(host,"udp://",6)) {
+		host += 6;
+	}
+	size_t hl = strlen(host);
+	char hn[hl+1];
+	memcpy(hn,host,hl+1);
+	uint16_t port = tcp ? SYSLOG_TCP_PORT : SYSLOG_PORT;
+	char *c = strchr(hn,':');
+	if (c && (c == strrchr(hn,':'))) {
+		// single colon: not an IPv6 address
+		*c = 0;
+		long l = strtol(c+1,0,0);
+		if ((l <= 0) || (l > UINT16_MAX)) {
+			log_warn(TAG,"invalid port");
+			return;
+		}
+		port = l;
+	}
+	Ctx->tcp = tcp;
+	Ctx->port = port;
+	err_t e = query_host(hn,0,syslog_hostip,0);
 	if (e < 0)
-		log_warn(TAG,"query %s: %d",host,e);
+		log_warn(TAG,"query %s: %d",hn,e);
 	else
 		log_local(TAG,"start");
 }
@@ -312,11 +598,11 @@ LogMsg *Syslog::create_msg()
 {
 	// assume lock is alread taken
 	LogMsg *r = msgs+at;
-	if (r->flags & sending_flag) {
+	if (r->flags & (sending_flag|inflight_flag)) {
 		++lost;
 		return 0;
 	}
-	if (r->msg[0] && ((r->flags & sent_flag) == 0))
+	if (r->ml && ((r->flags & sent_flag) == 0))
 		++overwr;
 	++at;
 	at %= num;
@@ -324,49 +610,121 @@ LogMsg *Syslog::create_msg()
 }
 
 
-extern "C"
-void log_syslog(log_level_t lvl, logmod_t module, const char *msg, size_t ml, struct timeval *tv)
+// Mtx must be held. Token bucket of CONFIG_SYSLOG_RATE_LIMIT messages
+// per second with a burst of the same size.
+static bool rate_ok()
+{
+#if CONFIG_SYSLOG_RATE_LIMIT > 0
+	uptime_t now = uptime();
+	unsigned add = (uint64_t)(now - Ctx->refill) * CONFIG_SYSLOG_RATE_LIMIT / 1000;
+	if (add) {
+		if (Ctx->tokens + add >= CONFIG_SYSLOG_RATE_LIMIT) {
+			Ctx->tokens = CONFIG_SYSLOG_RATE_LIMIT;
+			Ctx->refill = now;
+		} else {
+			Ctx->tokens += add;
+			Ctx->refill += (uint64_t)add * 1000 / CONFIG_SYSLOG_RATE_LIMIT;
+		}
+	}
+	if (Ctx->tokens == 0)
+		return false;
+	--Ctx->tokens;
+#endif
+	return true;
+}
+
+
+// Mtx must be held. Returns true if sendall must be triggered.
+static bool store_msg(log_level_t lvl, logmod_t module, const void *msg, size_t ml, struct timeval *tv, bool fwd)
+{
+	LogMsg *m = Ctx->create_msg();
+	if (m == 0)
+		return false;
+	m->flags = lvl;
+	m->ml = ml;
+	m->mod = module;
+	memcpy(m->msg,msg,ml);
+	struct timeval tv2;
+	if (tv == 0) {
+		gettimeofday(&tv2,0);
+		tv = &tv2;
+	}
+	if (tv->tv_sec > 10000000) {
+		m->flags |= ntp_flag;
+		if (Ctx->ntpbase == 0)
+			Ctx->ntpbase = tv->tv_sec;
+	}
+	m->ts = (tv->tv_sec-Ctx->ntpbase) * 1000 + tv->tv_usec/1000;
+	if (!fwd) {
+		m->flags |= sent_flag;
+		return false;
+	}
+	++Ctx->unsent;
+	if (Ctx->triggered)
+		return false;
+	Ctx->triggered = true;
+	return true;
+}
+
+
+static void syslog_store(log_level_t lvl, logmod_t module, const void *msg, size_t ml, struct timeval *tv)
 {
 	// header: pri version timestamp hostname app-name procid msgid
 	if (Ctx == 0)
 		return;
-	if (ml > INT8_MAX)	// could be UINT8_MAX, reserved for now
-		ml = INT8_MAX;
+	if (ml > sizeof(LogMsg::msg))
+		ml = sizeof(LogMsg::msg);
 	if (pdTRUE != xSemaphoreTake(Mtx,MUTEX_ABORT_TIMEOUT))
 		abort_on_mutex(Mtx,__BASE_FILE__);
 	bool trigger = false;
-	if (LogMsg *m = Ctx->create_msg()) {
-		m->flags = lvl;
-		m->ml = ml;
-		m->mod = module;
-		memcpy(m->msg,msg,ml);
-		m->msg[ml] = 0;
-		struct timeval tv2;
-		if (tv == 0) {
-			gettimeofday(&tv2,0);
-			tv = &tv2;
-		}
-		if (tv->tv_sec > 10000000) {
-			m->flags |= ntp_flag;
-			if (Ctx->ntpbase == 0)
-				Ctx->ntpbase = tv->tv_sec;
-		}
-		m->ts = (tv->tv_sec-Ctx->ntpbase) * 1000 + tv->tv_usec/1000;
-		if (lvl != ll_local) {
-			++Ctx->unsent;
-			trigger = !Ctx->triggered;
-			if (trigger)
-				Ctx->triggered = trigger;
-		} else {
-			m->flags |= sent_flag;
-		}
+	bool fwd = (lvl != ll_local);
+	if (fwd && !rate_ok()) {
+		// kept for dmesg, but not sent
+		++Ctx->dropped;
+		++Ctx->suppressed;
+		fwd = false;
+	} else if (fwd && Ctx->dropped) {
+		char text[40];
+		int n = snprintf(text,sizeof(text),"%u messages suppressed",Ctx->dropped);
+		Ctx->dropped = 0;
+#ifdef CONFIG_LOG_BINARY
+		uint8_t b[LOG_BINSIZE];
+		trigger = store_msg(ll_warn,TAG,b,log_bin_text(b,sizeof(b),text,n),tv,true);
+#else
+		trigger = store_msg(ll_warn,TAG,text,n,tv,true);
+#endif
 	}
+	if (store_msg(lvl,module,msg,ml,tv,fwd))
+		trigger = true;
 	xSemaphoreGive(Mtx);
 	if (trigger)
 		event_trigger_nd(Ctx->ev);
 }
 
 
+extern "C"
+void log_syslog(log_level_t lvl, logmod_t module, const char *msg, size_t ml, struct timeval *tv)
+{
+	if (ml > INT8_MAX)	// could be UINT8_MAX, reserved for now
+		ml = INT8_MAX;
+#ifdef CONFIG_LOG_BINARY
+	uint8_t b[LOG_BINSIZE];
+	syslog_store(lvl,module,b,log_bin_text(b,sizeof(b),msg,ml),tv);
+#else
+	syslog_store(lvl,module,msg,ml,tv);
+#endif
+}
+
+
+#ifdef CONFIG_LOG_BINARY
+extern "C"
+void log_syslog_bin(log_level_t lvl, logmod_t module, const uint8_t *b, size_t bl, struct timeval *tv)
+{
+	syslog_store(lvl,module,b,bl,tv);
+}
+#endif
+
+
 const char *dmesg(Terminal &term, int argc, const char *args[])
 {
 	if (argc > 2)
@@ -390,15 +748,19 @@ const char *dmesg(Terminal &term, int argc, const char *args[])
 	LogMsg *at = Ctx->msgs+Ctx->at;
 	LogMsg *m = at;
 #ifdef ESP32
-	term.printf("%u queued, %u overwritten, %u sent, %u lost\n",Ctx->unsent.load(),Ctx->overwr.load(),Ctx->sent,Ctx->lost.load());
+	term.printf("%u queued, %u overwritten, %u sent, %u lost, %u suppressed\n",Ctx->unsent.load(),Ctx->overwr.load(),Ctx->sent,Ctx->lost.load(),Ctx->suppressed);
 #else
-	term.printf("%u queued, %u overwritten, %u sent, %u lost\n",Ctx->unsent,Ctx->overwr,Ctx->sent,Ctx->lost);
+	term.printf("%u queued, %u overwritten, %u sent, %u lost, %u suppressed\n",Ctx->unsent,Ctx->overwr,Ctx->sent,Ctx->lost,Ctx->suppressed);
 #endif
+	if (Ctx->tcp)
+		term.printf("tcp %s, %u bytes unacknowledged\n",Ctx->connected ? "connected" : "disconnected",Ctx->inflight);
+	else
+		term.printf("udp, %u datagrams\n",Ctx->datagrams);
 	do {
-		if (m->msg[0]) {
+		if (m->ml) {
 			const char *mod = ModNames+ModNameOff[m->mod];
 			const char *lvls = "EWIDL";
-			char status = (m->flags & sending_flag) ? 's' : (m->flags & sent_flag) ? ' ' : '*';
+			char status = (m->flags & (sending_flag|inflight_flag)) ? 's' : (m->flags & sent_flag) ? ' ' : '*';
 			if (m->flags & ntp_flag) {
 				struct tm tm;
 				time_t ts = m->ts/1000+Ctx->ntpbase;
@@ -417,7 +779,12 @@ const char *dmesg(Terminal &term, int argc, const char *args[])
 					, mod
 					);
 			}
+#ifdef CONFIG_LOG_BINARY
+			char text[LOG_MAXLEN];
+			term.write(text,log_bin_format(text,sizeof(text),(const uint8_t *)m->msg,m->ml));
+#else
 			term.write(m->msg,m->ml);
+#endif
 			term.println();
 		}
 		++m;
@@ -431,7 +798,12 @@ const char *dmesg(Terminal &term, int argc, const char *args[])
 void dmesg_setup()
 {
 	Mtx = xSemaphoreCreateMutex();
-	event_register("syslog`msg");
+#ifndef CONFIG_IDF_TARGET_ESP8266
+	LwipSem = xSemaphoreCreateBinary();
+#endif
+	event_t e = event_register("syslog`msg");
+	event_set_prio(e,ep_bulk);
+	event_set_coalesce(e,true);
 }
 
 
@@ -23,7 +23,7 @@
 #include "globals.h"
 #include "inetd.h"
 #include "log.h"
-#include "mem_term.h"
+#include "terminal.h"
 #include "netsvc.h"
 #include "shell.h"
 #include "support.h"
@@ -31,6 +31,7 @@
 #include "wifi.h"
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include <freertos/task.h>
 
 #include <lwip/inet.h>
@@ -50,25 +51,88 @@
 #define stacksize 2048
 #endif
 
-struct UdpCtrl
-{
-	udp_pcb *PCB;
-	unsigned Cmds = 0;
-	uint16_t Port;
-};
+// Requests are executed one after the other by a single worker. A
+// request can be prefixed with "#<id> ". The reply of such a request
+// is sent in datagrams of up to UDPCTRL_MTU bytes, each starting with
+// "#<id> <seq>/<num>\n". Replies of the last UDPCTRL_SLOTS requests are
+// kept, so a retried request gets the same reply without executing
+// the command again. A retry that arrives while its request is still
+// queued or executing is dropped, as the reply is sent once the
+// request has been executed. Requests without id get a single datagram
+// as reply and are not cached.
 
+#define UDPCTRL_QUEUE		8
+#define UDPCTRL_SLOTS		4
+#define UDPCTRL_MTU		1400
+#define UDPCTRL_MAXREPLY	8192
+#define UDPCTRL_SLOTSIZE	1024	// kept allocated per slot
+#define UDPCTRL_PENDING		(UDPCTRL_QUEUE+1)	// queued and executing
 
 struct UdpCmd
 {
 	struct pbuf *pbuf;
 	ip_addr_t ip;
 	uint16_t port;
+	int8_t pending;		// index in UdpCtrl::pending or -1
+};
+
+
+struct UdpPending
+{
+	ip_addr_t ip;
+	uint32_t id;
+	bool used = false;
+};
+
+
+struct UdpReply
+{
+	ip_addr_t ip;
+	uint32_t id;
+	char *buf = 0;
+	size_t len = 0, size = 0;
+	bool framed = false, valid = false;
+
+	bool append(const char *, size_t);
+};
+
+
+struct UdpCtrl
+{
+	udp_pcb *PCB;
+	QueueHandle_t queue;
+	SemaphoreHandle_t mtx;	// protects pending
+	UdpReply replies[UDPCTRL_SLOTS];
+	UdpPending pending[UDPCTRL_PENDING];
+	unsigned Cmds = 0, Dropped = 0, Dups = 0, Sent = 0;
+	uint16_t Port;
+	uint8_t next = 0;
+};
+
 
-	UdpCmd(struct pbuf *b, ip_addr_t i, uint16_t p)
-	: pbuf(b)
-	, ip(i)
-	, port(p)
+class UdpTerminal : public Terminal
+{
+	public:
+	UdpTerminal(const char *inp, size_t l, UdpReply *r)
+	: Terminal(false)
+	, m_inp(inp)
+	, m_ilen(l)
+	, m_reply(r)
 	{ }
+
+	const char *type() const override
+	{ return "udp"; }
+
+	bool isInteractive() const override
+	{ return false; }
+
+	int read(char *, size_t, bool = true) override;
+	int write(const char *b, size_t) override;
+
+	private:
+	const char *m_inp;
+	size_t m_ilen;
+	UdpReply *m_reply;
 };
 
 
@@ -76,57 +140,233 @@ struct UdpCmd
 static UdpCtrl *Ctx = 0;
 
 
-static void udpctrl_session(void *arg)
+bool UdpReply::append(const char *b, size_t s)
+{
+	if (len + s > size) {
+		if (len + s > UDPCTRL_MAXREPLY)
+			return false;
+		size_t ns = (len + s + 255) & ~255;
+		char *n = (char *) realloc(buf,ns);
+		if (n == 0)
+			return false;
+		buf = n;
+		size = ns;
+	}
+	memcpy(buf+len,b,s);
+	len += s;
+	return true;
+}
+
+
+int UdpTerminal::read(char *buf, size_t s, bool b)
+{
+	if (m_inp == 0)
+		return -1;	// end-of-file
+	size_t n = (s < m_ilen) ? s : m_ilen;
+	if (n) {
+		memcpy(buf,m_inp,n);
+		m_ilen -= n;
+		m_inp += n;
+	} else {
+		m_inp = 0;
+	}
+	return n;
+}
+
+
+int UdpTerminal::write(const char *b, size_t s)
+{
+	if (m_error)
+		return -1;
+	if (!m_reply->append(b,s)) {
+		m_error = "Reply too long.";
+		return -1;
+	}
+	return s;
+}
+
+
+static void send_datagram(const char *hdr, size_t hl, const char *data, size_t dl, const ip_addr_t *ip)
 {
-	UdpCmd *c = (UdpCmd *) arg;
-	char ipstr[64];
-	ip2str_r(&c->ip,ipstr,sizeof(ipstr));
-	log_dbug(TAG,"%d bytes from %s:%u", c->pbuf->len, ipstr, (unsigned)c->port);
-	MemTerminal term((const char *)c->pbuf->payload,c->pbuf->len);
-	shell(term,true);
-	size_t s = term.getSize();
-	log_dbug(TAG,"response: '%s'",term.getBuffer());
 	LWIP_LOCK();
-	struct pbuf *r = pbuf_alloc(PBUF_TRANSPORT,s,PBUF_RAM);
-	pbuf_take(r,term.getBuffer(),s);
-	int e = udp_sendto(Ctx->PCB,r,&c->ip,Ctx->Port);
-	pbuf_free(r);
-	pbuf_free(c->pbuf);
+	struct pbuf *r = pbuf_alloc(PBUF_TRANSPORT,hl+dl,PBUF_RAM);
+	int e = ERR_MEM;
+	if (r) {
+		if (hl)
+			pbuf_take(r,hdr,hl);
+		if (dl)
+			pbuf_take_at(r,data,dl,hl);
+		e = udp_sendto(Ctx->PCB,r,ip,Ctx->Port);
+		pbuf_free(r);
+	}
 	LWIP_UNLOCK();
 	if (e)
 		log_warn(TAG,"send=%d",e);
-	delete c;
-	vTaskDelete(0);
+	else
+		++Ctx->Sent;
+}
+
+
+static void send_reply(const UdpReply *r)
+{
+	if (!r->framed) {
+		send_datagram(0,0,r->buf,r->len,&r->ip);
+		return;
+	}
+	unsigned num = r->len ? (r->len + UDPCTRL_MTU - 1) / UDPCTRL_MTU : 1;
+	for (unsigned seq = 1; seq <= num; ++seq) {
+		char hdr[32];
+		int hl = snprintf(hdr,sizeof(hdr),"#%u %u/%u\n",(unsigned)r->id,seq,num);
+		size_t off = (seq-1) * UDPCTRL_MTU;
+		size_t dl = r->len - off > UDPCTRL_MTU ? UDPCTRL_MTU : r->len - off;
+		send_datagram(hdr,hl,r->buf+off,dl,&r->ip);
+	}
+}
+
+
+// Returns the length of the "#<id> " prefix or 0 if there is none.
+static size_t parse_id(const char *cmd, size_t cl, uint32_t &id)
+{
+	if ((cl <= 2) || (cmd[0] != '#'))
+		return 0;
+	size_t i = 1;
+	id = 0;
+	while ((i < cl) && (cmd[i] >= '0') && (cmd[i] <= '9'))
+		id = id * 10 + cmd[i++] - '0';
+	if ((i > 1) && (i < cl) && (cmd[i] == ' '))
+		return i + 1;
+	return 0;
+}
+
+
+static void run(const char *cmd, size_t cl, UdpReply *r)
+{
+	UdpTerminal term(cmd,cl,r);
+	shell(term,true);
+	log_dbug(TAG,"response: '%.*s'",(int)r->len,r->buf);
+	send_reply(r);
+}
+
+
+static void execute(UdpCmd *c)
+{
+	const char *cmd = (const char *)c->pbuf->payload;
+	size_t cl = c->pbuf->len;
+	uint32_t id;
+	size_t hl = parse_id(cmd,cl,id);
+	if (hl == 0) {
+		UdpReply r;
+		r.ip = c->ip;
+		run(cmd,cl,&r);
+		free(r.buf);
+		return;
+	}
+	cmd += hl;
+	cl -= hl;
+	for (const UdpReply &r : Ctx->replies) {
+		if (r.valid && (r.id == id) && ip_addr_cmp(&r.ip,&c->ip)) {
+			log_dbug(TAG,"duplicate request %u",(unsigned)id);
+			++Ctx->Dups;
+			send_reply(&r);
+			return;
+		}
+	}
+	UdpReply *r = Ctx->replies + Ctx->next;
+	if (++Ctx->next == UDPCTRL_SLOTS)
+		Ctx->next = 0;
+	if (r->size > UDPCTRL_SLOTSIZE) {
+		free(r->buf);
+		r->buf = 0;
+		r->size = 0;
+	}
+	r->len = 0;
+	r->ip = c->ip;
+	r->id = id;
+	r->framed = true;
+	r->valid = false;
+	run(cmd,cl,r);
+	r->valid = true;
+}
+
+
+static void udpctrl_worker(void *)
+{
+	for (;;) {
+		UdpCmd c;
+		if (pdTRUE != xQueueReceive(Ctx->queue,&c,portMAX_DELAY))
+			continue;
+		char ipstr[64];
+		ip2str_r(&c.ip,ipstr,sizeof(ipstr));
+		log_dbug(TAG,"%d bytes from %s:%u", c.pbuf->len, ipstr, (unsigned)c.port);
+		execute(&c);
+		if (c.pending >= 0) {
+			Lock lock(Ctx->mtx,__FUNCTION__);
+			Ctx->pending[c.pending].used = false;
+		}
+		LWIP_LOCK();
+		pbuf_free(c.pbuf);
+		LWIP_UNLOCK();
+	}
 }
 
 
 static void recv_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *ip, u16_t port)
 {
-	UdpCmd *c = new UdpCmd(p,*ip,port);
-	char name[12];
+	UdpCmd c;
+	c.pbuf = p;
+	c.ip = *ip;
+	c.port = port;
+	c.pending = -1;
 	++Ctx->Cmds;
-	snprintf(name,sizeof(name),"udpctrl%u",Ctx->Cmds);
-	BaseType_t r = xTaskCreatePinnedToCore(udpctrl_session,name,stacksize,(void*)c,8,NULL,APP_CPU_NUM);
-	if (r != pdPASS)  {
-		log_warn(TAG,"create task %s: %d",name,r);
+	uint32_t id;
+	Lock lock(Ctx->mtx,__FUNCTION__);
+	if (parse_id((const char *)p->payload,p->len,id)) {
+		for (int i = 0; i < UDPCTRL_PENDING; ++i) {
+			UdpPending &q = Ctx->pending[i];
+			if (!q.used) {
+				if (c.pending < 0)
+					c.pending = i;
+			} else if ((q.id == id) && ip_addr_cmp(&q.ip,ip)) {
+				log_dbug(TAG,"request %u is pending",(unsigned)id);
+				++Ctx->Dups;
+				pbuf_free(p);
+				return;
+			}
+		}
+	}
+	if (pdTRUE != xQueueSendToBack(Ctx->queue,&c,0)) {
+		++Ctx->Dropped;
 		pbuf_free(p);
+	} else if (c.pending >= 0) {
+		UdpPending &q = Ctx->pending[c.pending];
+		q.ip = *ip;
+		q.id = id;
+		q.used = true;
 	}
 }
 
 
-int udpc_stats(Terminal &term, int argc, const char *args[])
+const char *udpc_stats(Terminal &term, int argc, const char *args[])
 {
-	term.printf("udpctrl: %u packets\n",Ctx->Cmds);
+	if (Ctx == 0)
+		return "Not running.";
+	term.printf("udpctrl: %u packets, %u queued, %u dropped, %u duplicates, %u sent\n"
+		,Ctx->Cmds,uxQueueMessagesWaiting(Ctx->queue),Ctx->Dropped,Ctx->Dups,Ctx->Sent);
 	return 0;
 }
 
 
-
 void udpctrl_setup(void)
 {
 	uint16_t p = Config.udp_ctrl_port();
 	if (p != 0) {
 		Ctx = new UdpCtrl;
+		Ctx->queue = xQueueCreate(UDPCTRL_QUEUE,sizeof(UdpCmd));
+		Ctx->mtx = xSemaphoreCreateMutex();
+		if (pdPASS != xTaskCreatePinnedToCore(udpctrl_worker,"udpctrl",stacksize,0,8,NULL,APP_CPU_NUM)) {
+			log_warn(TAG,"cannot create worker");
+			return;
+		}
 		LWIP_LOCK();
 		Ctx->PCB = udp_new();
 		Ctx->Port = p;
@@ -0,0 +1,227 @@
+/*
+ *  Copyright (C) 2024, Thomas Maier-Komor
+ *  Host benchmark for the event name lookup of Atrium.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Registers N events and measures the cost of registration and name
+ * lookup, once with the linear strcmp scan that event_id() used before
+ * and once with the hash index of components/event/event.cpp. event.cpp
+ * depends on FreeRTOS, so the index functions are replicated here and
+ * must be kept in sync.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef uint16_t event_t;
+
+
+static vector<const char *> EventHandlers;
+static event_t *EventIdx = 0;
+static unsigned EventIdxMask = 0;
+
+
+static uint32_t event_hash(const char *n)
+{
+	// FNV-1a
+	uint32_t h = 2166136261U;
+	while (char c = *n++) {
+		h ^= (uint8_t) c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+static unsigned event_idx_slot(const char *n)
+{
+	unsigned s = event_hash(n) & EventIdxMask;
+	while (event_t e = EventIdx[s]) {
+		if (!strcmp(n,EventHandlers[e]))
+			break;
+		s = (s + 1) & EventIdxMask;
+	}
+	return s;
+}
+
+
+static void event_idx_resize(unsigned size)
+{
+	free(EventIdx);
+	EventIdx = (event_t *) calloc(size,sizeof(event_t));
+	EventIdxMask = size - 1;
+	for (size_t e = 1, n = EventHandlers.size(); e < n; ++e)
+		EventIdx[event_idx_slot(EventHandlers[e])] = (event_t) e;
+}
+
+
+static event_t hash_register(const char *name)
+{
+	unsigned s = event_idx_slot(name);
+	if (event_t e = EventIdx[s])
+		return e;
+	size_t n = EventHandlers.size();
+	EventHandlers.push_back(name);
+	if (4*n >= 3*(EventIdxMask+1))
+		event_idx_resize((EventIdxMask+1)<<1);
+	else
+		EventIdx[s] = (event_t) n;
+	return (event_t) n;
+}
+
+
+static event_t hash_id(const char *n)
+{
+	return EventIdx[event_idx_slot(n)];
+}
+
+
+static event_t scan_id(const char *n)
+{
+	for (size_t e = 1, s = EventHandlers.size(); e < s; ++e) {
+		if (!strcmp(n,EventHandlers[e]))
+			return (event_t) e;
+	}
+	return 0;
+}
+
+
+static event_t scan_register(const char *name)
+{
+	if (event_t e = scan_id(name))
+		return e;
+	EventHandlers.push_back(name);
+	return (event_t) (EventHandlers.size() - 1);
+}
+
+
+static void reset()
+{
+	EventHandlers.clear();
+	EventHandlers.push_back("<null>");
+	event_idx_resize(64);
+}
+
+
+// names similar to the ones of a node with many sensors and timefuses
+static vector<string> make_names(unsigned n)
+{
+	static const char *Cat[] = { "bme280", "timefuse", "threshold", "relay", "button", "ina219" };
+	static const char *Type[] = { "`update", "`on", "`off", "`high", "`low" };
+	vector<string> names;
+	for (unsigned i = 0; names.size() < n; ++i) {
+		char buf[64];
+		snprintf(buf,sizeof(buf),"%s%u%s",Cat[i%6],i/6,Type[i%5]);
+		names.push_back(buf);
+	}
+	return names;
+}
+
+
+template <typename F>
+static double measure(unsigned loops, F f)
+{
+	auto s = chrono::steady_clock::now();
+	for (unsigned l = 0; l < loops; ++l)
+		f();
+	auto e = chrono::steady_clock::now();
+	return chrono::duration<double,nano>(e-s).count() / loops;
+}
+
+
+static void usage()
+{
+	printf(	"usage: evbench [-l <loops>] [<N> ...]\n"
+		"-l <loops>: number of measurement loops (default 100)\n"
+		"<N>       : number of events to register (default 16 64 256 1024)\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned loops = 100;
+	int opt;
+	while ((opt = getopt(argc,argv,"hl:")) != -1) {
+		switch (opt) {
+		case 'l':
+			loops = strtoul(optarg,0,0);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	vector<unsigned> sizes;
+	for (int i = optind; i < argc; ++i)
+		sizes.push_back(strtoul(argv[i],0,0));
+	if (sizes.empty())
+		sizes = { 16, 64, 256, 1024 };
+	printf("%6s %14s %14s %14s %14s\n","events","scan reg/ns","hash reg/ns","scan id/ns","hash id/ns");
+	for (unsigned n : sizes) {
+		if ((n == 0) || (n >= UINT16_MAX)) {
+			fprintf(stderr,"evbench: invalid number of events %u\n",n);
+			return EXIT_FAILURE;
+		}
+		vector<string> names = make_names(n);
+		unsigned sum = 0;
+		double sr = measure(loops,[&]() {
+			EventHandlers.clear();
+			EventHandlers.push_back("<null>");
+			for (const string &s : names)
+				sum += scan_register(s.c_str());
+		}) / n;
+		double hr = measure(loops,[&]() {
+			reset();
+			for (const string &s : names)
+				sum += hash_register(s.c_str());
+		}) / n;
+		double si = measure(loops,[&]() {
+			for (const string &s : names)
+				sum += scan_id(s.c_str());
+		}) / n;
+		double hi = measure(loops,[&]() {
+			for (const string &s : names)
+				sum += hash_id(s.c_str());
+		}) / n;
+		for (unsigned i = 0; i < n; ++i) {
+			if ((scan_id(names[i].c_str()) != i+1) || (hash_id(names[i].c_str()) != i+1)) {
+				fprintf(stderr,"evbench: lookup mismatch for %s\n",names[i].c_str());
+				return EXIT_FAILURE;
+			}
+		}
+		if (hash_id("no`such_event") != 0) {
+			fprintf(stderr,"evbench: lookup of unknown event failed\n");
+			return EXIT_FAILURE;
+		}
+		printf("%6u %14.1f %14.1f %14.1f %14.1f\n",n,sr,hr,si,hi);
+		if (sum == 0)	// keep the compiler from optimizing the loops away
+			printf("\n");
+	}
+	return EXIT_SUCCESS;
+}
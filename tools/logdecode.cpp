@@ -0,0 +1,393 @@
+/*
+ *  Copyright (C) 2024, Thomas Maier-Komor
+ *  Tool for decoding binary log files of Atrium.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary log records are written with CONFIG_LOG_BINARY. Format strings
+ * and module names are referenced by address, so this tool needs the ELF
+ * file of the firmware that wrote the log. Record layout see
+ * components/logging/logging.c and logfmt.c.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+struct Elf
+{
+	vector<uint8_t> data;
+	uint32_t modnames = 0, modnameoff = 0;
+
+	const uint8_t *at(uint32_t addr, size_t s) const;
+	const char *str(uint32_t addr) const;
+	string module(unsigned m) const;
+};
+
+
+static Elf *Firmware = 0;
+
+
+static void fatal(const char *f, ...)
+{
+	va_list val;
+	va_start(val,f);
+	fprintf(stderr,"logdecode: ");
+	vfprintf(stderr,f,val);
+	fputc('\n',stderr);
+	va_end(val);
+	exit(EXIT_FAILURE);
+}
+
+
+static bool read_file(const char *fn, vector<uint8_t> &d)
+{
+	FILE *f = fopen(fn,"rb");
+	if (f == 0)
+		return false;
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf,1,sizeof(buf),f)) > 0)
+		d.insert(d.end(),buf,buf+n);
+	fclose(f);
+	return true;
+}
+
+
+// returns the file data at virtual address addr
+const uint8_t *Elf::at(uint32_t addr, size_t s) const
+{
+	const Elf32_Ehdr *eh = (const Elf32_Ehdr *) data.data();
+	for (unsigned i = 0; i < eh->e_shnum; ++i) {
+		const Elf32_Shdr *sh = (const Elf32_Shdr *) (data.data() + eh->e_shoff + i * eh->e_shentsize);
+		if (((sh->sh_flags & SHF_ALLOC) == 0) || (sh->sh_type == SHT_NOBITS))
+			continue;
+		if ((addr >= sh->sh_addr) && (addr + s <= sh->sh_addr + sh->sh_size)
+			&& (sh->sh_offset + sh->sh_size <= data.size()))
+			return data.data() + sh->sh_offset + (addr - sh->sh_addr);
+	}
+	return 0;
+}
+
+
+const char *Elf::str(uint32_t addr) const
+{
+	const char *s = (const char *) at(addr,1);
+	if (s && memchr(s,0,data.data()+data.size()-(const uint8_t*)s))
+		return s;
+	return 0;
+}
+
+
+string Elf::module(unsigned m) const
+{
+	const uint8_t *o = at(modnameoff+m*2,2);
+	if (o == 0)
+		return "<mod" + to_string(m) + ">";
+	const char *n = str(modnames+(o[0]|(o[1]<<8)));
+	return n ? n : "<mod" + to_string(m) + ">";
+}
+
+
+static Elf *load_elf(const char *fn)
+{
+	Elf *e = new Elf;
+	if (!read_file(fn,e->data))
+		fatal("unable to read %s: %s",fn,strerror(errno));
+	const Elf32_Ehdr *eh = (const Elf32_Ehdr *) e->data.data();
+	if ((e->data.size() < sizeof(Elf32_Ehdr)) || memcmp(eh->e_ident,ELFMAG,SELFMAG) || (eh->e_ident[EI_CLASS] != ELFCLASS32))
+		fatal("%s is not a 32-bit ELF file",fn);
+	if (eh->e_shoff + eh->e_shnum * eh->e_shentsize > e->data.size())
+		fatal("%s: invalid section headers",fn);
+	for (unsigned i = 0; i < eh->e_shnum; ++i) {
+		const Elf32_Shdr *sh = (const Elf32_Shdr *) (e->data.data() + eh->e_shoff + i * eh->e_shentsize);
+		if (sh->sh_type != SHT_SYMTAB)
+			continue;
+		const Elf32_Shdr *strsh = (const Elf32_Shdr *) (e->data.data() + eh->e_shoff + sh->sh_link * eh->e_shentsize);
+		const char *strtab = (const char *) e->data.data() + strsh->sh_offset;
+		for (size_t o = 0; o + sizeof(Elf32_Sym) <= sh->sh_size; o += sizeof(Elf32_Sym)) {
+			const Elf32_Sym *sym = (const Elf32_Sym *) (e->data.data() + sh->sh_offset + o);
+			const char *n = strtab + sym->st_name;
+			if (0 == strcmp(n,"ModNames"))
+				e->modnames = sym->st_value;
+			else if (0 == strcmp(n,"ModNameOff"))
+				e->modnameoff = sym->st_value;
+		}
+	}
+	if ((e->modnames == 0) || (e->modnameoff == 0))
+		fatal("%s: symbols ModNames and ModNameOff not found",fn);
+	return e;
+}
+
+
+static bool get_varint(const uint8_t *&a, const uint8_t *e, uint64_t &v)
+{
+	v = 0;
+	unsigned s = 0;
+	while ((a != e) && (s < 64)) {
+		uint8_t b = *a++;
+		v |= (uint64_t)(b & 0x7f) << s;
+		if ((b & 0x80) == 0)
+			return true;
+		s += 7;
+	}
+	return false;
+}
+
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+
+static void append(string &out, const char *f, ...)
+{
+	char buf[512];
+	va_list val;
+	va_start(val,f);
+	int n = vsnprintf(buf,sizeof(buf),f,val);
+	va_end(val);
+	if (n > 0)
+		out.append(buf,n < (int)sizeof(buf) ? n : sizeof(buf)-1);
+}
+
+
+// decodes a record body, type sizes are those of the 32-bit target
+static string decode_body(const uint8_t *a, const uint8_t *e)
+{
+	uint64_t id;
+	if (!get_varint(a,e,id))
+		return "<invalid record>";
+	if (id == 0)
+		return string((const char *)a,e-a);
+	if (Firmware == 0)
+		return "<ELF file needed>";
+	const char *f = Firmware->str(Firmware->modnames + unzigzag(id-1));
+	if (f == 0)
+		return "<unknown format>";
+	string out;
+	while (*f) {
+		if (*f != '%') {
+			out += *f++;
+			continue;
+		}
+		if (f[1] == '%') {
+			out += '%';
+			f += 2;
+			continue;
+		}
+		string spec(1,*f++);
+		int st[2], ns = 0;
+		while (*f && strchr("-+ #0",*f))
+			spec += *f++;
+		if (*f == '*') {
+			uint64_t v;
+			if (!get_varint(a,e,v))
+				return out + "<truncated>";
+			st[ns++] = unzigzag(v);
+			spec += *f++;
+		} else {
+			while ((*f >= '0') && (*f <= '9'))
+				spec += *f++;
+		}
+		if (*f == '.') {
+			spec += *f++;
+			if (*f == '*') {
+				uint64_t v;
+				if (!get_varint(a,e,v))
+					return out + "<truncated>";
+				st[ns++] = unzigzag(v);
+				spec += *f++;
+			} else {
+				while ((*f >= '0') && (*f <= '9'))
+					spec += *f++;
+			}
+		}
+		bool wide = false;
+		while (*f && strchr("hlzjt",*f)) {
+			if ((f[0] == 'l') && (f[1] == 'l')) {
+				wide = true;
+				++f;
+			} else if (*f == 'j') {
+				wide = true;
+			}
+			++f;
+		}
+		char c = *f;
+		if (c == 0)
+			break;
+		++f;
+		string fs = spec;
+		uint64_t v;
+		switch (c) {
+		case 'd': case 'i': case 'c':
+		case 'u': case 'x': case 'X': case 'o':
+			if (!get_varint(a,e,v))
+				return out + "<truncated>";
+			if ((c == 'd') || (c == 'i') || (c == 'c'))
+				v = unzigzag(v);
+			if (wide) {
+				fs += "ll";
+				fs += c;
+				if (ns == 2)
+					append(out,fs.c_str(),st[0],st[1],(long long)v);
+				else if (ns == 1)
+					append(out,fs.c_str(),st[0],(long long)v);
+				else
+					append(out,fs.c_str(),(long long)v);
+			} else {
+				fs += c;
+				if (ns == 2)
+					append(out,fs.c_str(),st[0],st[1],(int)v);
+				else if (ns == 1)
+					append(out,fs.c_str(),st[0],(int)v);
+				else
+					append(out,fs.c_str(),(int)v);
+			}
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			{
+				double d;
+				if (a + sizeof(d) > e)
+					return out + "<truncated>";
+				memcpy(&d,a,sizeof(d));
+				a += sizeof(d);
+				fs += c;
+				if (ns == 2)
+					append(out,fs.c_str(),st[0],st[1],d);
+				else if (ns == 1)
+					append(out,fs.c_str(),st[0],d);
+				else
+					append(out,fs.c_str(),d);
+			}
+			break;
+		case 'p':
+			if (!get_varint(a,e,v))
+				return out + "<truncated>";
+			append(out,"0x%x",(unsigned)v);
+			break;
+		case 's':
+			{
+				if (!get_varint(a,e,v) || (a + v > e))
+					return out + "<truncated>";
+				string s((const char *)a,v);
+				a += v;
+				// the precision has been applied on the target
+				size_t dot = fs.find('.');
+				bool pstar = (dot != string::npos) && (fs.find('*',dot) != string::npos);
+				if (dot != string::npos)
+					fs.erase(dot);
+				fs += 's';
+				if (ns - pstar == 1)
+					append(out,fs.c_str(),st[0],s.c_str());
+				else
+					append(out,fs.c_str(),s.c_str());
+			}
+			break;
+		default:
+			return out + "<unsupported format>";
+		}
+	}
+	return out;
+}
+
+
+static void usage()
+{
+	printf(	"logdecode [-e <elf-file>] <log-file>\n"
+		"decodes binary log files written with CONFIG_LOG_BINARY\n"
+		"-e <elf-file>: firmware that has written the log file\n"
+		"-u           : print times in UTC instead of local time\n"
+		);
+}
+
+
+int main(int argc, char **argv)
+{
+	bool utc = false;
+	int opt;
+	while ((opt = getopt(argc,argv,"e:hu")) != -1) {
+		switch (opt) {
+		case 'e':
+			Firmware = load_elf(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'u':
+			utc = true;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	vector<uint8_t> log;
+	if (!read_file(argv[optind],log))
+		fatal("unable to read %s: %s",argv[optind],strerror(errno));
+	const uint8_t *a = log.data(), *e = log.data() + log.size();
+	uint64_t base = 0;
+	while (a != e) {
+		uint64_t rl;
+		if (!get_varint(a,e,rl) || (rl < 6) || (a + rl > e))
+			fatal("truncated record at offset %lu",(unsigned long)(a - log.data()));
+		const uint8_t *r = a, *re = a + rl;
+		a = re;
+		uint8_t flags = r[0];
+		unsigned mod = r[1];
+		uint32_t ts = r[2] | (r[3] << 8) | (r[4] << 16) | ((uint32_t)r[5] << 24);
+		r += 6;
+		if ((flags & 7) == 7) {
+			base = 0;
+			for (int i = 0; (i < 8) && (r + i < re); ++i)
+				base |= (uint64_t)r[i] << (i << 3);
+			continue;
+		}
+		char tstr[64];
+		if (flags & 8) {
+			time_t t = base + ts / 1000;
+			struct tm tm;
+			if (utc)
+				gmtime_r(&t,&tm);
+			else
+				localtime_r(&t,&tm);
+			size_t n = strftime(tstr,sizeof(tstr),"%Y-%m-%d %H:%M:%S",&tm);
+			snprintf(tstr+n,sizeof(tstr)-n,".%03u",ts%1000);
+		} else {
+			snprintf(tstr,sizeof(tstr),"(%u.%03u)",ts/1000,ts%1000);
+		}
+		string m = Firmware ? Firmware->module(mod) : to_string(mod);
+		printf("%c %s %s: %s\n","EWIDL???"[flags&7],tstr,m.c_str(),decode_body(r,re).c_str());
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,254 @@
+/*
+ *  Copyright (C) 2024, Thomas Maier-Komor
+ *  Host benchmark for the Influx RTData line formatting of Atrium.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the per cycle cost of the RTData line of send_rtdata() for
+ * trees of 10, 100 and 1000 fields: once as the tree walk did before
+ * the field plan (object and element name per field, snprintf with the
+ * format of the number, space stripping), and once with the field plan
+ * of main/influx.cpp (pre-rendered keys, fixed_to_str). The tree walk
+ * depends on FreeRTOS, so both paths are modelled here, while
+ * fixed_to_str and fmt_precision are taken from components/streams.
+ *
+ * Before measuring, fixed_to_str is checked against printf for random
+ * values with the formats used by EnvNumber.
+ */
+
+#include "stream.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+struct Number
+{
+	string obj, name, fmt;
+	float value;
+	int prec;
+};
+
+
+struct Field
+{
+	const Number *num;
+	uint16_t key, klen;
+};
+
+
+static vector<Number> make_tree(unsigned n, mt19937 &rng)
+{
+	static const char *Fmt[] = { "%4.1f", "%4.0f", "%4.2f", "%f", "%5.3f" };
+	uniform_real_distribution<float> d(-1000,1000);
+	vector<Number> tree;
+	for (unsigned i = 0; i < n; ++i) {
+		Number x;
+		x.obj = "sensor" + to_string(i/4);
+		x.name = (i & 1) ? "humidity" : "temperature";
+		x.name += to_string(i%4);
+		x.fmt = Fmt[i%5];
+		x.value = d(rng);
+		x.prec = fmt_precision(x.fmt.c_str());
+		tree.push_back(x);
+	}
+	return tree;
+}
+
+
+// line as written by walking the tree
+static size_t walk_line(char *out, const vector<Number> &tree)
+{
+	char *at = out;
+	char sep = ' ';
+	for (const Number &x : tree) {
+		*at++ = sep;
+		memcpy(at,x.obj.c_str(),x.obj.size());
+		at += x.obj.size();
+		*at++ = '_';
+		memcpy(at,x.name.c_str(),x.name.size());
+		at += x.name.size();
+		*at++ = '=';
+		char buf[32];
+		int n = snprintf(buf,sizeof(buf),x.fmt.c_str(),x.value);
+		for (int i = 0; i < n; ++i) {
+			if (buf[i] != ' ')
+				*at++ = buf[i];
+		}
+		sep = ',';
+	}
+	return at - out;
+}
+
+
+static void plan_build(const vector<Number> &tree, vector<Field> &fields, string &keys)
+{
+	fields.clear();
+	keys.clear();
+	for (const Number &x : tree) {
+		Field f;
+		f.num = &x;
+		f.key = keys.size();
+		keys += x.obj;
+		keys += '_';
+		keys += x.name;
+		keys += '=';
+		f.klen = keys.size() - f.key;
+		fields.push_back(f);
+	}
+}
+
+
+// line as written with the field plan
+static size_t plan_line(char *out, const vector<Field> &fields, const string &keys)
+{
+	char *at = out;
+	char sep = ' ';
+	const char *k = keys.data();
+	for (const Field &f : fields) {
+		*at++ = sep;
+		memcpy(at,k+f.key,f.klen);
+		at += f.klen;
+		char *e = 0;
+		if (f.num->prec >= 0)
+			e = fixed_to_str(at,f.num->value,f.num->prec);
+		if (e) {
+			at = e;
+		} else {
+			int n = sprintf(at,f.num->fmt.c_str(),f.num->value);
+			at += n;
+		}
+		sep = ',';
+	}
+	return at - out;
+}
+
+
+static bool check_format(unsigned num, mt19937 &rng)
+{
+	static const char *Fmt[] = { "%.0f", "%.1f", "%.3f", "%.4f", "%f" };
+	uniform_real_distribution<float> mag(-8,8);
+	uniform_real_distribution<float> one(-1,1);
+	for (const char *f : Fmt) {
+		int p = fmt_precision(f);
+		for (unsigned i = 0; i < num; ++i) {
+			float v = one(rng) * powf(10,mag(rng));
+			char a[64], b[64];
+			snprintf(a,sizeof(a),f,v);
+			if (0 == fixed_to_str(b,v,p)) {
+				fprintf(stderr,"rtdbench: fixed_to_str(%g,%d) failed\n",v,p);
+				return false;
+			}
+			if (strcmp(a,b)) {
+				fprintf(stderr,"rtdbench: %s of %.9g: printf %s, fixed_to_str %s\n",f,v,a,b);
+				return false;
+			}
+		}
+		printf("%-5s: %u values identical to printf\n",f,num);
+	}
+	return true;
+}
+
+
+template <typename F>
+static double measure(unsigned loops, F f)
+{
+	auto s = chrono::steady_clock::now();
+	for (unsigned l = 0; l < loops; ++l)
+		f();
+	auto e = chrono::steady_clock::now();
+	return chrono::duration<double,micro>(e-s).count() / loops;
+}
+
+
+static void usage()
+{
+	printf(	"usage: rtdbench [-c <values>] [-l <loops>] [<fields> ...]\n"
+		"-c <values>: values per format for the printf check (default 1000000)\n"
+		"-l <loops> : number of measured cycles (default 1000)\n"
+		"<fields>   : tree sizes (default 10 100 1000)\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned loops = 1000, check = 1000000;
+	int opt;
+	while ((opt = getopt(argc,argv,"c:hl:")) != -1) {
+		switch (opt) {
+		case 'c':
+			check = strtoul(optarg,0,0);
+			break;
+		case 'l':
+			loops = strtoul(optarg,0,0);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	vector<unsigned> sizes;
+	for (int i = optind; i < argc; ++i)
+		sizes.push_back(strtoul(argv[i],0,0));
+	if (sizes.empty())
+		sizes = { 10, 100, 1000 };
+	mt19937 rng(1);
+	if (!check_format(check,rng))
+		return EXIT_FAILURE;
+	printf("%6s %12s %12s %12s\n","fields","walk/us","plan/us","build/us");
+	for (unsigned n : sizes) {
+		vector<Number> tree = make_tree(n,rng);
+		vector<char> out(n * 64 + 1);
+		vector<Field> fields;
+		string keys;
+		size_t sum = 0;
+		double w = measure(loops,[&]() {
+			sum += walk_line(out.data(),tree);
+		});
+		double b = measure(loops,[&]() {
+			plan_build(tree,fields,keys);
+		});
+		double p = measure(loops,[&]() {
+			sum += plan_line(out.data(),fields,keys);
+		});
+		// both paths must produce the same line
+		size_t l0 = walk_line(out.data(),tree);
+		string s0(out.data(),l0);
+		size_t l1 = plan_line(out.data(),fields,keys);
+		if (s0 != string(out.data(),l1)) {
+			fprintf(stderr,"rtdbench: lines differ for %u fields\n",n);
+			return EXIT_FAILURE;
+		}
+		printf("%6u %12.2f %12.2f %12.2f\n",n,w,p,b);
+		if (sum == 0)	// keep the compiler from optimizing the loops away
+			printf("\n");
+	}
+	return EXIT_SUCCESS;
+}